@@ -76,6 +76,8 @@ struct shm_queue
 	time32_t fifo_times[SQ_MAX_READER_PROC_NUM]; // fifo creation timestamps
 	uint64_t shm_key;
 	uint64_t rw_conflict_time; // time duration when conflict occurs
+	int peek_head, peek_next; // head_pos before and after the element returned by sq_peek()
+	int peek_len; // length of the element returned by sq_peek(), 0 if none or released
 	int shm_id;
 	char errmsg[256];
 };
@@ -214,6 +216,12 @@ int sq_get_shmid(struct shm_queue *sq)
 	return sq->shm_id;
 }
 
+int sq_get_sig_ele_num(struct shm_queue *sq)
+{
+	if (sq == NULL || sq->head == NULL) return 0;
+	return sq->head->sig_node_num;
+}
+
 
 static inline void verify_and_remove_bad_pids(struct sq_head_t *sq)
 {
@@ -634,6 +642,12 @@ struct shm_queue *sq_open_by_shmid(int shm_id)
 		snprintf(errmsg, sizeof(errmsg), "Open shm failed: %s", strerror(errno));
 		return NULL;
 	}
+#ifdef __linux__
+	// the key names the fifo of events, it must be the one the writer created the queue with
+	struct shmid_ds ds;
+	if(shmctl(shm_id, IPC_STAT, &ds)==0)
+		queue->shm_key = (u64_t)(uint32_t)ds.shm_perm.__key;
+#endif
 	return queue;
 }
 
@@ -641,6 +655,8 @@ struct shm_queue *sq_open_by_shmid(int shm_id)
 // Destroy shm_queue created by sq_create()
 void sq_destroy(struct shm_queue *queue)
 {
+	if(queue->poll_fd>0)
+		close(queue->poll_fd);
 	shmdt(queue->head);
 	free(queue);
 }
@@ -648,6 +664,8 @@ void sq_destroy(struct shm_queue *queue)
 // Destroy shm_queue and remove shm
 void sq_destroy_and_remove(struct shm_queue *queue)
 {
+	if(queue->poll_fd>0)
+		close(queue->poll_fd);
 	shmdt(queue->head);
 	shmctl(queue->shm_id, IPC_RMID, 0);
 	free(queue);
@@ -803,45 +821,26 @@ int sq_get_used_blocks(struct shm_queue *sq)
 	return SQ_USED_NODES(queue);
 }
 
-// Retrieve data
-// On success, buf is filled with the first queue data
-// Returns the data length or
-//     0  - no data in queue
-//     -1 - invalid parameter
-int sq_get(struct shm_queue *sq, void *buf, int buf_sz, struct timeval *enqueue_time)
+// Find the first element from head_pos for sq_get() and sq_peek(), skipping corrupted nodes
+// Returns the node with *head set to its position and *old_head to the head_pos it is found from,
+// or NULL if there is none, in which case *head is the end of the nodes skipped
+static struct sq_node_head_t *sq_first_node(struct shm_queue *sq, int *old_head, int *head)
 {
 	struct sq_node_head_t *node;
-
-	int nr_nodes, datalen;
-	int old_head, new_head, head;
 	struct sq_head_t *queue = sq->head;
-
-	if(queue==NULL || buf==NULL || buf_sz<1)
-	{
-		snprintf(sq->errmsg, sizeof(sq->errmsg), "Bad argument");
-		return -1;
-	}
+	int nr_nodes;
 
 	rmb();
-	head = old_head = queue->head_pos;
+	*head = *old_head = queue->head_pos;
 	do
 	{
-		if(queue->tail_pos==head) // end of queue
+		if(queue->tail_pos==*head) // end of queue
 		{
-			if(head!=old_head && CAS32(&queue->head_pos, old_head, head))
-			{
-				fprintf(stderr, "shmqueue empty after skipping!!\n");
-				wmb();
-				new_head = head;
-				datalen = 0;
-				break;
-			}
-			// head_pos not advanced or changed by someone else, simply returns
 			sq->rw_conflict_time = 0;
-			return 0;
+			return NULL;
 		}
 
-		node = SQ_GET(queue, head);
+		node = SQ_GET(queue, *head);
 		if(node->start_token!=TOKEN_HAS_DATA) // read-write conflict or corruption of data
 		{
 			// if read-write conflict happens, we (the reader) will
@@ -862,15 +861,16 @@ int sq_get(struct shm_queue *sq, void *buf, int buf_sz, struct timeval *enqueue_
 					// this node may have been read by some other process,
 					// if so, the header position should have been updated
 					rmb();
-					if(old_head!=queue->head_pos)
+					if(*old_head!=queue->head_pos)
 					{
 						fprintf(stderr, "shmqueue read by others!!\n");
 						// read by others, start all over again
 						sq->rw_conflict_time = 0;
-						head = old_head = queue->head_pos;
+						*head = *old_head = queue->head_pos;
 						continue;
 					}
-					return 0; // returns no data
+					*head = *old_head; // no data, the nodes skipped are skipped again next time
+					return NULL;
 				}
 			}
 			// check start_token once again in case the writer may have already finished writting for now
@@ -883,23 +883,86 @@ int sq_get(struct shm_queue *sq, void *buf, int buf_sz, struct timeval *enqueue_
 					fprintf(stderr, "shmqueue data corrupted: unrecovered conflict!!\n");
 				sq->rw_conflict_time = 0;
 				// treat it as data corruption and skip this corrupted node
-				head = SQ_ADD_POS(queue, head, 1);
+				*head = SQ_ADD_POS(queue, *head, 1);
 				continue;
 			}
 		}
-		datalen = node->datalen;
-		nr_nodes = SQ_NUM_NEEDED_NODES(queue, datalen);
-		if(SQ_USED_NODES2(queue, head) < nr_nodes)
+		nr_nodes = SQ_NUM_NEEDED_NODES(queue, node->datalen);
+		if(SQ_USED_NODES2(queue, *head) < nr_nodes)
 		{
 			fprintf(stderr, "shmqueue data corrupted: invalid length metadata!!\n");
 			sq->rw_conflict_time = 0;
-			head = SQ_ADD_POS(queue, head, 1);
+			*head = SQ_ADD_POS(queue, *head, 1);
 			continue;
 		}
+		return node;
+	} while(1);
+}
+
+// Move head_pos from old_head to new_head, giving the nodes between back to the writers
+// Returns 0 on success, or -1 if head_pos has been changed by someone else
+static int sq_remove_nodes(struct shm_queue *sq, int old_head, int new_head)
+{
+	struct sq_node_head_t *node;
+	struct sq_head_t *queue = sq->head;
+
+	if(!CAS32(&queue->head_pos, old_head, new_head))
+		return -1;
+	wmb();
+
+	// FIXME: read-write conflict alert
+	//   writting after CAS is dangerous, because semeone may be just writing to the same node,
+	//   causing data to be currupted.
+	//   the only solution for now is to reserve enough space at the writing end, the developer
+	//   is responsible for keeping RESERVE_BLOCK_COUNT*ele_size > MAX_SQ_DATA_LENGTH
+	while(old_head!=new_head)
+	{
+		node = SQ_GET(queue, old_head);
+		// reset start_token so that this node will not be treated as a starting node of data
+		node->start_token = TOKEN_NO_DATA;
+		old_head = SQ_ADD_POS(queue, old_head, 1);
+	}
+
+	wmb();
+	sq->rw_conflict_time = 0;
+	return 0;
+}
+
+// Retrieve data
+// On success, buf is filled with the first queue data
+// this function is multi-thread/multi-process safe
+// Returns the data length or
+//     0  - no data in queue
+//     -1 - invalid parameter
+int sq_get(struct shm_queue *sq, void *buf, int buf_sz, struct timeval *enqueue_time)
+{
+	struct sq_node_head_t *node;
+
+	int datalen;
+	int old_head, head;
+	struct sq_head_t *queue = sq->head;
+
+	if(queue==NULL || buf==NULL || buf_sz<1)
+	{
+		snprintf(sq->errmsg, sizeof(sq->errmsg), "Bad argument");
+		return -1;
+	}
+
+	do
+	{
+		node = sq_first_node(sq, &old_head, &head);
+		if(node==NULL)
+		{
+			if(head!=old_head && sq_remove_nodes(sq, old_head, head)==0)
+				fprintf(stderr, "shmqueue empty after skipping!!\n");
+			// head_pos not advanced or changed by someone else, simply returns
+			return 0;
+		}
 
 		// read data from queue
 		// must be done before CAS operation, so that when CAS finishes,
 		// some one else may safely write to it.
+		datalen = node->datalen;
 		if(enqueue_time)
 		{
 			enqueue_time->tv_sec = node->enqueue_time.tv_sec;
@@ -913,36 +976,60 @@ int sq_get(struct shm_queue *sq, void *buf, int buf_sz, struct timeval *enqueue_
 			return -2;
 		}
 		memcpy(buf, node->data, datalen);
+	} // head_pos changed by someone else, start over
+	while(sq_remove_nodes(sq, old_head, SQ_ADD_POS(queue, head, SQ_NUM_NEEDED_NODES(queue, datalen))));
 
-		new_head = SQ_ADD_POS(queue, head, nr_nodes);
-		if(CAS32(&queue->head_pos, old_head, new_head))
-		{
-			wmb();
-			break;
-		}
-		else // head_pos changed by someone else, start over
-		{
-			old_head = queue->head_pos;
-			head = old_head;
-		}
-	} while(1);
+	return datalen;
+}
 
-	// FIXME: read-write conflict alert
-	//   writting after CAS is dangerous, because semeone may be just writing to the same node,
-	//   causing data to be currupted.
-	//   the only solution for now is to reserve enough space at the writing end, the developer
-	//   is responsible for keeping RESERVE_BLOCK_COUNT*ele_size > MAX_SQ_DATA_LENGTH
-	while(old_head!=new_head)
+// Retrieve data in place, see shm_queue.h
+int sq_peek(struct shm_queue *sq, void **data, struct timeval *enqueue_time)
+{
+	struct sq_node_head_t *node;
+	int old_head, head;
+	struct sq_head_t *queue = sq->head;
+
+	if(queue==NULL || data==NULL)
 	{
-		node = SQ_GET(queue, old_head);
-		// reset start_token so that this node will not be treated as a starting node of data
-		node->start_token = TOKEN_NO_DATA;
-		old_head = SQ_ADD_POS(queue, old_head, 1);
+		snprintf(sq->errmsg, sizeof(sq->errmsg), "Bad argument");
+		return -1;
 	}
 
-	wmb();
-	sq->rw_conflict_time = 0;
-	return datalen;
+	sq->peek_len = 0;
+	node = sq_first_node(sq, &old_head, &head);
+	if(node==NULL)
+	{
+		if(head!=old_head && sq_remove_nodes(sq, old_head, head)==0)
+			fprintf(stderr, "shmqueue empty after skipping!!\n");
+		return 0;
+	}
+	if(enqueue_time)
+	{
+		enqueue_time->tv_sec = node->enqueue_time.tv_sec;
+		enqueue_time->tv_usec = node->enqueue_time.tv_usec;
+	}
+	// head_pos stays before the element until sq_release(), so that the writers leave it alone
+	sq->peek_head = old_head;
+	sq->peek_next = SQ_ADD_POS(queue, head, SQ_NUM_NEEDED_NODES(queue, node->datalen));
+	sq->peek_len = node->datalen;
+	*data = node->data;
+	return sq->peek_len;
+}
+
+int sq_release(struct shm_queue *sq)
+{
+	if(sq->head==NULL || sq->peek_len==0)
+	{
+		snprintf(sq->errmsg, sizeof(sq->errmsg), "Bad argument: no data peeked");
+		return -1;
+	}
+	sq->peek_len = 0;
+	if(sq_remove_nodes(sq, sq->peek_head, sq->peek_next))
+	{
+		snprintf(sq->errmsg, sizeof(sq->errmsg), "Data peeked has been read by others");
+		return -1;
+	}
+	return 0;
 }
 
 // Add data to end of shm queue, wait as long as time_ms if queue is full
@@ -73,6 +73,9 @@ struct shm_queue *sq_open(u64_t shm_key);
 int sq_get_shmid(struct shm_queue *sq);
 struct shm_queue *sq_open_by_shmid(int shm_id);
 
+// Returns sig_ele_num of sq_create(), readers are only signaled if it is > 0
+int sq_get_sig_ele_num(struct shm_queue *sq);
+
 
 // Register the current process ID, so that it will be able to recived event by
 // polling the returned event_fd.
@@ -130,6 +133,21 @@ int sq_put_wait(struct shm_queue *sq, void *data, int datalen, long long time_ms
 //     -1 - invalid parameter
 int sq_get(struct shm_queue *queue, void *buf, int buf_sz, struct timeval *enqueue_time);
 
+// Retrieve data in place, without copying it out of shm
+// On success, *data points to the first queue data in shm, which stays there until
+// sq_release() is called, calling sq_peek() again before that returns the same data.
+// The writers do not overwrite the data meanwhile, so do not hold it longer than
+// needed, the queue fills up behind it.
+// this function is for a queue with one reader, other readers may read the same data
+// Returns the data length or
+//      0 - no data in queue
+//     -1 - invalid parameter
+int sq_peek(struct shm_queue *queue, void **data, struct timeval *enqueue_time);
+
+// Remove the data returned by sq_peek() from the queue, the pointer becomes invalid
+// Returns 0 on success, or -1 if nothing is peeked or the data has been read by others
+int sq_release(struct shm_queue *queue);
+
 // Get usage rate
 // Returns a number from 0 to 99
 int sq_get_usage(struct shm_queue *queue);
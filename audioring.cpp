@@ -0,0 +1,140 @@
+#include <string.h>
+#include <atomic>
+#include <algorithm>
+#include "audioring.h"
+
+static std::atomic<uint64_t> ring_count(0), ring_bytes(0), ring_peak(0), ring_capacity(0), ring_dropped(0);
+
+AudioRingStats audio_ring_stats()
+{
+    AudioRingStats s;
+    s.rings = ring_count;
+    s.bytes = ring_bytes;
+    s.peak_bytes = ring_peak;
+    s.capacity = ring_capacity;
+    s.dropped_bytes = ring_dropped;
+    return s;
+}
+
+AudioRing::~AudioRing()
+{
+    Release();
+}
+
+void AudioRing::Release()
+{
+    Clear();
+    if (buf.size())
+    {
+        ring_count --;
+        ring_capacity -= buf.size();
+    }
+    std::vector<unsigned char>().swap(buf);
+    head = 0;
+}
+
+// move the bytes to the start of a buffer of size
+void AudioRing::Resize(size_t size)
+{
+    std::vector<unsigned char> b(size);
+    const unsigned char *span[2];
+    size_t len[2];
+    int spans = ReadSpans(count, span, len);
+    if (spans > 0)
+        memcpy(b.data(), span[0], len[0]);
+    if (spans > 1)
+        memcpy(b.data() + len[0], span[1], len[1]);
+    head = 0;
+    if (buf.empty())
+        ring_count ++;
+    ring_capacity += size - buf.size();
+    buf.swap(b);
+}
+
+bool AudioRing::Reserve(size_t n)
+{
+    if (count + n <= buf.size())
+        return true;
+    if (count + n > max_size)
+        return false;
+    size_t size = buf.size()? buf.size() : 64*1024;
+    while (size < count + n)
+        size <<= 1;
+    Resize(size);
+    return true;
+}
+
+int AudioRing::WriteSpans(size_t n, unsigned char *span[2], size_t len[2])
+{
+    if (!Reserve(n)) // full, drop the stale audio rather than the latest
+    {
+        ring_dropped += count;
+        Clear();
+        if (!Reserve(n))
+            return 0;
+    }
+    size_t tail = (head + count) & (buf.size() - 1);
+    span[0] = buf.data() + tail;
+    len[0] = std::min(n, buf.size() - tail);
+    span[1] = buf.data();
+    len[1] = n - len[0];
+    return len[1]? 2 : 1;
+}
+
+void AudioRing::Commit(size_t n)
+{
+    count += n;
+    ring_bytes += n;
+    uint64_t peak = ring_peak;
+    while (count > peak && !ring_peak.compare_exchange_weak(peak, count))
+        ;
+}
+
+void AudioRing::Write(const void *data, size_t n)
+{
+    unsigned char *span[2];
+    size_t len[2];
+    int spans = n? WriteSpans(n, span, len) : 0;
+    if (spans == 0)
+        return;
+    memcpy(span[0], data, len[0]);
+    if (spans > 1)
+        memcpy(span[1], (const unsigned char *)data + len[0], len[1]);
+    Commit(n);
+}
+
+int AudioRing::ReadSpans(size_t n, const unsigned char *span[2], size_t len[2]) const
+{
+    n = std::min(n, count);
+    if (n == 0)
+        return 0;
+    span[0] = buf.data() + head;
+    len[0] = std::min(n, buf.size() - head);
+    span[1] = buf.data();
+    len[1] = n - len[0];
+    return len[1]? 2 : 1;
+}
+
+size_t AudioRing::Read(unsigned char *dst, size_t n)
+{
+    const unsigned char *span[2];
+    size_t len[2];
+    int spans = ReadSpans(n, span, len);
+    if (spans == 0)
+        return 0;
+    memcpy(dst, span[0], len[0]);
+    if (spans > 1)
+        memcpy(dst + len[0], span[1], len[1]);
+    Consume(len[0] + len[1]);
+    return len[0] + len[1];
+}
+
+void AudioRing::Consume(size_t n)
+{
+    n = std::min(n, count);
+    if (n == 0)
+        return;
+    count -= n;
+    ring_bytes -= n;
+    head = count? (head + n) & (buf.size() - 1) : 0;
+}
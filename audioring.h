@@ -0,0 +1,63 @@
+//
+// pcm buffered by readers between the demuxer and read_audio_data()
+//
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// occupancy of all rings, for a/v sync diagnostics
+struct AudioRingStats
+{
+    uint64_t rings;         // rings holding memory
+    uint64_t bytes;         // bytes buffered in all rings now
+    uint64_t peak_bytes;    // most bytes buffered by one ring since start
+    uint64_t capacity;      // bytes allocated by all rings
+    uint64_t dropped_bytes; // bytes dropped because a ring was full
+};
+
+// Bytes of a power of two size, grown by doubling up to max_size (a power of two). The oldest
+// bytes are read in place as up to two spans, instead of moving the remaining bytes to the front
+// of a vector after every read. Not thread safe, it is used by the thread reading its FFReader.
+class AudioRing
+{
+public:
+    explicit AudioRing(size_t max_size = 16*1024*1024) : head(0), count(0), max_size(max_size) {}
+    ~AudioRing();
+    AudioRing(const AudioRing &) = delete;
+    AudioRing &operator=(const AudioRing &) = delete;
+
+    int Size() const { return (int)count; }
+    size_t Capacity() const { return buf.size(); }
+    // drop all bytes, keep the memory
+    void Clear() { Consume(count); }
+    // drop all bytes and release the memory
+    void Release();
+    // make room for n more bytes, return false if it would exceed max_size
+    bool Reserve(size_t n);
+
+    size_t MaxSize() const { return max_size; }
+
+    // Writable spans for n bytes after the last one, return the number of spans (0 if n is over
+    // max_size), the bytes become readable by Commit(). If they do not fit under max_size,
+    // everything buffered is dropped first, the latest audio is kept rather than the stale one
+    int WriteSpans(size_t n, unsigned char *span[2], size_t len[2]);
+    void Commit(size_t n);
+    // append n bytes, see WriteSpans()
+    void Write(const void *data, size_t n);
+
+    // the oldest n bytes (at most Size()) as up to two spans, return the number of spans
+    int ReadSpans(size_t n, const unsigned char *span[2], size_t len[2]) const;
+    // move the oldest n bytes (at most Size()) to dst, return the number of bytes
+    size_t Read(unsigned char *dst, size_t n);
+    // drop the oldest n bytes
+    void Consume(size_t n);
+
+private:
+    void Resize(size_t size);
+
+    std::vector<unsigned char> buf;
+    size_t head, count, max_size;
+};
+
+AudioRingStats audio_ring_stats();
@@ -0,0 +1,84 @@
+//
+// benchmark of chroma keying, ChromaKeyImage() against the opencv based removeBackground()
+//
+// usage: chromakey_bench [width] [height] [loops]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <opencv2/opencv.hpp>
+#include "matops.h"
+#include "chromakey.h"
+#include "blend.h"
+
+int enable_debug = 0;
+int enable_premultiplied_alpha = 0;
+int enable_rotate_blend = 1;
+
+// green screen with a gradient person-like ellipse and some noise
+static cv::Mat make_frame(int w, int h)
+{
+    cv::Mat frame(cv::Size(w, h), CV_8UC3, cv::Scalar(40, 200, 50));
+    cv::ellipse(frame, cv::Point(w/2, h/2), cv::Size(w/4, h/3), 0, 0, 360, cv::Scalar(140, 170, 220), -1);
+    cv::rectangle(frame, cv::Rect(w/3, h/2, w/3, h/4), cv::Scalar(60, 60, 160), -1);
+    cv::Mat noise(frame.size(), CV_8UC3);
+    cv::randn(noise, cv::Scalar::all(0), cv::Scalar::all(6));
+    frame += noise;
+    cv::GaussianBlur(frame, frame, cv::Size(3, 3), 0);
+    return frame;
+}
+
+template <typename F>
+static double time_ms(int loops, F f)
+{
+    f(); // warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < loops; i++)
+        f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() / loops;
+}
+
+int main(int argc, char **argv)
+{
+    int w = argc > 1? atoi(argv[1]) : 1080;
+    int h = argc > 2? atoi(argv[2]) : 1920;
+    int loops = argc > 3? atoi(argv[3]) : 50;
+    cv::Mat src = make_frame(w, h);
+
+    cv::Mat old_mask;
+    double old_ms = time_ms(loops, [&]() {
+        cv::Mat frame = src.clone(), result;
+        removeBackground(frame, result, old_mask);
+    });
+    printf("removeBackground:   %8.3f ms/frame, %6.2f ns/pixel\n", old_ms, old_ms * 1e6 / (w * h));
+
+    ChromaKey key;
+    uchar bgr[3] = {40, 200, 50};
+    chromakey_init(key, bgr);
+    const BlendISA isas[] = {BLEND_SCALAR, BLEND_SSE41};
+    cv::Mat new_mask;
+    for (auto isa : isas)
+    {
+        if (blend_set_isa(isa) < 0)
+            continue;
+        double ms = time_ms(loops, [&]() {
+            cv::Mat frame = src.clone(), result;
+            ChromaKeyImage(frame, frame, new_mask, key);
+        });
+        printf("ChromaKeyImage %-6s %8.3f ms/frame, %6.2f ns/pixel, %.1fx\n",
+                blend_isa_name(isa), ms, ms * 1e6 / (w * h), old_ms / ms);
+    }
+    blend_set_isa(blend_detect_isa());
+
+    // the clone of each loop is included in both timings
+    double clone_ms = time_ms(loops, [&]() { cv::Mat frame = src.clone(); });
+    printf("(frame clone:       %8.3f ms/frame, included above)\n", clone_ms);
+
+    // how far the soft mask is from the binary one
+    cv::Mat diff;
+    cv::absdiff(old_mask, new_mask, diff);
+    printf("mask difference: %.2f%% pixels differ by more than 128\n",
+            100.0 * cv::countNonZero(diff > 128) / (w * h));
+    return 0;
+}
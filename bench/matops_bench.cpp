@@ -0,0 +1,458 @@
+//
+// microbenchmark of the cpu kernels in matops, on synthetic frames
+//
+// usage: matops_bench [--loops=<n>] [--size=<w>x<h>] [--cpu_blend=auto|avx2|sse4|scalar] [--json=<path>] [--verify]
+//  - sizes default to 1280x720, 1920x1080 and 1080x1920, --size can be given more than once
+//  - json output has one entry per case, so that results of two builds can be diffed
+//  - --verify compares the blend kernels of every instruction set the cpu supports with the scalar
+//    ones instead of timing, and exits with 1 on any byte of difference. It also composes static
+//    layers by BandCompositor with and without flattening, which must be identical on a bgra base
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "matops.h"
+#include "blend.h"
+#include "compositor.h"
+
+int enable_debug = 0;
+int enable_premultiplied_alpha = 0;
+int enable_rotate_blend = 1;
+
+// alpha distributions of transparent inputs
+enum AlphaDist { AD_Opaque, AD_Transparent, AD_Soft };
+static const char *alpha_name(AlphaDist d)
+{
+    return d == AD_Opaque? "opaque" : (d == AD_Transparent? "transparent" : "soft");
+}
+
+struct Result
+{
+    std::string name, alpha;
+    int w, h;
+    double ms;
+    double pixels; // pixels produced per run
+    double bytes;  // bytes read and written per run
+};
+
+template <typename F>
+static double time_ms(int loops, F f)
+{
+    f(); // warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < loops; i++)
+        f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() / loops;
+}
+
+// gradient with some noise, so that nothing is constant
+static cv::Mat make_bgr(int w, int h)
+{
+    cv::Mat bgr(cv::Size(w, h), CV_8UC3);
+    for (int r = 0; r < h; r++)
+    {
+        uchar *p = bgr.ptr<uchar>(r);
+        for (int c = 0; c < w; c++, p += 3)
+        {
+            p[0] = (uchar)(c * 255 / w);
+            p[1] = (uchar)(r * 255 / h);
+            p[2] = (uchar)((c + r) & 0xff);
+        }
+    }
+    cv::Mat noise(bgr.size(), CV_8UC3);
+    cv::RNG rng(12345);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 16);
+    bgr += noise;
+    return bgr;
+}
+
+// soft is an opaque ellipse with blurred edges on a transparent background, like a sticker
+static cv::Mat make_alpha(int w, int h, AlphaDist dist)
+{
+    if (dist != AD_Soft)
+        return cv::Mat(cv::Size(w, h), CV_8UC1, cv::Scalar(dist == AD_Opaque? 255 : 0));
+    cv::Mat alpha = cv::Mat::zeros(cv::Size(w, h), CV_8UC1);
+    cv::ellipse(alpha, cv::Point(w/2, h/2), cv::Size(w*3/8, h*3/8), 0, 0, 360, cv::Scalar(255), -1);
+    int k = (std::min(w, h) / 16) | 1;
+    cv::GaussianBlur(alpha, alpha, cv::Size(k, k), 0);
+    return alpha;
+}
+
+static cv::Mat make_bgra(const cv::Mat &bgr, const cv::Mat &alpha)
+{
+    cv::Mat bgra;
+    cv::Mat mats[2] = {bgr, alpha};
+    int from_to[] = {0, 0, 1, 1, 2, 2, 3, 3};
+    bgra.create(bgr.size(), CV_8UC4);
+    cv::mixChannels(mats, 2, &bgra, 1, from_to, 4);
+    return bgra;
+}
+
+// green screen with a person-like ellipse, the same as chromakey_bench
+static cv::Mat make_green_screen(int w, int h)
+{
+    cv::Mat frame(cv::Size(w, h), CV_8UC3, cv::Scalar(40, 200, 50));
+    cv::ellipse(frame, cv::Point(w/2, h/2), cv::Size(w/4, h/3), 0, 0, 360, cv::Scalar(140, 170, 220), -1);
+    cv::GaussianBlur(frame, frame, cv::Size(3, 3), 0);
+    return frame;
+}
+
+static void bench_size(int w, int h, int loops, std::vector<Result> &results)
+{
+    double px = (double)w * h;
+    auto add = [&](const char *name, const char *alpha, double ms, double pixels, double bytes) {
+        results.push_back(Result{name, alpha, w, h, ms, pixels, bytes});
+        printf("%-28s %-11s %5dx%-5d %9.3f ms %7.2f ns/pixel %7.2f GB/s\n", name, alpha, w, h,
+                ms, ms * 1e6 / pixels, bytes / (ms * 1e-3) / 1e9);
+        fflush(stdout);
+    };
+
+    cv::Mat bgr = make_bgr(w, h), base = make_bgr(w, h), none;
+
+    // same-size layers over a bgr base, the base is read and written once
+    {
+        cv::Mat image = bgr.clone();
+        double ms = time_ms(loops, [&]() { OverlapImageBGR(base, image, 0, 0, w, h); });
+        add("OverlapImageBGR", "", ms, px, px * (3 + 3));
+    }
+    const AlphaDist dists[] = {AD_Opaque, AD_Transparent, AD_Soft};
+    for (auto dist : dists)
+    {
+        cv::Mat alpha = make_alpha(w, h, dist);
+        cv::Mat bgra = make_bgra(bgr, alpha);
+        cv::Mat pbgra = PremultiplyAlpha(bgra, 100);
+        double ms = time_ms(loops, [&]() { OverlapImageBGRA(base, bgra, 0, 0, w, h); });
+        add("OverlapImageBGRA", alpha_name(dist), ms, px, px * (4 + 3 + 3));
+        ms = time_ms(loops, [&]() { OverlapImagePBGRA(base, pbgra, 0, 0, w, h); });
+        add("OverlapImagePBGRA", alpha_name(dist), ms, px, px * (4 + 3 + 3));
+        cv::Mat image = bgr.clone();
+        ms = time_ms(loops, [&]() { OverlapImageBGRM(base, image, alpha, 0, 0, w, h); });
+        add("OverlapImageBGRM", alpha_name(dist), ms, px, px * (3 + 1 + 3 + 3));
+    }
+
+    // half-size video frame scaled while blending
+    {
+        cv::Mat bgra = make_bgra(make_bgr(w/2, h/2), make_alpha(w/2, h/2, AD_Soft));
+        double ms = time_ms(loops, [&]() {
+            OverlapImage(materialcontext::FT_BGRA, base, bgra, none, 0, 0, w, h);
+        });
+        add("OverlapImage scaled 2x", "soft", ms, px, px / 4 * 4 + px * (3 + 3));
+    }
+
+    // three-argument version used for --enable_chromakeying before ChromaKeyImage()
+    {
+        cv::Mat src = make_green_screen(w, h), mask;
+        double ms = time_ms(loops, [&]() {
+            cv::Mat frame = src.clone(), result;
+            removeBackground(frame, result, mask);
+        });
+        add("removeBackground", "", ms, px, px * (3 + 3 + 1));
+    }
+
+    // left-right alpha video, color at left and alpha at right
+    {
+        cv::Mat alpha, lr(cv::Size(w*2, h), CV_8UC3), mask;
+        cv::cvtColor(make_alpha(w, h, AD_Soft), alpha, cv::COLOR_GRAY2BGR);
+        bgr.copyTo(lr(cv::Rect(0, 0, w, h)));
+        alpha.copyTo(lr(cv::Rect(w, 0, w, h)));
+        double ms = time_ms(loops, [&]() { MakeAlphaMat(lr, 'r', w, h, 100, false, NULL); });
+        add("MakeAlphaMat bgra", "soft", ms, px, px * (3 + 3 + 4));
+        ms = time_ms(loops, [&]() { MakeAlphaMat(lr, 'r', w, h, 80, true, NULL); });
+        add("MakeAlphaMat pbgra", "soft", ms, px, px * (3 + 3 + 4));
+        ms = time_ms(loops, [&]() { MakeAlphaMat(lr, 'r', w, h, 100, false, &mask); });
+        add("MakeAlphaMat bgr+mask", "soft", ms, px, px * 3 + px * 1);
+
+        cv::Mat half;
+        cv::resize(lr, half, cv::Size(w, h/2), 0, 0, cv::INTER_NEAREST);
+        ms = time_ms(loops, [&]() { MakeAlphaMat(half, 'r', w, h, 100, false, NULL); });
+        add("MakeAlphaMat scaled 2x", "soft", ms, px, px / 4 * (3 + 3) + px * 4);
+    }
+
+    // a half-size sticker rotated by 30 degrees, into a new image or while blending
+    {
+        int sw = w/2, sh = h/2;
+        double spx = (double)sw * sh;
+        cv::Mat bgra = make_bgra(make_bgr(sw, sh), make_alpha(sw, sh, AD_Soft)), rotated;
+        double ms = time_ms(loops, [&]() {
+            cv::Point pos(w/4, h/4);
+            rotated = RotateMat(bgra, pos, 30);
+        });
+        add("RotateMat 30", "soft", ms, spx, spx * 4 + (double)rotated.total() * 4);
+
+        material m = {};
+        m.rect = cv::Rect(w/4, h/4, sw, sh);
+        m.ctx.blend_rotation = 30;
+        auto map = GetRotateMap(m, bgra);
+        double bpx = (double)map->bbox.area();
+        ms = time_ms(loops, [&]() {
+            OverlapRotatedImage(materialcontext::FT_BGRA, base, bgra, none, m.rect.x, m.rect.y, *map);
+        });
+        add("OverlapRotatedImage 30", "soft", ms, spx, spx * 4 + bpx * (3 + 3));
+    }
+
+    // a caption of about 1/4 of the frame, with outline
+    {
+        cv::Mat text;
+        double ms = time_ms(loops, [&]() {
+            text = text2Mat("Decorate video 0123456789", "", h / 20, cv::Scalar(255, 255, 255, 255),
+                    cv::Point(0, 0), w, h / 4, cvx::WRAP_ALIGN_CENTER, cv::Scalar(0, 0, 0, 255));
+        });
+        if (!text.empty())
+            add("text2Mat", "", ms, (double)text.total(), (double)text.total() * 4);
+    }
+
+    // bgr output frame to yuv420p for the encoder
+    {
+        cv::Mat yuv;
+        double ms = time_ms(loops, [&]() { cv::cvtColor(bgr, yuv, cv::COLOR_BGR2YUV_I420); });
+        add("BGR to I420", "", ms, px, px * 3 + px * 3 / 2);
+    }
+}
+
+// alpha of the verified pixels, random if no values are given, or picked from the values
+struct AlphaCase
+{
+    const char *name;
+    std::vector<uchar> values;
+};
+
+enum VerifyKernel { VK_BGRA_BGRA, VK_BGRA_BGR, VK_BGRM_BGR, VK_PBGRA_BGRA, VK_PBGRA_BGR, VK_Count };
+static const char *verify_kernel_name(int k)
+{
+    static const char *names[VK_Count] = {"bgra_over_bgra", "bgra_over_bgr", "bgrm_over_bgr", "pbgra_over_bgra", "pbgra_over_bgr"};
+    return names[k];
+}
+
+// blend n pixels with the kernel of the instruction set in use, src is bgra, bgr for bgrm, or premultiplied
+static void run_kernel(int k, uchar *dst, const uchar *src, const uchar *mask, int n)
+{
+    switch (k)
+    {
+    case VK_BGRA_BGRA:
+        blend_bgra_over_bgra(dst, src, n);
+        break;
+    case VK_BGRA_BGR:
+        blend_bgra_over_bgr(dst, src, n);
+        break;
+    case VK_BGRM_BGR:
+        blend_bgrm_over_bgr(dst, src, mask, n);
+        break;
+    case VK_PBGRA_BGRA:
+        blend_pbgra_over_bgra(dst, src, n);
+        break;
+    case VK_PBGRA_BGR:
+        blend_pbgra_over_bgr(dst, src, n);
+        break;
+    }
+}
+
+// Every kernel of every instruction set supported is compared with the scalar one, byte by byte,
+// including guard bytes after dst, which no kernel may write. Widths cover tails shorter than a
+// vector of sse4.1 (4/16 pixels) and avx2 (8/32 pixels), alpha covers 0, 255 and both sides of
+// the thresholds (10 and 240) of the bgr kernels. Return the number of failed cases.
+static int verify_kernels()
+{
+    const AlphaCase alphas[] = {
+        {"random", {}},
+        {"0", {0}},
+        {"255", {255}},
+        {"10", {10}},
+        {"240", {240}},
+        {"thresholds", {0, 1, 9, 10, 11, 239, 240, 241, 254, 255}},
+    };
+    std::vector<int> widths;
+    for (int n = 1; n <= 70; n++)
+        widths.push_back(n);
+    const int wide[] = {95, 96, 97, 127, 128, 129, 255, 256, 257, 1279, 1280, 1281, 1919};
+    widths.insert(widths.end(), wide, wide + sizeof(wide) / sizeof(wide[0]));
+
+    BlendISA saved = blend_get_isa(), best = blend_detect_isa();
+    const int guard = 64;
+    cv::RNG rng(12345);
+    int cases = 0, failed = 0;
+    for (auto &ac : alphas)
+    {
+        for (int n : widths)
+        {
+            // straight bgra, the same pixels as bgr+mask and premultiplied
+            std::vector<uchar> bgra(n * 4), bgr(n * 3), mask(n), pbgra(n * 4), base(n * 4 + guard);
+            rng.fill(cv::Mat(1, n * 4, CV_8U, bgra.data()), cv::RNG::UNIFORM, 0, 256);
+            rng.fill(cv::Mat(1, n * 4 + guard, CV_8U, base.data()), cv::RNG::UNIFORM, 0, 256);
+            for (int i = 0; i < n; i++)
+            {
+                if (ac.values.size())
+                    bgra[i*4+3] = ac.values[rng.uniform(0, (int)ac.values.size())];
+                memcpy(&bgr[i*3], &bgra[i*4], 3);
+                mask[i] = bgra[i*4+3];
+            }
+            premultiply_bgra(pbgra.data(), bgra.data(), n, 255);
+
+            for (int k = 0; k < VK_Count; k++)
+            {
+                const uchar *src = k == VK_BGRM_BGR? bgr.data() : (k >= VK_PBGRA_BGRA? pbgra.data() : bgra.data());
+                int dcn = (k == VK_BGRA_BGRA || k == VK_PBGRA_BGRA)? 4 : 3;
+                std::vector<uchar> expect = base;
+                blend_set_isa(BLEND_SCALAR);
+                run_kernel(k, expect.data(), src, mask.data(), n);
+                for (int isa = BLEND_SSE41; isa <= best; isa++)
+                {
+                    std::vector<uchar> got = base;
+                    blend_set_isa((BlendISA)isa);
+                    run_kernel(k, got.data(), src, mask.data(), n);
+                    cases ++;
+                    if (got == expect)
+                        continue;
+                    size_t i = 0;
+                    while (got[i] == expect[i])
+                        i++;
+                    printf("FAIL %-16s %-7s width %5d alpha %-10s: byte %zu (pixel %zu) is %d, scalar %d%s\n",
+                        verify_kernel_name(k), blend_isa_name((BlendISA)isa), n, ac.name, i, i / dcn,
+                        got[i], expect[i], i >= (size_t)(n * dcn)? " (past the end)" : "");
+                    failed ++;
+                }
+            }
+        }
+    }
+    blend_set_isa(saved);
+    printf("verified %d cases of %s against scalar: %d failed\n", cases,
+        best == BLEND_SCALAR? "no simd kernel" : blend_isa_name(best), failed);
+    return failed;
+}
+
+// Three overlapping static layers (straight bgra stickers and an opaque bgr one) are composed by
+// BandCompositor onto bgr and bgra bases, layer by layer and flattened, for two frames so that the
+// cached run is used too. Flattening may differ by rounding on a bgr base, which is reported. A bgra
+// base must come out identical, its alpha differs if the run is blended as one premultiplied layer.
+// Return the number of failed cases.
+static int verify_flattening()
+{
+    const int w = 640, h = 360, lw = 240, lh = 160;
+    cv::Mat bgr = make_bgr(w, h);
+    cv::Mat sticker = make_bgra(make_bgr(lw, lh), make_alpha(lw, lh, AD_Soft));
+    const cv::Point pos[] = {cv::Point(40, 30), cv::Point(160, 90), cv::Point(300, 120)};
+    int failed = 0;
+    for (int cn = 3; cn <= 4; cn++)
+    {
+        cv::Mat base = cn == 4? make_bgra(bgr, make_alpha(w, h, AD_Soft)) : bgr;
+        cv::Mat out[2];
+        for (int flatten = 0; flatten < 2; flatten++)
+        {
+            BandCompositor compositor;
+            compositor.EnableFlattening(flatten != 0);
+            std::vector<material> layers(3);
+            std::vector<cv::Mat> images(3);
+            for (int frame = 0; frame < 2; frame++)
+            {
+                out[flatten] = base.clone();
+                for (int i = 0; i < 3; i++)
+                {
+                    material &m = layers[i];
+                    m.type = material::MT_Image;
+                    m.product_id = 1;
+                    m.material_id = i + 1;
+                    m.rect = cv::Rect(pos[i], cv::Size(lw, lh));
+                    m.ctx.ftype = i == 1? materialcontext::FT_BGR : materialcontext::FT_BGRA;
+                    if (images[i].empty())
+                        images[i] = i == 1? make_bgr(lw, lh) : sticker.clone();
+                    cv::Mat mask;
+                    compositor.Add(m, out[flatten], w, h, images[i], mask, cn == 4);
+                }
+                compositor.Compose(out[flatten]);
+            }
+        }
+        cv::Mat diff;
+        cv::absdiff(out[0], out[1], diff);
+        double maxdiff = 0;
+        cv::minMaxLoc(diff.reshape(1), NULL, &maxdiff);
+        bool ok = cn == 3 || maxdiff == 0;
+        printf("%s flattened layers over %s base: max difference %d from layer by layer\n",
+            ok? "OK  " : "FAIL", cn == 4? "bgra" : "bgr", (int)maxdiff);
+        if (!ok)
+            failed ++;
+    }
+    return failed;
+}
+
+static void write_json(const char *path, const std::vector<Result> &results, int loops)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: failed to open %s for writing\n", path);
+        return;
+    }
+    fprintf(fp, "{\n  \"isa\": \"%s\",\n  \"loops\": %d,\n  \"results\": [\n", blend_isa_name(blend_get_isa()), loops);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto &r = results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"alpha\": \"%s\", \"width\": %d, \"height\": %d, "
+                "\"ms\": %.4f, \"ns_per_pixel\": %.4f, \"gb_per_s\": %.4f}%s\n",
+                r.name.c_str(), r.alpha.c_str(), r.w, r.h, r.ms, r.ms * 1e6 / r.pixels,
+                r.bytes / (r.ms * 1e-3) / 1e9, i + 1 < results.size()? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    int loops = 20;
+    const char *json = NULL;
+    bool verify = false;
+    std::vector<cv::Size> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        int w, h;
+        if (strncasecmp(argv[i], "--loops=", 8) == 0)
+            loops = std::max(1, atoi(argv[i] + 8));
+        else if (strncasecmp(argv[i], "--size=", 7) == 0 && sscanf(argv[i] + 7, "%dx%d", &w, &h) == 2 && w > 1 && h > 1)
+            sizes.push_back(cv::Size(w & ~1, h & ~1));
+        else if (strncasecmp(argv[i], "--json=", 7) == 0)
+            json = argv[i] + 7;
+        else if (strcasecmp(argv[i], "--verify") == 0)
+            verify = true;
+        else if (strncasecmp(argv[i], "--cpu_blend=", 12) == 0)
+        {
+            const char *isa = argv[i] + 12;
+            BlendISA b = blend_detect_isa();
+            if (strcasecmp(isa, "avx2") == 0)
+                b = BLEND_AVX2;
+            else if (strcasecmp(isa, "sse4") == 0)
+                b = BLEND_SSE41;
+            else if (strcasecmp(isa, "scalar") == 0)
+                b = BLEND_SCALAR;
+            if (blend_set_isa(b) < 0)
+            {
+                fprintf(stderr, "Error: %s is not supported by this cpu\n", isa);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--loops=<n>] [--size=<w>x<h>] [--cpu_blend=auto|avx2|sse4|scalar] [--json=<path>] [--verify]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (verify)
+    {
+        int failed = verify_kernels();
+        failed += verify_flattening();
+        return failed? 1 : 0;
+    }
+    if (sizes.empty())
+        sizes = {cv::Size(1280, 720), cv::Size(1920, 1080), cv::Size(1080, 1920)};
+
+    printf("cpu blend: %s, loops: %d\n", blend_isa_name(blend_get_isa()), loops);
+    std::vector<Result> results;
+    for (auto &s : sizes)
+        bench_size(s.width, s.height, loops, results);
+    if (json)
+        write_json(json, results, loops);
+    return 0;
+}
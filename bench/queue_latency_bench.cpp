@@ -0,0 +1,184 @@
+//
+// latency of the decode -> render -> encode queues, with the sleep-polling loops the worker
+// threads used before and with the watermark waits of SafeQueue
+//
+// usage: queue_latency_bench [--frames=<n>] [--fps=<n>] [--stall=<ms>] [--mode=poll|event|both]
+//  - a decoder thread fills a queue up to the high watermark (100) as RUN() does,
+//    a render thread takes one frame per output frame and writes it to the encoder queue,
+//    an encoder thread writes it out, stalling for --stall ms every 25 frames like a busy pipe
+//  - input delay is from a frame being decoded to the encoder taking it, encoder delay is from
+//    Write() to the encoder taking the frame, render delay is how long Write() blocks when the
+//    encoder queue is above the high watermark, wakeups are loop iterations of the threads
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "safequeue.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const int decode_high = 100, decode_low = 80; // FFVideoDecodeThread
+static const int encode_high = 10, encode_low = 5;   // FFVideoEncodeThread::Write()
+
+struct Frame
+{
+    Clock::time_point decoded, written;
+};
+
+struct Stats
+{
+    std::vector<double> input, encode, render;
+    std::atomic<long> decoder_wakeups, encoder_wakeups;
+    Stats() : decoder_wakeups(0), encoder_wakeups(0) {}
+};
+
+static double us_since(Clock::time_point t)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - t).count();
+}
+
+static void spin_us(int us)
+{
+    auto end = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < end)
+        ;
+}
+
+static void run(bool event, int frames, int fps, int stall_ms, Stats &st)
+{
+    SafeQueue<Clock::time_point> decoded;
+    SafeQueue<Frame> encoding;
+    QueueNotifier wake;
+    std::atomic_bool exit(false);
+    if (event)
+        decoded.SetNotifier(&wake, decode_low);
+
+    // decoder: fill up to the high watermark, decoding a frame costs 200us
+    std::thread decoder([&] {
+        while (!exit)
+        {
+            st.decoder_wakeups ++;
+            while (!exit && decoded.Size() < decode_high)
+            {
+                spin_us(200);
+                decoded.PushMove(Clock::now());
+            }
+            if (event)
+                wake.Wait([&] { return exit || decoded.Size() <= decode_low; }, 100);
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+
+    // encoder: writing a frame costs 500us, and the pipe blocks for stall_ms every 25 frames
+    std::thread encoder([&] {
+        int n = 0;
+        while (!exit || encoding.Size())
+        {
+            Frame f;
+            st.encoder_wakeups ++;
+            if (!encoding.PopMove(f, 100))
+            {
+                if (!event)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            st.encode.push_back(us_since(f.written));
+            st.input.push_back(us_since(f.decoded));
+            spin_us(500);
+            if (++n % 25 == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(stall_ms));
+        }
+    });
+
+    // render: one frame per output frame period
+    auto next = Clock::now();
+    for (int i = 0; i < frames; i++)
+    {
+        next += std::chrono::microseconds(1000000 / fps);
+        std::this_thread::sleep_until(next);
+        Frame f;
+        if (!decoded.PopMove(f.decoded, 0))
+            f.decoded = Clock::now();
+        spin_us(1000); // compose
+        f.written = Clock::now();
+        encoding.PushMove(std::move(f));
+        if (encoding.Size() > encode_high)
+        {
+            auto t = Clock::now();
+            if (event)
+                encoding.WaitBelow(encode_low, 10);
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            st.render.push_back(us_since(t));
+        }
+    }
+    exit = true;
+    wake.Notify();
+    decoder.join();
+    encoder.join();
+}
+
+static void report(const char *mode, const char *name, std::vector<double> v)
+{
+    if (v.empty())
+    {
+        printf("%-6s %-16s %8s\n", mode, name, "-");
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (double x : v)
+        sum += x;
+    printf("%-6s %-16s %8zu %10.3f %10.3f %10.3f %10.3f\n", mode, name, v.size(), sum / v.size() / 1000,
+           v[v.size() / 2] / 1000, v[std::min(v.size() - 1, v.size() * 99 / 100)] / 1000, v.back() / 1000);
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 500, fps = 100, stall = 150;
+    bool poll = true, event = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncasecmp(argv[i], "--frames=", 9) == 0)
+            frames = std::max(1, atoi(argv[i] + 9));
+        else if (strncasecmp(argv[i], "--fps=", 6) == 0)
+            fps = std::max(1, atoi(argv[i] + 6));
+        else if (strncasecmp(argv[i], "--stall=", 8) == 0)
+            stall = std::max(0, atoi(argv[i] + 8));
+        else if (strncasecmp(argv[i], "--mode=", 7) == 0)
+        {
+            poll = strcasecmp(argv[i] + 7, "event") != 0;
+            event = strcasecmp(argv[i] + 7, "poll") != 0;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--frames=<n>] [--fps=<n>] [--stall=<ms>] [--mode=poll|event|both]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-6s %-16s %8s %10s %10s %10s %10s\n", "mode", "delay (ms)", "count", "mean", "p50", "p99", "max");
+    for (int m = 0; m < 2; m++)
+    {
+        if ((m == 0 && !poll) || (m == 1 && !event))
+            continue;
+        const char *mode = m? "event" : "poll";
+        Stats st;
+        auto start = Clock::now();
+        run(m == 1, frames, fps, stall, st);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        report(mode, "input->encoder", st.input);
+        report(mode, "encoder queue", st.encode);
+        report(mode, "render blocked", st.render);
+        printf("%-6s %-16s %8.1f/s\n", mode, "decoder wakeups", st.decoder_wakeups / secs);
+        printf("%-6s %-16s %8.1f/s\n", mode, "encoder wakeups", st.encoder_wakeups / secs);
+    }
+    return 0;
+}
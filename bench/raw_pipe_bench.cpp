@@ -0,0 +1,226 @@
+//
+// throughput and latency of raw fifo inputs, the stdio fread() loop read_rawvideo_frame() used
+// before against RawPipe
+//
+// usage: raw_pipe_bench [--frames=<n>] [--size=<bytes>] [--audio=<bytes>] [--fps=<n>] [--work=<us>] [--pipe_size=<KB>] [--mode=stdio|pipe|both]
+//  - a producer thread writes the <MsgHead><payload> stream of a raw input into a pipe: audio
+//    packets of --audio bytes in total and one video frame of --size bytes per frame
+//  - sustained MB/s is measured with the producer writing as fast as it can, read calls are the
+//    read()/readv() calls made by the reader per frame
+//  - latency is from the producer starting to write a frame to the reader having all of it, with
+//    the producer writing --fps frames per second, and the reader compositing each frame for --work us,
+//    writer blocked is the time the producer took to write a frame into the pipe
+//
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "event.h"
+#include "rawpipe.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static bool write_all(int fd, const void *data, size_t n)
+{
+    const char *p = (const char *)data;
+    while (n)
+    {
+        ssize_t r = write(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void spin_us(int us)
+{
+    auto end = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < end)
+        ;
+}
+
+// blocked is the time each frame took to write, the producer is held up by a full pipe
+static void produce(int fd, int frames, int size, int audio, int fps, std::vector<double> *blocked)
+{
+    std::vector<unsigned char> frame(size), pcm(std::max(audio / 2, 1));
+    auto next = Clock::now();
+    for (int i = 0; i < frames; i++)
+    {
+        if (fps)
+        {
+            next += std::chrono::microseconds(1000000 / fps);
+            std::this_thread::sleep_until(next);
+        }
+        for (int sent = 0; sent < audio; sent += pcm.size()) // two packets, as 20ms of audio at 25fps
+        {
+            MsgHead head = { 1, EC_RAWMEDIA_AUDIO, (int)std::min<size_t>(pcm.size(), audio - sent) };
+            if (!write_all(fd, &head, sizeof(head)) || !write_all(fd, pcm.data(), head.len))
+                return;
+        }
+        auto start = Clock::now();
+        int64_t now = start.time_since_epoch().count();
+        memcpy(frame.data(), &now, sizeof(now));
+        MsgHead head = { 1, EC_RAWMEDIA_VIDEO, size };
+        if (!write_all(fd, &head, sizeof(head)) || !write_all(fd, frame.data(), size))
+            return;
+        blocked->push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+}
+
+// the loop of read_rawvideo_frame() before RawPipe, the stream reads through a cookie to count them
+struct StdioReader
+{
+    int fd;
+    uint64_t reads;
+    FILE *f;
+    explicit StdioReader(int fd) : fd(fd), reads(0)
+    {
+        cookie_io_functions_t io = { StdioReader::read_fd, NULL, NULL, StdioReader::close_fd };
+        f = fopencookie(this, "rb", io);
+    }
+    ~StdioReader() { fclose(f); }
+    bool Read(void *dst, size_t n) { return fread(dst, n, 1, f) == 1; }
+
+    static ssize_t read_fd(void *cookie, char *buf, size_t n)
+    {
+        StdioReader *r = (StdioReader *)cookie;
+        r->reads ++;
+        return read(r->fd, buf, n);
+    }
+    static int close_fd(void *cookie) { return close(((StdioReader *)cookie)->fd); }
+};
+
+struct Result
+{
+    double seconds;
+    std::vector<double> lat, blocked; // us
+    uint64_t reads;
+};
+
+template <class Reader>
+static bool consume(Reader &reader, int frames, int size, int work, Result &res)
+{
+    std::vector<unsigned char> frame(size), pcm(1024*1024);
+    auto start = Clock::now();
+    for (int i = 0; i < frames; )
+    {
+        MsgHead head;
+        if (!reader.Read(&head, sizeof(head)))
+            return false;
+        if (head.type != EC_RAWMEDIA_VIDEO)
+        {
+            if (!reader.Read(pcm.data(), head.len))
+                return false;
+            continue;
+        }
+        if (!reader.Read(frame.data(), head.len))
+            return false;
+        int64_t put;
+        memcpy(&put, frame.data(), sizeof(put));
+        res.lat.push_back((Clock::now().time_since_epoch().count() - put) / 1000.0);
+        spin_us(work); // composite
+        i ++;
+    }
+    res.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return true;
+}
+
+static int run(bool pipe_mode, int frames, int size, int audio, int fps, int work, int pipe_size, Result &res)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+    res.reads = 0;
+    std::thread producer(produce, fds[1], frames, size, audio, fps, &res.blocked);
+    bool ok;
+    if (pipe_mode)
+    {
+        RawPipe reader(fds[0], true, pipe_size);
+        ok = consume(reader, frames, size, work, res);
+        res.reads = reader.Reads();
+    }
+    else
+    {
+        StdioReader reader(fds[0]);
+        ok = consume(reader, frames, size, work, res);
+        res.reads = reader.reads;
+    }
+    producer.join(); // the reader is closed, a producer left writing fails with EPIPE
+    close(fds[1]);
+    if (!ok)
+    {
+        fprintf(stderr, "reading failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static double pct(std::vector<double> &v, int p)
+{
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, v.size() * p / 100)];
+}
+
+static int bench(bool pipe_mode, int frames, int size, int audio, int fps, int work, int pipe_size)
+{
+    Result tput, lat;
+    if (run(pipe_mode, frames, size, audio, 0, 0, pipe_size, tput) < 0 ||
+        run(pipe_mode, std::min(frames, fps * 10), size, audio, fps, work, pipe_size, lat) < 0)
+        return -1;
+    double mb = (double)frames * (size + audio) / (1024*1024);
+    printf("%-6s %8.1f MB/s  %6.1f reads/frame   at %dfps: latency p50 %7.1f us  p99 %7.1f us   writer blocked p50 %7.1f us  p99 %7.1f us\n",
+           pipe_mode? "pipe" : "stdio", mb / tput.seconds, (double)tput.reads / frames,
+           fps, pct(lat.lat, 50), pct(lat.lat, 99), pct(lat.blocked, 50), pct(lat.blocked, 99));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 2000, size = 1280*720*3/2, audio = 3840, fps = 25, work = 5000, pipe_size = 0;
+    bool stdio = true, rawpipe = true;
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncasecmp(argv[i], "--frames=", 9) == 0)
+            frames = std::max(10, atoi(argv[i] + 9));
+        else if (strncasecmp(argv[i], "--size=", 7) == 0)
+            size = std::max((int)sizeof(int64_t), atoi(argv[i] + 7));
+        else if (strncasecmp(argv[i], "--audio=", 8) == 0)
+            audio = std::max(0, atoi(argv[i] + 8));
+        else if (strncasecmp(argv[i], "--fps=", 6) == 0)
+            fps = std::max(1, atoi(argv[i] + 6));
+        else if (strncasecmp(argv[i], "--work=", 7) == 0)
+            work = std::max(0, atoi(argv[i] + 7));
+        else if (strncasecmp(argv[i], "--pipe_size=", 12) == 0)
+            pipe_size = std::max(0, atoi(argv[i] + 12));
+        else if (strcasecmp(argv[i], "--mode=stdio") == 0)
+            rawpipe = false;
+        else if (strcasecmp(argv[i], "--mode=pipe") == 0)
+            stdio = false;
+        else if (strcasecmp(argv[i], "--mode=both") != 0)
+        {
+            fprintf(stderr, "usage: %s [--frames=<n>] [--size=<bytes>] [--audio=<bytes>] [--fps=<n>] [--work=<us>] [--pipe_size=<KB>] [--mode=stdio|pipe|both]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (stdio && bench(false, frames, size, audio, fps, work, 0) < 0)
+        return 1;
+    if (rawpipe && bench(true, frames, size, audio, fps, work, pipe_size * 1024) < 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,156 @@
+//
+// latency of shm:// inputs, the 10ms sleep-polling loop read_rawvideo_frame_shm() used before
+// against ShmWaiter sleeping on the fifo the writer signals
+//
+// usage: shm_latency_bench [--frames=<n>] [--fps=<n>] [--size=<bytes>] [--idle=<ms>] [--mode=poll|event|both]
+//  - a writer thread puts a frame of --size bytes every 1/fps second into a shm queue created
+//    to signal its readers (sig_ele_num 1), like the generator of ai frames does
+//  - the reader takes each frame and composites it, which costs 1ms of spinning, latency is from
+//    sq_put() to the frame being composited
+//  - the queue is then left empty for --idle ms, wakeups are the times the reader went to sleep
+//    in that time
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "3rd/shmqueue/shm_queue.h"
+#include "shmwait.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const int timeout = 60000; // --shm_timeout
+
+static void spin_us(int us)
+{
+    auto end = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < end)
+        ;
+}
+
+// the loop of read_rawvideo_frame_shm() before ShmWaiter, return the length and the sleeps
+static int poll_get(struct shm_queue *sq, std::vector<unsigned char> &buf, long &sleeps, int timeout_ms)
+{
+    struct timeval t;
+    int length, waited = 0;
+    while ((length = sq_get(sq, buf.data(), buf.size(), &t)) == 0)
+    {
+        waited += 10;
+        if (waited > timeout_ms)
+            break;
+        sleeps ++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return length;
+}
+
+static int run(bool event, int frames, int fps, int size, int idle_ms)
+{
+    u64_t key = 0x5eed0000 + (getpid() & 0xffff);
+    struct shm_queue *wq = sq_create(key, std::max(size, 1024) / 4, 64, 1, 1);
+    if (wq == NULL)
+    {
+        fprintf(stderr, "sq_create failed: %s\n", sq_errorstr(NULL));
+        return -1;
+    }
+    // opened as shm://<shmid> is, shmid 0 (the first segment of the system) is taken as none by sq_open_by_shmid()
+    int shmid = sq_get_shmid(wq);
+    struct shm_queue *rq = shmid > 0? sq_open_by_shmid(shmid) : sq_open(key);
+    if (rq == NULL)
+    {
+        fprintf(stderr, "opening the shm queue failed: %s\n", sq_errorstr(NULL));
+        sq_destroy_and_remove(wq);
+        return -1;
+    }
+    ShmWaiter *waiter = event? new ShmWaiter(rq) : NULL;
+    if (waiter && !waiter->Evented())
+        fprintf(stderr, "warning: the shm queue is polled, no event fd\n");
+
+    std::thread writer([&] {
+        std::vector<unsigned char> frame(size);
+        auto next = Clock::now();
+        for (int i = 0; i < frames; i++)
+        {
+            next += std::chrono::microseconds(1000000 / fps);
+            std::this_thread::sleep_until(next);
+            int64_t now = Clock::now().time_since_epoch().count();
+            memcpy(frame.data(), &now, sizeof(now));
+            while (sq_put(wq, frame.data(), frame.size()) == -2) // full
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::vector<unsigned char> buf(size + 1024);
+    std::vector<double> lat;
+    long sleeps = 0;
+    struct timeval t;
+    while ((int)lat.size() < frames)
+    {
+        int length = waiter? waiter->Get(buf.data(), buf.size(), &t, timeout) : poll_get(rq, buf, sleeps, timeout);
+        if (length <= 0)
+        {
+            fprintf(stderr, "reading failed: %d\n", length);
+            break;
+        }
+        spin_us(1000); // composite
+        int64_t put;
+        memcpy(&put, buf.data(), sizeof(put));
+        lat.push_back((Clock::now().time_since_epoch().count() - put) / 1000.0);
+    }
+    writer.join();
+
+    // idle, nothing is put for idle_ms
+    long idle_sleeps = waiter? waiter->Sleeps() : sleeps;
+    if (waiter)
+        waiter->Get(buf.data(), buf.size(), &t, idle_ms);
+    else
+        poll_get(rq, buf, sleeps, idle_ms);
+    idle_sleeps = (waiter? waiter->Sleeps() : sleeps) - idle_sleeps;
+
+    delete waiter;
+    sq_destroy(rq);
+    sq_destroy_and_remove(wq);
+    if (lat.empty())
+        return -1;
+    std::sort(lat.begin(), lat.end());
+    printf("%-6s put->composited p50 %8.1f us  p99 %8.1f us  max %8.1f us   idle wakeups %.1f/s\n", event? "event" : "poll",
+           lat[lat.size() / 2], lat[lat.size() * 99 / 100], lat.back(), idle_sleeps * 1000.0 / std::max(idle_ms, 1));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 500, fps = 25, size = 1280*720*3/2, idle = 2000;
+    bool poll = true, event = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncasecmp(argv[i], "--frames=", 9) == 0)
+            frames = std::max(10, atoi(argv[i] + 9));
+        else if (strncasecmp(argv[i], "--fps=", 6) == 0)
+            fps = std::max(1, atoi(argv[i] + 6));
+        else if (strncasecmp(argv[i], "--size=", 7) == 0)
+            size = std::max((int)sizeof(int64_t), atoi(argv[i] + 7));
+        else if (strncasecmp(argv[i], "--idle=", 7) == 0)
+            idle = std::max(0, atoi(argv[i] + 7));
+        else if (strcasecmp(argv[i], "--mode=poll") == 0)
+            event = false;
+        else if (strcasecmp(argv[i], "--mode=event") == 0)
+            poll = false;
+        else if (strcasecmp(argv[i], "--mode=both") != 0)
+        {
+            fprintf(stderr, "usage: %s [--frames=<n>] [--fps=<n>] [--size=<bytes>] [--idle=<ms>] [--mode=poll|event|both]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (poll && run(false, frames, fps, size, idle) < 0)
+        return 1;
+    if (event && run(true, frames, fps, size, idle) < 0)
+        return 1;
+    return 0;
+}
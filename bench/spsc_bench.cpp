@@ -0,0 +1,135 @@
+//
+// microbenchmark of the stage hand-off queues, SafeQueue against SpscQueue
+//
+// usage: spsc_bench [--items=<n>] [--payload=<bytes>]
+//  - throughput: a producer fills the queue up to a high watermark like the decoders do, calling
+//    Size() before every push, a consumer pops with PopMove(t, 100) as fast as it can
+//  - handoff: a producer pushes a timestamp every 50us, the consumer is blocked on the empty
+//    queue, latency is from the push to the pop returning
+//  - payload is the size of the vector moved through the queue per item, the frame data
+//    itself is never copied by either queue, the consumer hands the vectors back for reuse
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "safequeue.h"
+#include "spscqueue.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Item
+{
+    Clock::time_point pushed;
+    std::vector<unsigned char> data;
+};
+
+static const int high = 100, capacity = 128; // FFVideoDecodeThread::max_queue_size
+
+// SafeQueue has no capacity
+template<typename Q> Q *make_queue();
+template<> SafeQueue<Item> *make_queue() { return new SafeQueue<Item>; }
+template<> SpscQueue<Item> *make_queue() { return new SpscQueue<Item>(capacity); }
+
+// every item carries payload bytes, the consumer returns the vectors to the producer through a
+// ring of free buffers, the same for both queues, as decoders recycle frames through the pool
+template<typename Q>
+static double throughput(int items, int payload)
+{
+    Q *q = make_queue<Q>();
+    SpscQueue<std::vector<unsigned char>> free_buffers(capacity * 2);
+    for (int i = 0; i < capacity + 2; i++)
+        free_buffers.TryPushMove(std::vector<unsigned char>(payload));
+    int short_items = 0;
+    auto start = Clock::now();
+    std::thread producer([&] {
+        for (int i = 0; i < items; i++)
+        {
+            while (q->Size() >= high)
+                q->WaitBelow(high - 1, 10);
+            Item it;
+            if (!free_buffers.PopMove(it.data, 100))
+                it.data.resize(payload);
+            q->PushMove(std::move(it));
+        }
+    });
+    for (int i = 0; i < items; )
+    {
+        Item it;
+        if (q->PopMove(it, 100))
+        {
+            if ((int)it.data.size() != payload)
+                short_items ++;
+            free_buffers.TryPushMove(std::move(it.data));
+            i++;
+        }
+    }
+    producer.join();
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / items;
+    delete q;
+    if (short_items)
+        fprintf(stderr, "Error: %d items did not carry %d bytes\n", short_items, payload);
+    return ns;
+}
+
+template<typename Q>
+static void handoff(int items, std::vector<double> &lat)
+{
+    Q *q = make_queue<Q>();
+    std::thread producer([&] {
+        auto next = Clock::now();
+        for (int i = 0; i < items; i++)
+        {
+            next += std::chrono::microseconds(50);
+            std::this_thread::sleep_until(next);
+            Item it;
+            it.pushed = Clock::now();
+            q->PushMove(std::move(it));
+        }
+    });
+    lat.clear();
+    while ((int)lat.size() < items)
+    {
+        Item it;
+        if (q->PopMove(it, 100))
+            lat.push_back(std::chrono::duration<double, std::micro>(Clock::now() - it.pushed).count());
+    }
+    producer.join();
+    delete q;
+    std::sort(lat.begin(), lat.end());
+}
+
+template<typename Q>
+static void run(const char *name, int items, int payload)
+{
+    double ns = throughput<Q>(items, payload);
+    printf("%-10s throughput %9.1f ns/item %10.2f M items/s\n", name, ns, 1000.0 / ns);
+    std::vector<double> lat;
+    handoff<Q>(std::min(items, 20000), lat);
+    printf("%-10s handoff    p50 %7.1f us  p99 %7.1f us  max %7.1f us\n", name,
+           lat[lat.size() / 2], lat[lat.size() * 99 / 100], lat.back());
+}
+
+int main(int argc, char **argv)
+{
+    int items = 1000000, payload = 64;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncasecmp(argv[i], "--items=", 8) == 0)
+            items = std::max(100, atoi(argv[i] + 8));
+        else if (strncasecmp(argv[i], "--payload=", 10) == 0)
+            payload = std::max(0, atoi(argv[i] + 10));
+        else
+        {
+            fprintf(stderr, "usage: %s [--items=<n>] [--payload=<bytes>]\n", argv[0]);
+            return 1;
+        }
+    }
+    run<SafeQueue<Item>>("SafeQueue", items, payload);
+    run<SpscQueue<Item>>("SpscQueue", items, payload);
+    return 0;
+}
@@ -0,0 +1,802 @@
+#include <string.h>
+#include "blend.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define BLEND_X86
+#include <immintrin.h>
+#endif
+
+//
+// scalar kernels, these are also the reference of simd kernels
+//
+static inline void blend_bgr_pixel(uchar *dst, const uchar *src, uchar a)
+{
+    if(a > 240) // solid forground, memcpy
+    {
+        memcpy(dst, src, 3);
+    }
+    else if(a > 10) // alpha is zero, skip
+    {
+        float alpha = ((float)a) / 255; // alpha threshold value
+        float beta = 1-alpha;
+        dst[0] = beta*dst[0] + alpha*src[0];
+        dst[1] = beta*dst[1] + alpha*src[1];
+        dst[2] = beta*dst[2] + alpha*src[2];
+    }
+}
+
+static void blend_bgra_over_bgra_scalar(uchar *dst, const uchar *src, int n)
+{
+    for (int i = 0; i < n; i++, dst += 4, src += 4)
+    {
+        auto a = src[3];
+        if (a == 0) // alpha 0 keeps dst exactly
+            continue;
+        if (a == 0xff) // alpha 1.0 gives src exactly
+        {
+            memcpy(dst, src, 4);
+            continue;
+        }
+        float alpha = ((float)a) / 255; // alpha threshold value
+        float beta = 1 - alpha;
+        dst[0] = beta*dst[0] + alpha*src[0];
+        dst[1] = beta*dst[1] + alpha*src[1];
+        dst[2] = beta*dst[2] + alpha*src[2];
+        dst[3] = beta*dst[3] + alpha*src[3];
+    }
+}
+
+static void blend_bgra_over_bgr_scalar(uchar *dst, const uchar *src, int n)
+{
+    for (int i = 0; i < n; i++, dst += 3, src += 4)
+        blend_bgr_pixel(dst, src, src[3]);
+}
+
+static void blend_bgrm_over_bgr_scalar(uchar *dst, const uchar *src, const uchar *mask, int n)
+{
+    for (int i = 0; i < n; i++, dst += 3, src += 3)
+        blend_bgr_pixel(dst, src, mask[i]);
+}
+
+// x/255 rounded, x must be in [0, 255*255]
+static inline int div255(int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// s + d*ia/255, saturated in case of src is not premultiplied correctly
+static inline uchar blend_premultiplied(uchar d, uchar s, int ia)
+{
+    int v = s + div255(d * ia);
+    return v > 255? 255 : v;
+}
+
+static void blend_pbgra_over_bgra_scalar(uchar *dst, const uchar *src, int n)
+{
+    for (int i = 0; i < n; i++, dst += 4, src += 4)
+    {
+        int ia = 255 - src[3];
+        if (ia == 255) // transparent
+            continue;
+        if (ia == 0) // opaque
+        {
+            memcpy(dst, src, 4);
+            continue;
+        }
+        dst[0] = blend_premultiplied(dst[0], src[0], ia);
+        dst[1] = blend_premultiplied(dst[1], src[1], ia);
+        dst[2] = blend_premultiplied(dst[2], src[2], ia);
+        dst[3] = blend_premultiplied(dst[3], src[3], ia);
+    }
+}
+
+static void blend_pbgra_over_bgr_scalar(uchar *dst, const uchar *src, int n)
+{
+    for (int i = 0; i < n; i++, dst += 3, src += 4)
+    {
+        int ia = 255 - src[3];
+        if (ia == 255) // transparent
+            continue;
+        if (ia == 0) // opaque
+        {
+            memcpy(dst, src, 3);
+            continue;
+        }
+        dst[0] = blend_premultiplied(dst[0], src[0], ia);
+        dst[1] = blend_premultiplied(dst[1], src[1], ia);
+        dst[2] = blend_premultiplied(dst[2], src[2], ia);
+    }
+}
+
+void premultiply_bgra(uchar *dst, const uchar *src, int n, int opacity)
+{
+    for (int i = 0; i < n; i++, dst += 4, src += 4)
+    {
+        int a = div255(src[3] * opacity);
+        dst[0] = div255(src[0] * a);
+        dst[1] = div255(src[1] * a);
+        dst[2] = div255(src[2] * a);
+        dst[3] = a;
+    }
+}
+
+void premultiply_bgr(uchar *dst, const uchar *src, int n, int opacity)
+{
+    for (int i = 0; i < n; i++, dst += 4, src += 3)
+    {
+        dst[0] = div255(src[0] * opacity);
+        dst[1] = div255(src[1] * opacity);
+        dst[2] = div255(src[2] * opacity);
+        dst[3] = opacity;
+    }
+}
+
+// bt.601 limited range, the same as cv::COLOR_BGR2YUV_I420, weighted by alpha in 0-255*255
+static inline void bgra_to_yuv_terms(const uchar *s, bool premultiplied, int &ty, int &tu, int &tv)
+{
+    int b = s[0], g = s[1], r = s[2], a = s[3];
+    int y = (66*r + 129*g + 25*b + 128) >> 8;
+    int u = (-38*r - 74*g + 112*b + 128) >> 8;
+    int v = (112*r - 94*g - 18*b + 128) >> 8;
+    if (premultiplied) // color is already multiplied by alpha, only the offsets are not
+    {
+        ty = 255*y + 16*a;
+        tu = 255*u + 128*a;
+        tv = 255*v + 128*a;
+    }
+    else
+    {
+        ty = a*(y + 16);
+        tu = a*(u + 128);
+        tv = a*(v + 128);
+    }
+}
+
+static inline uchar clamp_u8(int x)
+{
+    return (uchar)(x < 0? 0 : (x > 255? 255 : x));
+}
+
+void blend_bgra_over_i420(uchar *y0, uchar *y1, uchar *u, uchar *v,
+                          const uchar *src0, const uchar *src1, int n, bool premultiplied)
+{
+    for (int i = 0; i < n; i += 2, u++, v++)
+    {
+        const uchar *s[4] = {src0 + i*4, src0 + i*4 + 4, src1 + i*4, src1 + i*4 + 4};
+        uchar *d[4] = {y0 + i, y0 + i + 1, y1 + i, y1 + i + 1};
+        int sa = 0, su = 0, sv = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            int a = s[k][3];
+            if (a == 0)
+                continue;
+            int ty, tu, tv;
+            bgra_to_yuv_terms(s[k], premultiplied, ty, tu, tv);
+            *d[k] = clamp_u8(div255(ty + *d[k] * (255 - a)));
+            sa += a;
+            su += tu;
+            sv += tv;
+        }
+        if (sa == 0)
+            continue;
+        // chroma is shared by 2x2 pixels, blended with their average alpha
+        *u = clamp_u8((su + *u * (1020 - sa) + 510) / 1020);
+        *v = clamp_u8((sv + *v * (1020 - sa) + 510) / 1020);
+    }
+}
+
+void scale_row_linear(uchar *dst, const uchar *src0, const uchar *src1, int wy,
+                      const int *xofs0, const int *xofs1, const short *wx, int n, int cn)
+{
+    int iwy = 256 - wy;
+    for (int i = 0; i < n; i++, dst += cn)
+    {
+        const uchar *a = src0 + xofs0[i], *b = src0 + xofs1[i];
+        const uchar *c = src1 + xofs0[i], *d = src1 + xofs1[i];
+        int w1 = wx[i], w0 = 256 - w1;
+        for (int k = 0; k < cn; k++)
+            dst[k] = (uchar)(((a[k]*w0 + b[k]*w1)*iwy + (c[k]*w0 + d[k]*w1)*wy + (1<<15)) >> 16);
+    }
+}
+
+void scale_row_nearest(uchar *dst, const uchar *src, const int *xofs, int n, int cn)
+{
+    for (int i = 0; i < n; i++, dst += cn)
+        memcpy(dst, src + xofs[i], cn);
+}
+
+#ifdef BLEND_X86
+//
+// simd kernels, computing in float exactly like the scalar ones:
+//  - alpha is divided by 255 (not multiplied by reciprocal)
+//  - mul and add are separate instructions, fma is not enabled for these targets
+//  - float is truncated to integer like the implicit conversion of c
+//
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+
+// alpha index of each byte for 16 pixels of bgr in 3 registers
+#define BGR_ALPHA_IDX0 0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5
+#define BGR_ALPHA_IDX1 5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10
+#define BGR_ALPHA_IDX2 10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15
+// alpha index of each byte for 4 pixels of bgra
+#define BGRA_ALPHA_IDX 3,3,3,3,7,7,7,7,11,11,11,11,15,15,15,15
+
+TARGET_SSE41 static inline __m128i blend_epi32_sse41(__m128i d, __m128i s, __m128i a)
+{
+    __m128 alpha = _mm_div_ps(_mm_cvtepi32_ps(a), _mm_set1_ps(255.f));
+    __m128 beta = _mm_sub_ps(_mm_set1_ps(1.f), alpha);
+    __m128 r = _mm_add_ps(_mm_mul_ps(beta, _mm_cvtepi32_ps(d)), _mm_mul_ps(alpha, _mm_cvtepi32_ps(s)));
+    return _mm_cvttps_epi32(r);
+}
+
+// blend 16 bytes, a holds the alpha of each byte
+TARGET_SSE41 static inline __m128i blend_epu8_sse41(__m128i d, __m128i s, __m128i a)
+{
+    __m128i z = _mm_setzero_si128();
+    __m128i d0 = _mm_unpacklo_epi8(d, z), d1 = _mm_unpackhi_epi8(d, z);
+    __m128i s0 = _mm_unpacklo_epi8(s, z), s1 = _mm_unpackhi_epi8(s, z);
+    __m128i a0 = _mm_unpacklo_epi8(a, z), a1 = _mm_unpackhi_epi8(a, z);
+    __m128i r0 = _mm_packus_epi32(
+        blend_epi32_sse41(_mm_unpacklo_epi16(d0, z), _mm_unpacklo_epi16(s0, z), _mm_unpacklo_epi16(a0, z)),
+        blend_epi32_sse41(_mm_unpackhi_epi16(d0, z), _mm_unpackhi_epi16(s0, z), _mm_unpackhi_epi16(a0, z)));
+    __m128i r1 = _mm_packus_epi32(
+        blend_epi32_sse41(_mm_unpacklo_epi16(d1, z), _mm_unpacklo_epi16(s1, z), _mm_unpacklo_epi16(a1, z)),
+        blend_epi32_sse41(_mm_unpackhi_epi16(d1, z), _mm_unpackhi_epi16(s1, z), _mm_unpackhi_epi16(a1, z)));
+    return _mm_packus_epi16(r0, r1);
+}
+
+// apply thresholds of bgr blending: a > 240 takes s, a > 10 takes r, otherwise keeps d
+TARGET_SSE41 static inline __m128i select_bgr_sse41(__m128i d, __m128i s, __m128i r, __m128i a)
+{
+    __m128i blend = _mm_cmpeq_epi8(_mm_max_epu8(a, _mm_set1_epi8(11)), a);
+    __m128i solid = _mm_cmpeq_epi8(_mm_max_epu8(a, _mm_set1_epi8((char)241)), a);
+    return _mm_blendv_epi8(_mm_blendv_epi8(d, r, blend), s, solid);
+}
+
+// blend 16 bgr pixels (3 registers of src) with 16 alpha values in m
+TARGET_SSE41 static inline void blend_bgr16_sse41(uchar *dst, const __m128i src[3], __m128i m)
+{
+    if (_mm_testz_si128(m, m)) // all transparent
+        return;
+    if (_mm_testc_si128(m, _mm_set1_epi8(-1))) // all opaque
+    {
+        for (int k = 0; k < 3; k++)
+            _mm_storeu_si128((__m128i *)(dst + 16*k), src[k]);
+        return;
+    }
+    const __m128i idx[3] = {
+        _mm_setr_epi8(BGR_ALPHA_IDX0), _mm_setr_epi8(BGR_ALPHA_IDX1), _mm_setr_epi8(BGR_ALPHA_IDX2)
+    };
+    for (int k = 0; k < 3; k++)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + 16*k));
+        __m128i a = _mm_shuffle_epi8(m, idx[k]);
+        __m128i r = blend_epu8_sse41(d, src[k], a);
+        _mm_storeu_si128((__m128i *)(dst + 16*k), select_bgr_sse41(d, src[k], r, a));
+    }
+}
+
+// split 16 bgra pixels into 3 registers of bgr, return the 16 alpha values
+TARGET_SSE41 static inline __m128i split_bgra16_sse41(const uchar *src, __m128i bgr[3])
+{
+    const __m128i idx = _mm_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, 3,7,11,15);
+    __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), idx);
+    __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), idx);
+    __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 32)), idx);
+    __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 48)), idx);
+    bgr[0] = _mm_blend_epi16(p0, _mm_slli_si128(p1, 12), 0xc0);
+    bgr[1] = _mm_blend_epi16(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8), 0xf0);
+    bgr[2] = _mm_blend_epi16(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4), 0xfc);
+    return _mm_unpackhi_epi64(_mm_unpackhi_epi32(p0, p1), _mm_unpackhi_epi32(p2, p3));
+}
+
+TARGET_SSE41 static void blend_bgra_over_bgra_sse41(uchar *dst, const uchar *src, int n)
+{
+    const __m128i idx = _mm_setr_epi8(BGRA_ALPHA_IDX);
+    int i = 0;
+    for (; i <= n - 4; i += 4, dst += 16, src += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        __m128i a = _mm_shuffle_epi8(s, idx);
+        if (_mm_testz_si128(a, a)) // all transparent
+            continue;
+        if (_mm_testc_si128(a, _mm_set1_epi8(-1))) // all opaque
+        {
+            _mm_storeu_si128((__m128i *)dst, s);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i *)dst);
+        _mm_storeu_si128((__m128i *)dst, blend_epu8_sse41(d, s, a));
+    }
+    blend_bgra_over_bgra_scalar(dst, src, n - i);
+}
+
+TARGET_SSE41 static void blend_bgra_over_bgr_sse41(uchar *dst, const uchar *src, int n)
+{
+    int i = 0;
+    for (; i <= n - 16; i += 16, dst += 48, src += 64)
+    {
+        __m128i s[3];
+        __m128i m = split_bgra16_sse41(src, s);
+        blend_bgr16_sse41(dst, s, m);
+    }
+    blend_bgra_over_bgr_scalar(dst, src, n - i);
+}
+
+TARGET_SSE41 static void blend_bgrm_over_bgr_sse41(uchar *dst, const uchar *src, const uchar *mask, int n)
+{
+    int i = 0;
+    for (; i <= n - 16; i += 16, dst += 48, src += 48, mask += 16)
+    {
+        __m128i m = _mm_loadu_si128((const __m128i *)mask);
+        __m128i s[3] = {
+            _mm_loadu_si128((const __m128i *)src),
+            _mm_loadu_si128((const __m128i *)(src + 16)),
+            _mm_loadu_si128((const __m128i *)(src + 32))
+        };
+        blend_bgr16_sse41(dst, s, m);
+    }
+    blend_bgrm_over_bgr_scalar(dst, src, mask, n - i);
+}
+
+// x*y/255 rounded for 16 bytes
+TARGET_SSE41 static inline __m128i mul_div255_sse41(__m128i x, __m128i y)
+{
+    __m128i z = _mm_setzero_si128(), r = _mm_set1_epi16(128);
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, z), _mm_unpacklo_epi8(y, z)), r);
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, z), _mm_unpackhi_epi8(y, z)), r);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+TARGET_SSE41 static void blend_pbgra_over_bgra_sse41(uchar *dst, const uchar *src, int n)
+{
+    const __m128i idx = _mm_setr_epi8(BGRA_ALPHA_IDX);
+    const __m128i ones = _mm_set1_epi8(-1);
+    int i = 0;
+    for (; i <= n - 4; i += 4, dst += 16, src += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        __m128i a = _mm_shuffle_epi8(s, idx);
+        if (_mm_testz_si128(a, a)) // all transparent
+            continue;
+        if (_mm_testc_si128(a, ones)) // all opaque
+        {
+            _mm_storeu_si128((__m128i *)dst, s);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i *)dst);
+        d = mul_div255_sse41(d, _mm_xor_si128(a, ones));
+        _mm_storeu_si128((__m128i *)dst, _mm_adds_epu8(s, d));
+    }
+    blend_pbgra_over_bgra_scalar(dst, src, n - i);
+}
+
+TARGET_SSE41 static void blend_pbgra_over_bgr_sse41(uchar *dst, const uchar *src, int n)
+{
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i idx[3] = {
+        _mm_setr_epi8(BGR_ALPHA_IDX0), _mm_setr_epi8(BGR_ALPHA_IDX1), _mm_setr_epi8(BGR_ALPHA_IDX2)
+    };
+    int i = 0;
+    for (; i <= n - 16; i += 16, dst += 48, src += 64)
+    {
+        __m128i s[3];
+        __m128i m = split_bgra16_sse41(src, s);
+        if (_mm_testz_si128(m, m)) // all transparent
+            continue;
+        bool opaque = _mm_testc_si128(m, ones);
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i r = s[k];
+            if (!opaque)
+            {
+                __m128i d = _mm_loadu_si128((const __m128i *)(dst + 16*k));
+                __m128i ia = _mm_xor_si128(_mm_shuffle_epi8(m, idx[k]), ones);
+                r = _mm_adds_epu8(r, mul_div255_sse41(d, ia));
+            }
+            _mm_storeu_si128((__m128i *)(dst + 16*k), r);
+        }
+    }
+    blend_pbgra_over_bgr_scalar(dst, src, n - i);
+}
+
+TARGET_AVX2 static inline __m256i blend_epi32_avx2(__m256i d, __m256i s, __m256i a)
+{
+    __m256 alpha = _mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_set1_ps(255.f));
+    __m256 beta = _mm256_sub_ps(_mm256_set1_ps(1.f), alpha);
+    __m256 r = _mm256_add_ps(_mm256_mul_ps(beta, _mm256_cvtepi32_ps(d)), _mm256_mul_ps(alpha, _mm256_cvtepi32_ps(s)));
+    return _mm256_cvttps_epi32(r);
+}
+
+// blend 32 bytes, unpack and pack work in 128-bit lanes, so the byte order is kept
+TARGET_AVX2 static inline __m256i blend_epu8_avx2(__m256i d, __m256i s, __m256i a)
+{
+    __m256i z = _mm256_setzero_si256();
+    __m256i d0 = _mm256_unpacklo_epi8(d, z), d1 = _mm256_unpackhi_epi8(d, z);
+    __m256i s0 = _mm256_unpacklo_epi8(s, z), s1 = _mm256_unpackhi_epi8(s, z);
+    __m256i a0 = _mm256_unpacklo_epi8(a, z), a1 = _mm256_unpackhi_epi8(a, z);
+    __m256i r0 = _mm256_packus_epi32(
+        blend_epi32_avx2(_mm256_unpacklo_epi16(d0, z), _mm256_unpacklo_epi16(s0, z), _mm256_unpacklo_epi16(a0, z)),
+        blend_epi32_avx2(_mm256_unpackhi_epi16(d0, z), _mm256_unpackhi_epi16(s0, z), _mm256_unpackhi_epi16(a0, z)));
+    __m256i r1 = _mm256_packus_epi32(
+        blend_epi32_avx2(_mm256_unpacklo_epi16(d1, z), _mm256_unpacklo_epi16(s1, z), _mm256_unpacklo_epi16(a1, z)),
+        blend_epi32_avx2(_mm256_unpackhi_epi16(d1, z), _mm256_unpackhi_epi16(s1, z), _mm256_unpackhi_epi16(a1, z)));
+    return _mm256_packus_epi16(r0, r1);
+}
+
+TARGET_AVX2 static inline __m256i select_bgr_avx2(__m256i d, __m256i s, __m256i r, __m256i a)
+{
+    __m256i blend = _mm256_cmpeq_epi8(_mm256_max_epu8(a, _mm256_set1_epi8(11)), a);
+    __m256i solid = _mm256_cmpeq_epi8(_mm256_max_epu8(a, _mm256_set1_epi8((char)241)), a);
+    return _mm256_blendv_epi8(_mm256_blendv_epi8(d, r, blend), s, solid);
+}
+
+TARGET_AVX2 static inline __m256i combine_avx2(__m128i lo, __m128i hi)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+// blend 32 bgr pixels (6 registers of src) with 32 alpha values in mlo/mhi
+TARGET_AVX2 static inline void blend_bgr32_avx2(uchar *dst, const __m128i src[6], __m128i mlo, __m128i mhi)
+{
+    __m256i m = combine_avx2(mlo, mhi);
+    if (_mm256_testz_si256(m, m)) // all transparent
+        return;
+    if (_mm256_testc_si256(m, _mm256_set1_epi8(-1))) // all opaque
+    {
+        for (int k = 0; k < 3; k++)
+            _mm256_storeu_si256((__m256i *)(dst + 32*k), combine_avx2(src[2*k], src[2*k+1]));
+        return;
+    }
+    // the k-th register covers bytes of pixel [32k/3, (32k+31)/3]
+    const __m256i idx[3] = {
+        _mm256_setr_epi8(BGR_ALPHA_IDX0, BGR_ALPHA_IDX1),
+        _mm256_setr_epi8(BGR_ALPHA_IDX2, BGR_ALPHA_IDX0),
+        _mm256_setr_epi8(BGR_ALPHA_IDX1, BGR_ALPHA_IDX2)
+    };
+    const __m256i msk[3] = {
+        combine_avx2(mlo, mlo), combine_avx2(mlo, mhi), combine_avx2(mhi, mhi)
+    };
+    for (int k = 0; k < 3; k++)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + 32*k));
+        __m256i s = combine_avx2(src[2*k], src[2*k+1]);
+        __m256i a = _mm256_shuffle_epi8(msk[k], idx[k]);
+        __m256i r = blend_epu8_avx2(d, s, a);
+        _mm256_storeu_si256((__m256i *)(dst + 32*k), select_bgr_avx2(d, s, r, a));
+    }
+}
+
+TARGET_AVX2 static void blend_bgra_over_bgra_avx2(uchar *dst, const uchar *src, int n)
+{
+    const __m256i idx = _mm256_setr_epi8(BGRA_ALPHA_IDX, BGRA_ALPHA_IDX);
+    int i = 0;
+    for (; i <= n - 8; i += 8, dst += 32, src += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)src);
+        __m256i a = _mm256_shuffle_epi8(s, idx);
+        if (_mm256_testz_si256(a, a)) // all transparent
+            continue;
+        if (_mm256_testc_si256(a, _mm256_set1_epi8(-1))) // all opaque
+        {
+            _mm256_storeu_si256((__m256i *)dst, s);
+            continue;
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i *)dst);
+        _mm256_storeu_si256((__m256i *)dst, blend_epu8_avx2(d, s, a));
+    }
+    blend_bgra_over_bgra_sse41(dst, src, n - i);
+}
+
+TARGET_AVX2 static void blend_bgra_over_bgr_avx2(uchar *dst, const uchar *src, int n)
+{
+    int i = 0;
+    for (; i <= n - 32; i += 32, dst += 96, src += 128)
+    {
+        __m128i s[6];
+        __m128i mlo = split_bgra16_sse41(src, s);
+        __m128i mhi = split_bgra16_sse41(src + 64, s + 3);
+        blend_bgr32_avx2(dst, s, mlo, mhi);
+    }
+    blend_bgra_over_bgr_sse41(dst, src, n - i);
+}
+
+TARGET_AVX2 static void blend_bgrm_over_bgr_avx2(uchar *dst, const uchar *src, const uchar *mask, int n)
+{
+    int i = 0;
+    for (; i <= n - 32; i += 32, dst += 96, src += 96, mask += 32)
+    {
+        __m128i s[6];
+        for (int k = 0; k < 6; k++)
+            s[k] = _mm_loadu_si128((const __m128i *)(src + 16*k));
+        __m128i mlo = _mm_loadu_si128((const __m128i *)mask);
+        __m128i mhi = _mm_loadu_si128((const __m128i *)(mask + 16));
+        blend_bgr32_avx2(dst, s, mlo, mhi);
+    }
+    blend_bgrm_over_bgr_sse41(dst, src, mask, n - i);
+}
+TARGET_AVX2 static inline __m256i mul_div255_avx2(__m256i x, __m256i y)
+{
+    __m256i z = _mm256_setzero_si256(), r = _mm256_set1_epi16(128);
+    __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(x, z), _mm256_unpacklo_epi8(y, z)), r);
+    __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(x, z), _mm256_unpackhi_epi8(y, z)), r);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+TARGET_AVX2 static void blend_pbgra_over_bgra_avx2(uchar *dst, const uchar *src, int n)
+{
+    const __m256i idx = _mm256_setr_epi8(BGRA_ALPHA_IDX, BGRA_ALPHA_IDX);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    int i = 0;
+    for (; i <= n - 8; i += 8, dst += 32, src += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)src);
+        __m256i a = _mm256_shuffle_epi8(s, idx);
+        if (_mm256_testz_si256(a, a)) // all transparent
+            continue;
+        if (_mm256_testc_si256(a, ones)) // all opaque
+        {
+            _mm256_storeu_si256((__m256i *)dst, s);
+            continue;
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i *)dst);
+        d = mul_div255_avx2(d, _mm256_xor_si256(a, ones));
+        _mm256_storeu_si256((__m256i *)dst, _mm256_adds_epu8(s, d));
+    }
+    blend_pbgra_over_bgra_sse41(dst, src, n - i);
+}
+
+TARGET_AVX2 static void blend_pbgra_over_bgr_avx2(uchar *dst, const uchar *src, int n)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i idx[3] = {
+        _mm256_setr_epi8(BGR_ALPHA_IDX0, BGR_ALPHA_IDX1),
+        _mm256_setr_epi8(BGR_ALPHA_IDX2, BGR_ALPHA_IDX0),
+        _mm256_setr_epi8(BGR_ALPHA_IDX1, BGR_ALPHA_IDX2)
+    };
+    int i = 0;
+    for (; i <= n - 32; i += 32, dst += 96, src += 128)
+    {
+        __m128i s[6];
+        __m128i mlo = split_bgra16_sse41(src, s);
+        __m128i mhi = split_bgra16_sse41(src + 64, s + 3);
+        __m256i m = combine_avx2(mlo, mhi);
+        if (_mm256_testz_si256(m, m)) // all transparent
+            continue;
+        bool opaque = _mm256_testc_si256(m, ones);
+        const __m256i msk[3] = {
+            combine_avx2(mlo, mlo), combine_avx2(mlo, mhi), combine_avx2(mhi, mhi)
+        };
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i r = combine_avx2(s[2*k], s[2*k+1]);
+            if (!opaque)
+            {
+                __m256i d = _mm256_loadu_si256((const __m256i *)(dst + 32*k));
+                __m256i ia = _mm256_xor_si256(_mm256_shuffle_epi8(msk[k], idx[k]), ones);
+                r = _mm256_adds_epu8(r, mul_div255_avx2(d, ia));
+            }
+            _mm256_storeu_si256((__m256i *)(dst + 32*k), r);
+        }
+    }
+    blend_pbgra_over_bgr_sse41(dst, src, n - i);
+}
+#endif // BLEND_X86
+
+//
+// runtime dispatching
+//
+struct BlendKernels
+{
+    BlendISA isa;
+    void (*bgra_over_bgra)(uchar *dst, const uchar *src, int n);
+    void (*bgra_over_bgr)(uchar *dst, const uchar *src, int n);
+    void (*bgrm_over_bgr)(uchar *dst, const uchar *src, const uchar *mask, int n);
+    void (*pbgra_over_bgra)(uchar *dst, const uchar *src, int n);
+    void (*pbgra_over_bgr)(uchar *dst, const uchar *src, int n);
+};
+
+static BlendKernels get_kernels(BlendISA isa)
+{
+    switch (isa)
+    {
+#ifdef BLEND_X86
+    case BLEND_AVX2:
+        return {BLEND_AVX2, blend_bgra_over_bgra_avx2, blend_bgra_over_bgr_avx2, blend_bgrm_over_bgr_avx2,
+                blend_pbgra_over_bgra_avx2, blend_pbgra_over_bgr_avx2};
+    case BLEND_SSE41:
+        return {BLEND_SSE41, blend_bgra_over_bgra_sse41, blend_bgra_over_bgr_sse41, blend_bgrm_over_bgr_sse41,
+                blend_pbgra_over_bgra_sse41, blend_pbgra_over_bgr_sse41};
+#endif
+    default:
+        return {BLEND_SCALAR, blend_bgra_over_bgra_scalar, blend_bgra_over_bgr_scalar, blend_bgrm_over_bgr_scalar,
+                blend_pbgra_over_bgra_scalar, blend_pbgra_over_bgr_scalar};
+    }
+}
+
+BlendISA blend_detect_isa()
+{
+#ifdef BLEND_X86
+    __builtin_cpu_init(); // may run before constructors of libgcc
+    if (__builtin_cpu_supports("avx2"))
+        return BLEND_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return BLEND_SSE41;
+#endif
+    return BLEND_SCALAR;
+}
+
+// selected once at startup
+static BlendKernels blend_kernels = get_kernels(blend_detect_isa());
+
+int blend_set_isa(BlendISA isa)
+{
+    if (isa > blend_detect_isa())
+        return -1;
+    blend_kernels = get_kernels(isa);
+    return 0;
+}
+
+BlendISA blend_get_isa()
+{
+    return blend_kernels.isa;
+}
+
+const char *blend_isa_name(BlendISA isa)
+{
+    switch (isa)
+    {
+    case BLEND_AVX2:
+        return "avx2";
+    case BLEND_SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+void blend_bgra_over_bgra(uchar *dst, const uchar *src, int n)
+{
+    blend_kernels.bgra_over_bgra(dst, src, n);
+}
+
+void blend_bgra_over_bgr(uchar *dst, const uchar *src, int n)
+{
+    blend_kernels.bgra_over_bgr(dst, src, n);
+}
+
+void blend_bgrm_over_bgr(uchar *dst, const uchar *src, const uchar *mask, int n)
+{
+    blend_kernels.bgrm_over_bgr(dst, src, mask, n);
+}
+
+void blend_pbgra_over_bgra(uchar *dst, const uchar *src, int n)
+{
+    blend_kernels.pbgra_over_bgra(dst, src, n);
+}
+
+void blend_pbgra_over_bgr(uchar *dst, const uchar *src, int n)
+{
+    blend_kernels.pbgra_over_bgr(dst, src, n);
+}
+
+//
+// kernels specialized per layer configuration, processed in chunks on the stack, so that
+// converted pixels stay in L1 cache and no memory is allocated
+//
+template <BlendSrc SRC, int SCN, int DCN, bool OPACITY, bool MASK>
+static void blend_row(uchar *dst, const uchar *src, const uchar *mask, int n, int opacity)
+{
+    const int chunk = 256;
+    uchar buf[chunk * 4], alpha[chunk];
+    for (int i = 0; i < n; i += chunk)
+    {
+        int k = n - i < chunk? n - i : chunk;
+        uchar *d = dst + i * DCN;
+        const uchar *s = src + i * SCN;
+        const uchar *m = MASK? mask + i : NULL;
+        if (SRC == BLEND_SRC_PREMULTIPLIED)
+        {
+            if (DCN == 4)
+                blend_pbgra_over_bgra(d, s, k);
+            else
+                blend_pbgra_over_bgr(d, s, k);
+        }
+        else if (SRC == BLEND_SRC_OPAQUE && !OPACITY) // copy
+        {
+            if (SCN == DCN)
+            {
+                memcpy(d, s, k * SCN);
+                continue;
+            }
+            for (int j = 0; j < k; j++, d += DCN, s += SCN)
+            {
+                d[0] = s[0];
+                d[1] = s[1];
+                d[2] = s[2];
+                if (DCN == 4)
+                    d[3] = 0xff;
+            }
+        }
+        else if (SRC == BLEND_SRC_STRAIGHT && SCN == 4 && DCN == 4 && !OPACITY && !MASK)
+        {
+            blend_bgra_over_bgra(d, s, k);
+        }
+        else if (SRC == BLEND_SRC_STRAIGHT && SCN == 4 && DCN == 3 && !OPACITY && !MASK)
+        {
+            blend_bgra_over_bgr(d, s, k);
+        }
+        else if (SCN == 3 && DCN == 3) // bgr with mask or a constant alpha
+        {
+            const uchar *a = m;
+            if (!MASK)
+                memset(alpha, opacity, k);
+            else if (OPACITY)
+                for (int j = 0; j < k; j++)
+                    alpha[j] = div255(m[j] * opacity);
+            if (!MASK || OPACITY)
+                a = alpha;
+            blend_bgrm_over_bgr(d, s, a, k);
+        }
+        else // expand to straight bgra with alpha from src, mask or opacity
+        {
+            uchar *b = buf;
+            for (int j = 0; j < k; j++, b += 4, s += SCN)
+            {
+                int a = MASK? m[j] : (SRC == BLEND_SRC_STRAIGHT && SCN == 4? s[3] : 0xff);
+                b[0] = s[0];
+                b[1] = s[1];
+                b[2] = s[2];
+                b[3] = OPACITY? div255(a * opacity) : a;
+            }
+            if (DCN == 4)
+                blend_bgra_over_bgra(d, buf, k);
+            else
+                blend_bgra_over_bgr(d, buf, k);
+        }
+    }
+}
+
+template <BlendSrc SRC, int SCN, int DCN>
+static BlendRowFunc get_row_func(bool has_opacity, bool has_mask)
+{
+    if (has_opacity)
+        return has_mask? blend_row<SRC, SCN, DCN, true, true> : blend_row<SRC, SCN, DCN, true, false>;
+    return has_mask? blend_row<SRC, SCN, DCN, false, true> : blend_row<SRC, SCN, DCN, false, false>;
+}
+
+template <BlendSrc SRC>
+static BlendRowFunc get_row_func(int src_cn, int dst_cn, bool has_opacity, bool has_mask)
+{
+    if (src_cn == 3)
+        return dst_cn == 3? get_row_func<SRC, 3, 3>(has_opacity, has_mask) : get_row_func<SRC, 3, 4>(has_opacity, has_mask);
+    return dst_cn == 3? get_row_func<SRC, 4, 3>(has_opacity, has_mask) : get_row_func<SRC, 4, 4>(has_opacity, has_mask);
+}
+
+BlendRowFunc blend_get_row_func(BlendSrc src, int src_cn, int dst_cn, bool has_opacity, bool has_mask)
+{
+    if ((src_cn != 3 && src_cn != 4) || (dst_cn != 3 && dst_cn != 4))
+        return NULL;
+    switch (src)
+    {
+    case BLEND_SRC_OPAQUE:
+        if (has_mask)
+            return NULL;
+        return get_row_func<BLEND_SRC_OPAQUE>(src_cn, dst_cn, has_opacity, false);
+    case BLEND_SRC_STRAIGHT:
+        if (src_cn == 3 && !has_mask) // no alpha at all
+            return NULL;
+        return get_row_func<BLEND_SRC_STRAIGHT>(src_cn, dst_cn, has_opacity, has_mask);
+    case BLEND_SRC_PREMULTIPLIED:
+        if (src_cn != 4 || has_opacity || has_mask)
+            return NULL;
+        return get_row_func<BLEND_SRC_PREMULTIPLIED>(4, dst_cn, false, false);
+    default:
+        return NULL;
+    }
+}
@@ -0,0 +1,76 @@
+//
+// alpha blending kernels used by the CPU compositor
+//
+#pragma once
+#include <opencv2/core.hpp>
+
+// instruction sets a blending kernel can be built for
+enum BlendISA
+{
+    BLEND_SCALAR = 0,
+    BLEND_SSE41,
+    BLEND_AVX2,
+};
+
+// All kernels blend n continuous pixels of one row, results are bit-exact
+// among all instruction sets, i.e. the same as the float formula:
+//     dst = (uchar)((1-alpha)*dst + alpha*src), alpha = a/255.f
+
+// blend BGRA src over BGRA dst, all 4 channels including alpha are blended
+void blend_bgra_over_bgra(uchar *dst, const uchar *src, int n);
+// blend BGRA src over BGR dst, alpha > 240 is copied, alpha <= 10 is skipped
+void blend_bgra_over_bgr(uchar *dst, const uchar *src, int n);
+// blend BGR src over BGR dst using a single channel mask as alpha, thresholds are the same as above
+void blend_bgrm_over_bgr(uchar *dst, const uchar *src, const uchar *mask, int n);
+
+// Kernels of premultiplied alpha, in integer math, one multiply-add per channel:
+//     dst = src + dst*(255-a)/255
+
+// blend premultiplied BGRA src over BGRA dst, all 4 channels are blended
+void blend_pbgra_over_bgra(uchar *dst, const uchar *src, int n);
+// blend premultiplied BGRA src over BGR dst
+void blend_pbgra_over_bgr(uchar *dst, const uchar *src, int n);
+
+// convert BGRA src to premultiplied BGRA dst, alpha is scaled by opacity (0-255) at the same time
+// dst may be the same as src
+void premultiply_bgra(uchar *dst, const uchar *src, int n, int opacity);
+// convert BGR src to premultiplied BGRA dst with alpha of opacity (0-255)
+void premultiply_bgr(uchar *dst, const uchar *src, int n, int opacity);
+
+// blend 2 rows of BGRA src over the same rows of an i420 image, n is even, y0/y1 are the luma rows
+// and u/v the chroma row of them, src may be premultiplied, alpha 0 keeps dst exactly
+void blend_bgra_over_i420(uchar *y0, uchar *y1, uchar *u, uchar *v,
+                          const uchar *src0, const uchar *src1, int n, bool premultiplied);
+
+// Sample one row of a scaled image of cn channels into dst, n pixels, so that scaling can be
+// fused with blending without a resized image. xofs0/xofs1 are byte offsets of the left/right
+// source pixels of each dst pixel, wx and wy are weights (0-256) of the right pixel and src1 row.
+void scale_row_linear(uchar *dst, const uchar *src0, const uchar *src1, int wy,
+                      const int *xofs0, const int *xofs1, const short *wx, int n, int cn);
+void scale_row_nearest(uchar *dst, const uchar *src, const int *xofs, int n, int cn);
+
+// Row kernels specialized at compile time for one layer configuration, so that formats are not
+// negotiated per frame and nothing is converted into temporary images:
+//  - src, how the color of src is weighted, see BlendSrc
+//  - src_cn/dst_cn, 3 (bgr) or 4 (bgra) channels of src and dst, dst alpha is blended too if 4
+//  - has_opacity, alpha is scaled by opacity (1-255) while blending
+//  - has_mask, alpha of straight src is taken from mask instead of src
+// Results are the same as converting src to bgra (or bgr+mask) with opacity applied first and
+// calling the kernels above on it.
+enum BlendSrc
+{
+    BLEND_SRC_OPAQUE = 0,   // copied like OverlapImageBGR(), or blended with alpha of opacity if has_opacity
+    BLEND_SRC_STRAIGHT,     // alpha in channel 3 or mask
+    BLEND_SRC_PREMULTIPLIED,// premultiplied bgra, opacity already applied
+};
+typedef void (*BlendRowFunc)(uchar *dst, const uchar *src, const uchar *mask, int n, int opacity);
+// return NULL if the combination is not supported
+BlendRowFunc blend_get_row_func(BlendSrc src, int src_cn, int dst_cn, bool has_opacity, bool has_mask);
+
+// best instruction set supported by the running cpu
+BlendISA blend_detect_isa();
+// force kernels to use the given instruction set, return -1 if not supported by cpu
+int blend_set_isa(BlendISA isa);
+// instruction set currently in use
+BlendISA blend_get_isa();
+const char *blend_isa_name(BlendISA isa);
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "chromakey.h"
+#include "blend.h"
+#include "AutoTime.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define CHROMAKEY_X86
+#include <immintrin.h>
+#endif
+
+extern int enable_debug;
+
+void chromakey_init(ChromaKey &key, const uchar bgr[3], int tolerance, int softness, bool despill)
+{
+    static const uchar green[3] = {0, 255, 0};
+    if (!bgr)
+        bgr = green;
+    memcpy(key.color, bgr, 3);
+    key.tolerance = std::min(std::max(tolerance, 0), 444);
+    key.softness = std::min(std::max(softness, 1), 444);
+    key.despill = despill;
+
+    int b = bgr[0], g = bgr[1], r = bgr[2];
+    key.cb = (-38*r - 74*g + 112*b) >> 8;
+    key.cr = (112*r - 94*g - 18*b) >> 8;
+    key.k = (255*16 + key.softness/2) / key.softness;
+    key.spill = (g >= b && g >= r)? 1 : (b >= r? 0 : 2);
+}
+
+//
+// scalar kernel, also the reference of simd kernel
+//
+static inline uchar key_alpha(const uchar *s, const ChromaKey &key)
+{
+    int b = s[0], g = s[1], r = s[2];
+    int cb = (-38*r - 74*g + 112*b) >> 8;
+    int cr = (112*r - 94*g - 18*b) >> 8;
+    int d = abs(cb - key.cb) + abs(cr - key.cr);
+    int t = std::min(std::max(d - key.tolerance, 0), key.softness);
+    return (uchar)std::min((t * key.k) >> 4, 255);
+}
+
+static void key_row_scalar(uchar *mask, const uchar *src, int n, int cn, const ChromaKey &key)
+{
+    for (int i = 0; i < n; i++, src += cn)
+        mask[i] = key_alpha(src, key);
+}
+
+#ifdef CHROMAKEY_X86
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+
+// 16 alphas from 16 bgr pixels in b/g/r of epi16 (8 pixels each half)
+TARGET_SSE41 static inline __m128i key_alpha8_sse41(__m128i b, __m128i g, __m128i r, const ChromaKey &key)
+{
+    // partial sums stay in 16 bits: -38r-74g >= -28305, 112r-94g <= 28560
+    __m128i cb = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-38)),
+                    _mm_mullo_epi16(g, _mm_set1_epi16(-74))), _mm_mullo_epi16(b, _mm_set1_epi16(112)));
+    __m128i cr = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+                    _mm_mullo_epi16(g, _mm_set1_epi16(-94))), _mm_mullo_epi16(b, _mm_set1_epi16(-18)));
+    cb = _mm_srai_epi16(cb, 8);
+    cr = _mm_srai_epi16(cr, 8);
+    __m128i d = _mm_add_epi16(_mm_abs_epi16(_mm_sub_epi16(cb, _mm_set1_epi16(key.cb))),
+                    _mm_abs_epi16(_mm_sub_epi16(cr, _mm_set1_epi16(key.cr))));
+    __m128i t = _mm_sub_epi16(d, _mm_set1_epi16(key.tolerance));
+    t = _mm_min_epi16(_mm_max_epi16(t, _mm_setzero_si128()), _mm_set1_epi16(key.softness));
+    return _mm_srli_epi16(_mm_mullo_epi16(t, _mm_set1_epi16(key.k)), 4);
+}
+
+TARGET_SSE41 static void key_row_bgr_sse41(uchar *mask, const uchar *src, int n, const ChromaKey &key)
+{
+    // deinterleave 16 bgr pixels of 3 registers into b, g, r
+    const __m128i sb0 = _mm_setr_epi8(0,3,6,9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m128i sb1 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,2,5,8,11,14,-1,-1,-1,-1,-1);
+    const __m128i sb2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,1,4,7,10,13);
+    const __m128i sg0 = _mm_setr_epi8(1,4,7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m128i sg1 = _mm_setr_epi8(-1,-1,-1,-1,-1,0,3,6,9,12,15,-1,-1,-1,-1,-1);
+    const __m128i sg2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,2,5,8,11,14);
+    const __m128i sr0 = _mm_setr_epi8(2,5,8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m128i sr1 = _mm_setr_epi8(-1,-1,-1,-1,-1,1,4,7,10,13,-1,-1,-1,-1,-1,-1);
+    const __m128i sr2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,0,3,6,9,12,15);
+    int i = 0;
+    for (; i + 16 <= n; i += 16, src += 48)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i x2 = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(x0, sb0), _mm_shuffle_epi8(x1, sb1)), _mm_shuffle_epi8(x2, sb2));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(x0, sg0), _mm_shuffle_epi8(x1, sg1)), _mm_shuffle_epi8(x2, sg2));
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(x0, sr0), _mm_shuffle_epi8(x1, sr1)), _mm_shuffle_epi8(x2, sr2));
+        __m128i z = _mm_setzero_si128();
+        __m128i lo = key_alpha8_sse41(_mm_unpacklo_epi8(b, z), _mm_unpacklo_epi8(g, z), _mm_unpacklo_epi8(r, z), key);
+        __m128i hi = key_alpha8_sse41(_mm_unpackhi_epi8(b, z), _mm_unpackhi_epi8(g, z), _mm_unpackhi_epi8(r, z), key);
+        _mm_storeu_si128((__m128i *)(mask + i), _mm_packus_epi16(lo, hi));
+    }
+    key_row_scalar(mask + i, src, n - i, 3, key);
+}
+#endif
+
+static void key_row(uchar *mask, const uchar *src, int n, int cn, const ChromaKey &key)
+{
+#ifdef CHROMAKEY_X86
+    // avx2 brings little over sse4.1 here, as bgr deinterleaving does not cross 128-bit lanes
+    if (cn == 3 && blend_get_isa() != BLEND_SCALAR)
+    {
+        key_row_bgr_sse41(mask, src, n, key);
+        return;
+    }
+#endif
+    key_row_scalar(mask, src, n, cn, key);
+}
+
+void ChromaKeyImage(cv::Mat &frame, cv::Mat &result, cv::Mat &mask, const ChromaKey &key)
+{
+    AUTOTIMED("ChromaKeyImage run", enable_debug);
+    cv::Mat src = frame; // keep source alive, result may be the same mat as frame
+    int cn = src.channels();
+    if (!(result.data == src.data && cn == 3))
+        result.create(src.size(), CV_8UC3);
+    mask.create(src.size(), CV_8U);
+
+    cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range) {
+        for (int r = range.start; r < range.end; r++)
+        {
+            const uchar *s = src.ptr<uchar>(r);
+            uchar *d = result.ptr<uchar>(r), *m = mask.ptr<uchar>(r);
+            key_row(m, s, src.cols, cn, key);
+            if (cn == 4 || d != s)
+            {
+                for (int c = 0; c < src.cols; c++)
+                {
+                    memcpy(d + c*3, s + c*cn, 3);
+                    if (cn == 4) // keep source alpha
+                        m[c] = (uchar)((m[c] * s[c*4+3] + 127) / 255);
+                }
+            }
+            if (!key.despill)
+                continue;
+            // limit the key channel of edge pixels to the larger of the other two
+            int k = key.spill, o1 = (k + 1) % 3, o2 = (k + 2) % 3;
+            for (int c = 0; c < src.cols; c++, d += 3)
+            {
+                if (m[c] == 0 || m[c] == 255)
+                    continue;
+                uchar limit = std::max(d[o1], d[o2]);
+                if (d[k] > limit)
+                    d[k] = limit;
+            }
+        }
+    }, std::max(1, src.rows / 32));
+}
@@ -0,0 +1,28 @@
+//
+// chroma keyer, removes a solid color background in one pass
+//
+#pragma once
+#include <opencv2/core.hpp>
+
+// Pixels are compared to the key color by chroma distance |cb-cb'| + |cr-cr'| (bt.601, -222 - 222),
+// distance <= tolerance is transparent, >= tolerance+softness is opaque, and soft alpha in between.
+struct ChromaKey
+{
+    uchar color[3];     // key color in bgr
+    int tolerance;      // 0 - 444
+    int softness;       // 1 - 444
+    bool despill;       // remove key color spill of semi-transparent pixels
+
+    // derived by chromakey_init()
+    short cb, cr;       // chroma of key color
+    short k;            // alpha = (distance - tolerance) * k >> 4
+    int spill;          // dominant channel of key color
+};
+
+// default key is pure green
+void chromakey_init(ChromaKey &key, const uchar bgr[3] = NULL, int tolerance = 100, int softness = 40, bool despill = true);
+
+// Key out the background of a bgr or bgra frame, result is a bgr image and a single channel mask,
+// i.e. FT_BGRM layout, alpha of bgra frame is multiplied into mask. result may be the same as frame
+// if frame is bgr. Rows are keyed on multiple threads, with simd if supported by cpu.
+void ChromaKeyImage(cv::Mat &frame, cv::Mat &result, cv::Mat &mask, const ChromaKey &key);
@@ -0,0 +1,324 @@
+#include <unistd.h>
+#include <algorithm>
+#include "compositor.h"
+#include "matops.h"
+#include "AutoTime.h"
+
+using namespace std;
+using namespace cv;
+
+extern int enable_debug;
+
+void BandCompositor::Add(material &m, cv::Mat &base, int display_width, int display_height, cv::Mat &image, cv::Mat &mask, bool output_alpha)
+{
+    if (base.empty())
+    {
+        // nothing to blend with, base is created from image
+        OverlapImage(m, base, display_width, display_height, image, mask, output_alpha);
+        return;
+    }
+
+    // do everything that changes image here, so that bands only read it,
+    // formats of image and base are not converted but handled by the resolved kernel
+    Layer l;
+    l.ftype = m.ctx.ftype;
+    l.x = m.rect.x;
+    l.y = m.rect.y;
+    l.opacity = m.ctx.blend_opacity;
+    int w = m.rect.width, h = m.rect.height;
+    // video frames are replaced every frame, resizing them in place saves nothing,
+    // they are scaled while blending instead, others keep the resized image in cache
+    bool resize = (m.type != material::MT_Video && m.type != material::MT_MainVideo);
+    switch (l.ftype)
+    {
+    case materialcontext::FT_BGR:
+    case materialcontext::FT_BGRA:
+    case materialcontext::FT_PBGRA:
+        if (resize)
+            ResizeOverlapImage(image, NULL, w, h);
+        l.image = image;
+        break;
+    case materialcontext::FT_BGRM:
+        if (resize)
+            ResizeOverlapImage(image, &mask, w, h);
+        l.image = image;
+        l.mask = mask;
+        break;
+    case materialcontext::FT_I420:
+        l.image = image;
+        break;
+    default:
+        return;
+    }
+    if (l.image.empty() || (l.ftype == materialcontext::FT_BGRM && l.mask.size() != l.image.size()))
+        return;
+    const uchar *frame_data = l.image.data;
+    l.blend = i420? NULL : ResolveBlend(m, l.image, base.channels());
+    if (!i420 && !l.blend)
+        return;
+    l.w = w? w : l.image.cols;
+    l.h = h? h : (l.ftype == materialcontext::FT_I420? l.image.rows*2/3 : l.image.rows);
+    bool rotate = m.ctx.blend_rotation && l.ftype != materialcontext::FT_I420;
+    if (rotate)
+    {
+        // frame is rotated while blending, bands only need to know its bounding box
+        l.rotate = GetRotateMap(m, l.image);
+        l.x += l.rotate->bbox.x;
+        l.y += l.rotate->bbox.y;
+        l.w = l.rotate->bbox.width;
+        l.h = l.rotate->bbox.height;
+    }
+    if (i420 && (rotate || (l.opacity && l.ftype != materialcontext::FT_PBGRA)))
+    {
+        // no opacity or rotation in i420 kernels, they are applied into a premultiplied image first,
+        // which is kept until the frame changes, and converted into the same buffer when it does
+        auto &c = m.ctx;
+        if (c.blend_src.empty() || c.blend_src_data != frame_data || c.blend_src_cts != c.cts ||
+            c.blend_src_opacity != l.opacity || c.blend_src_map != l.rotate)
+        {
+            if (c.blend_src.u && c.blend_src.u->refcount > 1) // still queued, or shared by a copy of m
+                c.blend_src.release();
+            bool ok = rotate? RotateImage(l.ftype, l.image, l.mask, l.opacity, *l.rotate, c.blend_src) :
+                            ToPBGRA(l.ftype, l.image, l.mask, l.opacity, c.blend_src);
+            if (!ok)
+            {
+                c.blend_src.release();
+                return;
+            }
+            c.blend_src_data = frame_data;
+            c.blend_src_cts = c.cts;
+            c.blend_src_opacity = l.opacity;
+            c.blend_src_map = l.rotate;
+        }
+        l.image = c.blend_src;
+        l.mask = cv::Mat();
+        l.ftype = materialcontext::FT_PBGRA;
+        l.rotate.reset();
+    }
+    if (i420)
+        l.opacity = 0;
+
+    l.is_static = (m.type == material::MT_Image || m.type == material::MT_Text ||
+            m.type == material::MT_Time || m.type == material::MT_Clock) && l.ftype != materialcontext::FT_BGRM;
+    // time/clock changes its cts and image at each tick
+    l.key = {m.material_id, m.product_id, l.ftype, l.x, l.y, l.w, l.h, frame_data, m.ctx.cts};
+    layers.push_back(l);
+}
+
+void BandCompositor::Invalidate(int product_id, int material_id)
+{
+    runs.erase(std::remove_if(runs.begin(), runs.end(), [&](const FlatRun &run)->bool{
+            for (auto &k : run.keys)
+            {
+                if ((product_id <= 0 || k.product_id == product_id) && (material_id <= 0 || k.material_id == material_id))
+                    return true;
+            }
+            return false;
+        }), runs.end());
+}
+
+static bool IsTransparent(const cv::Mat &pbgra)
+{
+    for (int r=0; r<pbgra.rows; r++)
+    {
+        const uchar *p = pbgra.ptr<uchar>(r);
+        for (int c=0; c<pbgra.cols; c++)
+        {
+            if (p[c*4+3])
+                return false;
+        }
+    }
+    return true;
+}
+
+void BandCompositor::BuildRun(FlatRun &run, cv::Size frame, int base_cn, size_t begin, size_t end)
+{
+    AUTOTIMED("Flatten static layers run", enable_debug);
+    run.keys.clear();
+    run.tiles.clear();
+    run.used = false;
+
+    cv::Rect bbox(layers[begin].x, layers[begin].y, layers[begin].w, layers[begin].h);
+    for (size_t i=begin; i<end; i++)
+    {
+        auto &l = layers[i];
+        run.keys.push_back(l.key);
+        bbox |= cv::Rect(l.x, l.y, l.w, l.h);
+    }
+    bbox &= cv::Rect(cv::Point(0, 0), frame);
+    if (bbox.empty())
+        return;
+
+    // "over" is associative in premultiplied alpha, so the run can be blended in advance
+    cv::Mat canvas = cv::Mat::zeros(bbox.size(), CV_8UC4);
+    for (size_t i=begin; i<end; i++)
+    {
+        auto &l = layers[i];
+        cv::Mat pbgra = ToPBGRA(l.ftype, l.image, l.mask, 255), mask;
+        if (!pbgra.empty())
+            OverlapImage(materialcontext::FT_PBGRA, canvas, pbgra, mask, l.x - bbox.x, l.y - bbox.y, l.w, l.h);
+    }
+
+    // keep non-transparent tiles only, so that the space between stickers costs nothing,
+    // neighbouring tiles in the same row are merged into one layer
+    const int tile = 32;
+    for (int ty=0; ty<canvas.rows; ty+=tile)
+    {
+        int th = std::min(tile, canvas.rows - ty);
+        int start = -1;
+        for (int tx=0; ; tx+=tile)
+        {
+            bool visible = tx < canvas.cols &&
+                !IsTransparent(canvas(cv::Rect(tx, ty, std::min(tile, canvas.cols - tx), th)));
+            if (visible && start < 0)
+            {
+                start = tx;
+            }
+            else if (!visible && start >= 0)
+            {
+                Layer l;
+                l.ftype = materialcontext::FT_PBGRA;
+                l.blend = GetBlendRowFunc(l.ftype, 4, base_cn, false);
+                l.opacity = 0;
+                l.image = canvas(cv::Rect(start, ty, std::min(tx, canvas.cols) - start, th));
+                l.x = bbox.x + start;
+                l.y = bbox.y + ty;
+                l.w = l.image.cols;
+                l.h = l.image.rows;
+                l.is_static = false;
+                run.tiles.push_back(l);
+                start = -1;
+            }
+            if (tx >= canvas.cols)
+                break;
+        }
+    }
+}
+
+void BandCompositor::Flatten(cv::Size frame, int base_cn)
+{
+    std::vector<Layer> flat;
+    size_t i = 0;
+    while (i < layers.size())
+    {
+        size_t j = i;
+        while (j < layers.size() && layers[j].is_static)
+            j++;
+        if (j - i < 2) // nothing to flatten
+        {
+            flat.push_back(layers[i++]);
+            continue;
+        }
+
+        FlatRun *run = NULL;
+        for (auto &r : runs)
+        {
+            if (r.used || r.keys.size() != j - i)
+                continue;
+            size_t k = 0;
+            while (k < r.keys.size() && r.keys[k] == layers[i+k].key)
+                k++;
+            if (k == r.keys.size())
+            {
+                run = &r;
+                break;
+            }
+        }
+        if (!run) // new or changed run
+        {
+            runs.push_back(FlatRun());
+            run = &runs.back();
+            BuildRun(*run, frame, base_cn, i, j);
+        }
+        run->used = true;
+        flat.insert(flat.end(), run->tiles.begin(), run->tiles.end());
+        i = j;
+    }
+
+    // runs not shown in this frame are out of date
+    runs.erase(std::remove_if(runs.begin(), runs.end(), [](const FlatRun &run)->bool{
+            return !run.used;
+        }), runs.end());
+    for (auto &r : runs)
+        r.used = false;
+    layers.swap(flat);
+}
+
+int BandCompositor::GetBandRows(size_t row_bytes)
+{
+    if (band_rows > 0)
+        return band_rows;
+
+    long l2 = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l2 <= 0)
+        l2 = 256*1024;
+    // half of L2 for base rows, the other half for rows of layers
+    int rows = (int)(l2 / 2 / row_bytes);
+    return std::max(rows, 16) & ~1; // even for i420
+}
+
+void BandCompositor::Compose(cv::Mat &base)
+{
+    if (layers.empty() || base.empty())
+    {
+        layers.clear();
+        return;
+    }
+
+    AUTOTIMED("Compose bands run", enable_debug);
+    // i420 image is y plane of width*height, followed by u and v planes of (width/2)*(height/2)
+    int width = base.cols, height = i420? base.rows*2/3 : base.rows;
+    cv::Mat ym, um, vm;
+    if (i420)
+    {
+        ym = base.rowRange(0, height);
+        um = cv::Mat(height/2, width/2, CV_8U, base.data + width*height);
+        vm = cv::Mat(height/2, width/2, CV_8U, base.data + width*height + (width/2)*(height/2));
+    }
+    // a flattened run is blended over the base as one premultiplied layer, whose alpha is not what
+    // straight layers blend into the alpha of a bgra base one by one, so such bases are not flattened
+    if (enable_flattening && (i420 || base.channels() == 3))
+        Flatten(cv::Size(width, height), i420? 3 : base.channels());
+    int rows = GetBandRows(i420? width*3/2 : base.step[0]);
+    int nbands = (height + rows - 1) / rows;
+    auto compose = [&](const cv::Range &range)
+    {
+        for (int b = range.start; b < range.end; b++)
+        {
+            int y0 = b * rows, y1 = std::min(height, y0 + rows);
+            cv::Mat band, uband, vband;
+            if (i420)
+            {
+                band = ym.rowRange(y0, y1);
+                uband = um.rowRange(y0/2, (y1+1)/2);
+                vband = vm.rowRange(y0/2, (y1+1)/2);
+            }
+            else
+            {
+                band = base.rowRange(y0, y1);
+            }
+            for (auto &l : layers)
+            {
+                if (l.y >= y1 || l.y + l.h <= y0)
+                    continue;
+                // bands must not share mat headers
+                cv::Mat image = l.image, mask = l.mask;
+                if (i420)
+                    OverlapImageI420(l.ftype, band, uband, vband, image, mask, l.x, l.y - y0, l.w, l.h);
+                else if (l.rotate)
+                    OverlapRotatedImage(l.blend, l.opacity, band, image, mask, l.x - l.rotate->bbox.x,
+                                    l.y - y0 - l.rotate->bbox.y, *l.rotate);
+                else
+                    OverlapImage(l.blend, l.opacity, band, image, mask, l.x, l.y - y0, l.w, l.h);
+            }
+        }
+    };
+    if (nbands > 1)
+        cv::parallel_for_(cv::Range(0, nbands), compose, nbands);
+    else
+        compose(cv::Range(0, nbands));
+    layers.clear();
+}
@@ -0,0 +1,85 @@
+//
+// band-parallel cpu compositor
+//
+#pragma once
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "material.h"
+
+// Composite all layers of a frame band by band, instead of layer by layer.
+// The base is split into horizontal bands small enough to stay in L2 cache,
+// every band applies all visible layers in layer order on opencv's worker
+// threads. The result is identical to calling OverlapImage() for each layer.
+//
+// With EnableFlattening(), consecutive static layers (image, text, and time/clock
+// between ticks) are flattened into one premultiplied layer, which is cached until
+// any layer of the run changes, e.g. by ADD/DEL/MOD/SWPROD. The result then may
+// differ from OverlapImage() by rounding, so it is off by default. A bgra base (with
+// output_alpha) is always composed layer by layer, see matops_bench --verify.
+class BandCompositor
+{
+public:
+    BandCompositor() : band_rows(0), enable_flattening(false), i420(false) {}
+
+    // Prepare image (resize and convert in place, same as OverlapImage does) and queue it as a layer.
+    // If base is empty, base is created from the layer right away.
+    void Add(material &m, cv::Mat &base, int display_width, int display_height, cv::Mat &image, cv::Mat &mask, bool output_alpha);
+    // Blend all queued layers onto base, and clear the queue
+    void Compose(cv::Mat &base);
+    void Clear() { layers.clear(); }
+    // Force rows per band, 0 means calculating from L2 cache size
+    void SetBandRows(int rows) { band_rows = rows; }
+
+    // Base given to Add/Compose is an i420 image of height*3/2 rows instead of bgr/bgra,
+    // FT_I420 layers are copied, others are blended into y/u/v planes directly
+    void EnableI420(bool enable) { i420 = enable; }
+
+    // Enable or disable flattening of static layers
+    void EnableFlattening(bool enable) { enable_flattening = enable; if (!enable) runs.clear(); }
+    // Drop cached runs containing the material, material_id <= 0 means all materials of the product,
+    // product_id <= 0 means any product
+    void Invalidate(int product_id, int material_id);
+
+private:
+    // what a static layer looks like, a cached run is reused only if all of its layers are the same
+    struct LayerKey
+    {
+        int material_id, product_id;
+        int ftype;
+        int x, y, w, h;
+        const uchar *data;
+        double cts;
+        bool operator==(const LayerKey &k) const
+        {
+            return material_id == k.material_id && product_id == k.product_id && ftype == k.ftype &&
+                x == k.x && y == k.y && w == k.w && h == k.h && data == k.data && cts == k.cts;
+        }
+    };
+    struct Layer
+    {
+        int ftype;
+        cv::Mat image, mask;
+        int x, y, w, h; // display rect, image is scaled while blending if its size differs
+        std::shared_ptr<const RotateMap> rotate; // if set, x/y/w/h is the rotated bounding box
+        BlendRowFunc blend; // kernel resolved for formats of image and base, not used for i420
+        int opacity; // opacity (0-255) applied by blend if it has opacity
+        bool is_static;
+        LayerKey key;
+    };
+    // a run of static layers flattened into non-transparent tiles of one premultiplied image
+    struct FlatRun
+    {
+        std::vector<LayerKey> keys;
+        std::vector<Layer> tiles;
+        bool used;
+    };
+    int GetBandRows(size_t row_bytes);
+    void Flatten(cv::Size frame, int base_cn);
+    void BuildRun(FlatRun &run, cv::Size frame, int base_cn, size_t begin, size_t end);
+
+    std::vector<Layer> layers;
+    std::vector<FlatRun> runs;
+    int band_rows;
+    bool enable_flattening;
+    bool i420;
+};
@@ -0,0 +1,114 @@
+#include <chrono>
+#include <algorithm>
+#include "decodepool.h"
+#include "3rd/log/LOGHelp.h"
+
+#undef	__MODULE__
+#define __MODULE__ "DecodePool"
+
+int64_t steady_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int DecodePool::Threads()
+{
+    if (threads > 0)
+        return threads;
+    int n = std::thread::hardware_concurrency();
+    return n > 0? n : 4;
+}
+
+void DecodePool::Add(DecodeTask *task)
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto it = std::find_if(tasks.begin(), tasks.end(), [task](const Entry &e) { return e.task == task; });
+        if (it == tasks.end())
+            tasks.push_back(Entry{task, false, false, false});
+        else // restarted
+            it->finished = it->removed = false;
+        if (workers.empty())
+        {
+            int n = Threads();
+            for (int i = 0; i < n; i++)
+                workers.push_back(std::thread(&DecodePool::Work, this));
+            LOG_INFO("Decode pool started with %d threads", n);
+        }
+    }
+    wake.Notify();
+}
+
+void DecodePool::Remove(DecodeTask *task, bool force)
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    auto find = [this, task] {
+        return std::find_if(tasks.begin(), tasks.end(), [task](const Entry &e) { return e.task == task; });
+    };
+    auto it = find();
+    if (it == tasks.end())
+        return;
+    if (it->running && force)
+    {
+        it->removed = true; // erased by Done()
+        return;
+    }
+    done.wait(lk, [&] { it = find(); return it == tasks.end() || !it->running; });
+    if (it != tasks.end())
+        tasks.erase(it);
+}
+
+// take the runnable task of the earliest deadline
+DecodeTask *DecodePool::Pick()
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    Entry *best = NULL;
+    int64_t deadline = 0;
+    for (auto &e : tasks)
+    {
+        if (e.running || e.finished || e.removed || !e.task->Runnable())
+            continue;
+        int64_t d = e.task->Deadline();
+        if (!best || d < deadline)
+        {
+            best = &e;
+            deadline = d;
+        }
+    }
+    if (!best)
+        return NULL;
+    best->running = true;
+    return best->task;
+}
+
+void DecodePool::Done(DecodeTask *task, bool more)
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    auto it = std::find_if(tasks.begin(), tasks.end(), [task](const Entry &e) { return e.task == task; });
+    if (it != tasks.end())
+    {
+        it->running = false;
+        it->finished = !more;
+        if (it->removed)
+            tasks.erase(it);
+    }
+    done.notify_all();
+}
+
+void DecodePool::Work()
+{
+    while (true)
+    {
+        DecodeTask *task = NULL;
+        wake.Wait([&] { return (task = Pick()) != NULL; }, 100);
+        if (task)
+            Done(task, task->Run());
+    }
+}
+
+DecodePool &decode_pool()
+{
+    // never destroyed, workers run until the process exits
+    static DecodePool *pool = new DecodePool;
+    return *pool;
+}
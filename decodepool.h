@@ -0,0 +1,72 @@
+//
+// shared threads decoding video materials, in the order their frames are needed
+//
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "safequeue.h"
+
+// A source decoded by DecodePool, its methods are called by one worker at a time
+class DecodeTask
+{
+public:
+    virtual ~DecodeTask() {}
+    // steady time (ms, see steady_ms()) by which the reader runs out of decoded frames,
+    // the runnable task of the earliest deadline is run first
+    virtual int64_t Deadline() = 0;
+    // whether there is something to do, checked again whenever the pool is notified,
+    // and every 100ms for time based retries
+    virtual bool Runnable() = 0;
+    // decode a bounded slice of frames, return false if the task is finished and should
+    // not be run again until it is added again
+    virtual bool Run() = 0;
+};
+
+// A fixed number of workers shared by many decoders, instead of one thread per decoder.
+// There is a single run list ordered by deadline rather than per-worker queues, tasks are
+// tens at most, and the order between them has to be global.
+class DecodePool
+{
+public:
+    DecodePool() : threads(0) {}
+
+    // number of workers, and threads of each codec not in the pool, 0 for the number of cores,
+    // must be set before the first Add()
+    void SetThreads(int n) { threads = n; }
+    int Threads();
+    // schedule a task, workers are started by the first one
+    void Add(DecodeTask *task);
+    // unschedule a task, waiting for the slice it is running to finish, unless force,
+    // in which case it is dropped once the slice finishes
+    void Remove(DecodeTask *task, bool force = false);
+
+    // wakes workers to check Runnable() again, notified by tasks whenever readers consume frames
+    QueueNotifier wake;
+
+private:
+    struct Entry
+    {
+        DecodeTask *task;
+        bool running;
+        bool finished;
+        bool removed;
+    };
+    DecodeTask *Pick();
+    void Done(DecodeTask *task, bool more);
+    void Work();
+
+    std::mutex mutex;
+    std::condition_variable done; // a slice finished, for Remove()
+    std::vector<Entry> tasks;
+    std::vector<std::thread> workers;
+    int threads;
+};
+
+// milliseconds of the steady clock
+int64_t steady_ms();
+
+// process wide pool shared by all video materials
+DecodePool &decode_pool();
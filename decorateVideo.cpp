@@ -10,10 +10,15 @@
 #include <execinfo.h>
 #include "ffgif.h"
 #include "videoplayer.h"
+#include "framepool.h"
+#include "decodepool.h"
 #include "version.h"
 #include "opengl/gl_render.h"
 #include "AutoTime.h"
 #include "matops.h"
+#include "blend.h"
+#include "compositor.h"
+#include "chromakey.h"
 #include "decorateVideo.h"
 #include "safequeue.h"
 #include "event.h"
@@ -31,7 +36,36 @@ using namespace cv;
 
 #define MAX_LOG_SIZE (10*1024*1024)
 
+// allocations and copies of decoded frames, per frame handed over by decoders
+static void log_frame_pool_stats()
+{
+    FramePoolStats s = frame_pool().Stats();
+    double frames = s.frames? (double)s.frames : 1.0;
+    LOG_INFO("Frame pool: frames %llu, allocs %llu (%.3f/frame, %.1f KB/frame), reuses %llu, copies %llu (%.1f KB/frame), recycles %.3f/frame, free %llu buffers of %llu KB",
+        (unsigned long long)s.frames, (unsigned long long)s.allocs, s.allocs / frames, s.alloc_bytes / frames / 1024,
+        (unsigned long long)s.reuses, (unsigned long long)s.copies, s.copy_bytes / frames / 1024, s.recycles / frames,
+        (unsigned long long)s.free_buffers, (unsigned long long)(s.free_bytes / 1024));
+}
+
+// pcm buffered by readers, a growing total means audio is decoded ahead of the video it goes with
+static void log_audio_ring_stats()
+{
+    AudioRingStats s = audio_ring_stats();
+    LOG_INFO("Audio buffers: %llu readers buffer %llu KB (peak %llu KB per reader), %llu KB allocated, %llu KB dropped",
+        (unsigned long long)s.rings, (unsigned long long)(s.bytes / 1024), (unsigned long long)(s.peak_bytes / 1024),
+        (unsigned long long)(s.capacity / 1024), (unsigned long long)(s.dropped_bytes / 1024));
+}
+
 int enable_debug = 0;
+int enable_premultiplied_alpha = 0;
+int enable_rotate_blend = 1;
+int enable_lazy_convert = 1;
+int enable_source_sharing = 1; // materials of the same file or live stream share one decoder
+int64_t loop_cache_size = 256*1024*1024; // bytes of decoded frames kept for replaying looping materials
+int standby_products = 2; // products kept pre-rolled for switching to, see switch_product()
+int64_t standby_memory = 256*1024*1024; // bytes the products on standby may hold
+int shm_timeout = 60000; // ms to wait for the writer of a shm:// input before failing
+int raw_pipe_size = 0; // bytes of the pipe buffer of raw fifo inputs, 0 keeps the system default, see RawPipe
 
 
 static std::string get_ffmpeg_path()
@@ -201,7 +235,28 @@ int main(int argc, char **argv) {
         std::cout << "  --bg_color=#ffaabb                    # set background color to #ffaabb" << std::endl;
         std::cout << "  --enable_chromakeying                 # enable chroma keying (removing green background) on mainvideo, for test purposes only," << std::endl;
         std::cout << "                                        # for product use, please use professional software such as Premiere Pro and pruduce left-right or webm video" << std::endl;
+        std::cout << "  --chromakey_color=#00ff00             # set key color of chroma keying, default is pure green" << std::endl;
+        std::cout << "  --chromakey_tolerance=<tol>[:<soft>]  # chroma distance (0-444) to be transparent, and soft edge width above it, default is 100:40" << std::endl;
         std::cout << "  --disable_opengl                      # disable opengl rendering, run in pure CPU mode" << std::endl;
+        std::cout << "  --cpu_blend=auto|avx2|sse4|scalar     # set instruction set of cpu blending kernels, default is auto (best supported)" << std::endl;
+        std::cout << "  --premultiplied_alpha                 # keep transparent materials in premultiplied alpha with opacity applied, for faster cpu blending," << std::endl;
+        std::cout << "                                        # only take effect with --disable_opengl and non-alpha output" << std::endl;
+        std::cout << "  --i420_compose                        # composite in yuv420p instead of bgr, main video is kept in yuv420p if possible," << std::endl;
+        std::cout << "                                        # only take effect with --disable_opengl and yuv420p output" << std::endl;
+        std::cout << "  --enable_flattening                   # cache runs of static layers as one pre-blended layer, only for --disable_opengl," << std::endl;
+        std::cout << "                                        # faster but may differ from layer by layer blending by rounding" << std::endl;
+        std::cout << "  --disable_rotate_blend                # rotate video frames into a new image instead of rotating while blending, only for --disable_opengl" << std::endl;
+        std::cout << "  --disable_lazy_convert                # convert every decoded frame of videos to bgr, instead of only those displayed" << std::endl;
+        std::cout << "  --disable_source_sharing              # decode each video material on its own, even if several read the same file or live stream" << std::endl;
+        std::cout << "  --loop_cache_size=<MB>                # memory for keeping decoded frames of looping video materials, to replay them" << std::endl;
+        std::cout << "                                        # without decoding again, default is 256, 0 to disable" << std::endl;
+        std::cout << "  --standby_products=<n>                # keep video materials of the n likeliest next products opened and pre-rolled," << std::endl;
+        std::cout << "                                        # to switch to them without delay, default is 2, 0 to disable" << std::endl;
+        std::cout << "  --standby_memory=<MB>                 # memory for products on standby, default is 256" << std::endl;
+        std::cout << "  --shm_timeout=<ms>                    # time to wait for data of shm:// inputs before giving up, default is 60000" << std::endl;
+        std::cout << "  --pipe_size=<KB>                      # enlarge the pipe buffer of raw fifo and stdin inputs, default is 0 to keep the system size" << std::endl;
+        std::cout << "  --decode_threads=<n>                  # threads shared by decoders of video materials, and codec threads of main video," << std::endl;
+        std::cout << "                                        # default is the number of cores" << std::endl;
         std::cout << "  --enable_window                       # display the preview window while processing" << std::endl;
         std::cout << "  --enable_debug                        # output debug message while processing" << std::endl;
         std::cout << "  --enable_ff_nv_enc                    # enable hw encode for nvidia driver, only for mp4 file output" << std::endl;
@@ -286,7 +341,7 @@ int main(int argc, char **argv) {
         std::cout << "         - raw32: bgra + pcm_s16le in {type + length + data} format" << std::endl;
         std::cout << std::endl;
         std::cout << "Material format for media:" << std::endl;
-        std::cout << "  <type>:<layer>:<path>:<top>:<left>:<width>:<height>:<volume>:<rotation>:<opacity>" << std::endl;
+        std::cout << "  <type>:<layer>:<path>:<top>:<left>:<width>:<height>:<volume>:<rotation>:<opacity>:<decode>" << std::endl;
         std::cout << "    - type: one of mainvideo, mainaudio, image, gif, video, audio. " << std::endl;
         std::cout << "    - layer: layer starting at 1, used for sorting the materials. " << std::endl;
         std::cout << "    - path: file path or rtmp://domain/appid/streamid or shm://shm_id" << std::endl;
@@ -294,6 +349,12 @@ int main(int argc, char **argv) {
         std::cout << "    - volume: optional, for video/audio only, the sound volume, range 0-100" << std::endl;
         std::cout << "    - rotation: clockwise rotation degree from -360 - 360" << std::endl;
         std::cout << "    - opacity: transparancy percentage, 1 - 100, 0 is equal to 100, fully opaque" << std::endl;
+        std::cout << "    - decode: optional, for video only, how a video shown smaller than its source is decoded" << std::endl;
+        std::cout << "         - auto: default, picked by the ratio of the source size to width/height" << std::endl;
+        std::cout << "         - full: every frame at full resolution" << std::endl;
+        std::cout << "         - fast: skip the deblocking filter, slight artifacts hidden by downscaling" << std::endl;
+        std::cout << "         - lowres: decode at 1/2 to 1/8 resolution if the codec supports it, otherwise fast" << std::endl;
+        std::cout << "         - keyframe: key frames only, each shown until the next one, for thumbnails" << std::endl;
         std::cout << std::endl;
         std::cout << "Material format for text/time:" << std::endl;
         std::cout << "  <type>:<layer>:<text|time_format>:<top>:<left>:<width>:<height>:<starttime>:<rotation>:<opacity>:<font>:<fontsize>:<color>:<outlinesize>:<outlinecolor>" << std::endl;
@@ -324,7 +385,11 @@ int main(int argc, char **argv) {
     }
 
     bool enable_chromakeying = false;
+    std::vector<uchar> key_bgr = {0, 255, 0};
+    int key_tolerance = 100, key_softness = 40;
     bool disable_opengl = false;
+    bool enable_flattening = false;
+    bool i420_compose = false;
     bool enable_window = false;
     bool enable_ff_nv_enc = false;
     int enable_bg_color = 0;
@@ -376,6 +441,60 @@ int main(int argc, char **argv) {
             --i;
             continue;
         }
+        if(strcasecmp(argv[i], "--i420_compose")==0)
+        {
+            i420_compose = true;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        if(strcasecmp(argv[i], "--enable_flattening")==0)
+        {
+            enable_flattening = true;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        if(strcasecmp(argv[i], "--disable_rotate_blend")==0)
+        {
+            enable_rotate_blend = 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        if(strcasecmp(argv[i], "--disable_lazy_convert")==0)
+        {
+            enable_lazy_convert = 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        if(strcasecmp(argv[i], "--disable_source_sharing")==0)
+        {
+            enable_source_sharing = 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        if(strcasecmp(argv[i], "--premultiplied_alpha")==0)
+        {
+            enable_premultiplied_alpha = 1;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
         if(strcasecmp(argv[i], "--enable_window")==0)
         {
             enable_window = true;
@@ -404,6 +523,34 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        opt = "--cpu_blend=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            const char *isa = argv[i]+optlen;
+            int ret = 0;
+            if (strncasecmp(isa, "avx2", 5) == 0)
+                ret = blend_set_isa(BLEND_AVX2);
+            else if (strncasecmp(isa, "sse4", 5) == 0)
+                ret = blend_set_isa(BLEND_SSE41);
+            else if (strncasecmp(isa, "scalar", 7) == 0)
+                ret = blend_set_isa(BLEND_SCALAR);
+            else if (strncasecmp(isa, "auto", 5) != 0)
+            {
+                std::cerr << "Invalid cpu_blend parameter: " << isa << std::endl;
+                return -1;
+            }
+            if (ret < 0)
+            {
+                std::cerr << "Bad argument, cpu_blend " << isa << " is not supported by this cpu." << std::endl;
+                return -1;
+            }
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
         opt = "--encode_preset=";
         optlen = strlen(opt);
         if(strncasecmp(argv[i], opt, optlen)==0)
@@ -431,6 +578,80 @@ int main(int argc, char **argv) {
             --i;
             continue;
         }
+        opt = "--loop_cache_size=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            int mb = atoi(argv[i]+optlen);
+            loop_cache_size = mb > 0? (int64_t)mb*1024*1024 : 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        opt = "--standby_products=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            int n = atoi(argv[i]+optlen);
+            standby_products = n > 0? n : 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        opt = "--standby_memory=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            int mb = atoi(argv[i]+optlen);
+            standby_memory = mb > 0? (int64_t)mb*1024*1024 : 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        opt = "--shm_timeout=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            int ms = atoi(argv[i]+optlen);
+            shm_timeout = ms > 0? ms : 60000;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        opt = "--pipe_size=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            int kb = atoi(argv[i]+optlen);
+            raw_pipe_size = kb > 0? kb*1024 : 0;
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        opt = "--decode_threads=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            int threads = atoi(argv[i]+optlen);
+            if (threads < 0)
+                threads = 0;
+            decode_pool().SetThreads(threads);
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
         opt = "--read_timeout=";
         optlen = strlen(opt);
         if(strncasecmp(argv[i], opt, optlen)==0)
@@ -539,6 +760,32 @@ int main(int argc, char **argv) {
             --i;
             continue;
         }
+        opt = "--chromakey_color=#";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            parse_color(argv[i]+optlen, key_bgr);
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
+        opt = "--chromakey_tolerance=";
+        optlen = strlen(opt);
+        if(strncasecmp(argv[i], opt, optlen)==0)
+        {
+            if (sscanf(argv[i]+optlen, "%d:%d", &key_tolerance, &key_softness) < 1)
+            {
+                std::cerr << "Invalid chromakey_tolerance parameter: " << argv[i]+optlen << std::endl;
+                return -1;
+            }
+            if(i+1 < argc)
+                memmove(argv+i, argv+i+1, (argc-i-1)*sizeof(argv));
+            --argc;
+            --i;
+            continue;
+        }
         opt = "--bg_color=#";
         optlen = strlen(opt);
         if(strncasecmp(argv[i], opt, optlen)==0)
@@ -935,6 +1182,11 @@ int main(int argc, char **argv) {
     }
     output_alpha = (strncasecmp(output_fmt, "mov", 4)==0 || strncasecmp(output_fmt, "webm", 5)==0 ||
                     strncasecmp(output_fmt, "raw32", 6)==0 || strncasecmp(output_fmt, "mp4alpha", 9)==0);
+    if (enable_premultiplied_alpha && (!disable_opengl || output_alpha))
+    {
+        std::cout << "Warning: premultiplied_alpha is ignored, it needs --disable_opengl and non-alpha output" << std::endl;
+        enable_premultiplied_alpha = 0;
+    }
     merge_path(outputvideo, sizeof(outputvideo), data_dir, ov);
     if(event_fifo)
     {
@@ -949,6 +1201,11 @@ int main(int argc, char **argv) {
         return -1;
     }
     std::cout << "Output video path: " << outputvideo << std::endl;
+    if (i420_compose && (!disable_opengl || output_alpha || rawdata_out || blind_watermark))
+    {
+        std::cout << "Warning: i420_compose is ignored, it needs --disable_opengl, yuv420p output and no blind watermark" << std::endl;
+        i420_compose = false;
+    }
     double x_ratio = 1.0, y_ratio = 1.0; // scale ratio for all materials
     if (force_width && force_height)
     {
@@ -957,6 +1214,11 @@ int main(int argc, char **argv) {
         output_width = force_width;
         output_height = force_height;
     }
+    if (i420_compose && ((output_width & 1) || (output_height & 1)))
+    {
+        std::cout << "Warning: i420_compose is ignored, output width and height must be even" << std::endl;
+        i420_compose = false;
+    }
     material mainvideo, mainaudio;
     std::vector<material> mlist;
     auto ret = parse_materials(argc, argv, mainvideo, mainaudio, mlist, data_dir, x_ratio, y_ratio);
@@ -975,6 +1237,7 @@ int main(int argc, char **argv) {
     int64_t duration = 7LL*24*3600*1000; // output video duration in ms, maximum of 1 week
     int64_t totalframes = 0;
     FFReader *ffreader = NULL;
+    bool i420_mainvideo = false; // mainvideo frames are yuv420p, copied into i420 output directly
     if(mainvideo.type == material::MT_MainVideo)
     {
         // open mainvideo
@@ -990,6 +1253,9 @@ int main(int argc, char **argv) {
             size_t l;
             if (alpha_video || ((l=strlen(mainvideo.path)) > 4 && strcasecmp(mainvideo.path+l-4, ".mp4")==0))
                 out_fmt = AV_PIX_FMT_BGR24;
+            if (i420_compose && !alpha_video && !enable_chromakeying &&
+                (mainvideo.rotation%360)==0 && (mainvideo.opacity<=0 || mainvideo.opacity>=100))
+                out_fmt = AV_PIX_FMT_YUV420P;
 
             // open mainvideo, always convert color to bgra
             if(strncasecmp(scale_engine, "ffmpeg", 6)==0 && alpha_video==NULL) // scale with ffmpeg
@@ -1010,6 +1276,9 @@ int main(int argc, char **argv) {
         materialcontext &ctx = mainvideo.ctx;
         ctx.w = ffreader->disp_width;
         ctx.h = ffreader->disp_height;
+        // otherwise get_bgra_mat() converts yuv420p to bgr as usual
+        i420_mainvideo = (ffreader->out_pix_fmt == AV_PIX_FMT_YUV420P && i420_compose && !rawvideo.pix_fmt &&
+                        ffreader->rotation < 0.1 && (ctx.w & 1) == 0 && (ctx.h & 1) == 0);
         int a = alpha_video? tolower(alpha_video[0]) : 0;
         if (a == 'l' || a == 'r') // left-right video
         {
@@ -1091,6 +1360,7 @@ int main(int argc, char **argv) {
     ret = open_materials(mlist, x_ratio, y_ratio, &rawaudio, &mainaudio, stream_buffer_size, fps, disable_opengl, product_id);
     if (ret)
         return -2;
+    switch_product(mlist, product_id, product_id, stream_buffer_size);
 
     // open write file
     std::string cmd;
@@ -1195,6 +1465,8 @@ int main(int argc, char **argv) {
     }
 
     GetLogHelp().Init(data_dir, enable_debug? LogLevel::debug : LogLevel::info);
+    if (disable_opengl)
+        LOG_INFO("CPU blending kernels use %s", blend_isa_name(blend_get_isa()));
 
     {
     AUTOTIME("MergeVideo Run");
@@ -1255,6 +1527,18 @@ int main(int argc, char **argv) {
     unsigned int subTexture = 0;
     Mat base = cv::Mat::zeros(cv::Size(output_width, output_height), output_alpha? CV_8UC4 : CV_8UC3);
     cv::Mat yuv(cv::Size(output_width, output_height+output_height/2), CV_8U);
+    BandCompositor compositor; // used when opengl is disabled
+    ChromaKey chroma_key;
+    chromakey_init(chroma_key, key_bgr.data(), key_tolerance, key_softness);
+    compositor.EnableFlattening(enable_flattening);
+    compositor.EnableI420(i420_compose);
+    cv::Mat bgyuv; // background in i420, copied to yuv at the beginning of each frame
+    if (i420_compose)
+    {
+        cv::Mat bg = bgmat.empty()? cv::Mat::zeros(cv::Size(output_width, output_height), CV_8UC3) : bgmat;
+        cv::cvtColor(bg, bgyuv, COLOR_BGR2YUV_I420);
+        LOG_INFO("Composite in i420, mainvideo is %s", i420_mainvideo? "kept in yuv420p" : "converted from bgr");
+    }
     cv::Mat watermat;
     if (water.text)
     {
@@ -1363,6 +1647,7 @@ int main(int argc, char **argv) {
                         m.product_id = c.product_id;
                         m.material_id = c.material_id;
                         new_mlist.push_back(m);
+                        compositor.Invalidate(c.product_id, c.material_id);
                         break;
                     }
                 case stream_cmd_info::DEL:
@@ -1383,6 +1668,7 @@ int main(int argc, char **argv) {
                                     gl_delete_texture(m.ctx.glTexture);
                                 }
                                 send_event(ET_MATERIAL_DEL_SUCC, std::string("Delete material ")+m.path+" successfully");
+                                compositor.Invalidate(m.product_id, m.material_id);
                                 close_material(m);
                                 mlist.erase(mlist.begin()+i);
                                 break;
@@ -1405,6 +1691,7 @@ int main(int argc, char **argv) {
                                 m.rect.width = c.rect.w * x_ratio;
                                 m.rect.height = c.rect.h * y_ratio;
                                 send_event(ET_MATERIAL_MOD_SUCC, std::string("Modify material ")+m.path+" successfully");
+                                compositor.Invalidate(m.product_id, m.material_id);
                                 modified = true;
                                 break;
                             }
@@ -1467,17 +1754,10 @@ int main(int argc, char **argv) {
                         int old_product_id = product_id;
                         product_id = c.product_id;
                         cout << "Switch product from " << old_product_id << " to " << product_id << endl;
-
-                        for (auto &m : mlist)
-                        {
-                            if (m.type == material::MT_Audio || m.type == material::MT_Video)
-                            {
-                                if (m.product_id > 0 && m.product_id == old_product_id) // non-current product, stop
-                                    stop_video_decoder_thread(m.ctx.reader, AV_STREAMING, check_is_stream(m)? stream_buffer_size : 0);
-                                else if (m.product_id > 0 && m.product_id == product_id) // new current product, start
-                                    start_video_decoder_thread(m.ctx.reader, AV_STREAMING, check_is_stream(m)? stream_buffer_size : 0);
-                            }
-                        }
+                        if (old_product_id > 0)
+                            compositor.Invalidate(old_product_id, 0);
+                        compositor.Invalidate(product_id, 0);
+                        switch_product(mlist, old_product_id, product_id, stream_buffer_size);
                     }
                     break;
                 default:
@@ -1496,6 +1776,7 @@ int main(int argc, char **argv) {
             {
                 mlist.insert(mlist.end(), pmlist->begin(), pmlist->end());
                 delete pmlist;
+                switch_product(mlist, product_id, product_id, stream_buffer_size); // pre-roll new products
             }
             std::sort(mlist.begin(), mlist.end(), 
                 [](const material &a2, const material &a1)->bool{
@@ -1506,7 +1787,10 @@ int main(int argc, char **argv) {
         AUTOTIMED("Frame handling total run", enable_debug);
         Mat frame, mask;
         int prodid = 0; // new product id
-        std::vector<unsigned char> main_vdata, main_adata;
+        // the main video frame goes back to the pool when the iteration ends, to be decoded into again
+        FrameBuffer main_frame(&frame_pool(), std::vector<unsigned char>());
+        std::vector<unsigned char> &main_vdata = main_frame.vec();
+        std::vector<unsigned char> main_adata;
         // if main video is from shm, it is AI frame and possibly is delay, so set can_wait = true
         bool can_wait = first_frame_ready==false || has_stream_io==false || (mainvideo.type == material::MT_MainVideo && strncmp(mainvideo.path, "shm://", 6)==0);
         bool mainaudio_missing = false;
@@ -1557,7 +1841,13 @@ int main(int argc, char **argv) {
                 }
                 else if(!main_vdata.empty())
                 {
-                    frame = get_bgra_mat(ffreader, mainvideo, main_vdata.data(),
+                    if (i420_mainvideo)
+                    {
+                        frame = cv::Mat(cv::Size(ffreader->disp_width, ffreader->disp_height*3/2), CV_8U, main_vdata.data());
+                        mainvideo.ctx.ftype = materialcontext::FT_I420;
+                    }
+                    else
+                        frame = get_bgra_mat(ffreader, mainvideo, main_vdata.data(),
                                     AV_PIX_FMT_NONE, disable_opengl, disable_opengl? alpha_video : NULL, &mask);
                     if(mainvideo.ctx.frames.empty())
                         mainvideo.ctx.frames.push_back(frame.clone());
@@ -1584,7 +1874,12 @@ int main(int argc, char **argv) {
                 {
                     timeout_num = 0;
                     main_adata.insert(main_adata.end(), adata.begin(), adata.end());
-                    if(!main_vdata.empty())
+                    if(!main_vdata.empty() && i420_mainvideo)
+                    {
+                        frame = cv::Mat(cv::Size(ffreader->disp_width, ffreader->disp_height*3/2), CV_8U, main_vdata.data());
+                        mainvideo.ctx.ftype = materialcontext::FT_I420;
+                    }
+                    else if(!main_vdata.empty())
                     {
                         frame = get_bgra_mat(ffreader, mainvideo, main_vdata.data(), 
                                 AV_PIX_FMT_NONE, disable_opengl, disable_opengl? alpha_video : NULL, &mask);
@@ -1604,7 +1899,7 @@ int main(int argc, char **argv) {
                     AUTOTIMED("FFMPEG convert alpha image", enable_debug);
                     frame = MakeAlphaMat(frame, alpha_video[0], NULL);
                 }
-                if(((mainvideo.rotation%360)==0 && (mainvideo.opacity<=0 || mainvideo.opacity>=100)) && 
+                if(!i420_mainvideo && ((mainvideo.rotation%360)==0 && (mainvideo.opacity<=0 || mainvideo.opacity>=100)) && 
                     strncasecmp(scale_engine, "opencv", 6)==0 && // scale with opencv
                     (mainvideo.ctx.w!=mainvideo.rect.width ||
                     mainvideo.ctx.h!=mainvideo.rect.height))
@@ -1648,7 +1943,12 @@ int main(int argc, char **argv) {
         if (mainvideo.type != material::MT_MainVideo || !frame.empty()) // mainvideo has arrived
         {
             Mat outmat;
-            if (disable_opengl && !bgmat.empty()) // merge in CPU to outmat if not using opengl
+            if (i420_compose) // merge in CPU to yuv directly, no conversion is needed before encoding
+            {
+                bgyuv.copyTo(yuv);
+                outmat = yuv;
+            }
+            else if (disable_opengl && !bgmat.empty()) // merge in CPU to outmat if not using opengl
                 outmat = bgmat.clone();
             // now begin to render
             if (!disable_opengl)
@@ -1661,17 +1961,7 @@ int main(int argc, char **argv) {
                     LOG_INFO("Main rendering thread switch product from %d to %d", product_id, prodid);
                 }
                 product_id = prodid;
-
-                for (auto &m : mlist)
-                {
-                    if (m.type == material::MT_Audio || m.type == material::MT_Video)
-                    {
-                        if (m.product_id > 0 && m.product_id == old_product_id) // non-current product, stop
-                            stop_video_decoder_thread(m.ctx.reader, AV_STREAMING, check_is_stream(m)? stream_buffer_size : 0);
-                        else if (m.product_id > 0 && m.product_id == product_id) // new current product, start
-                            start_video_decoder_thread(m.ctx.reader, AV_STREAMING, check_is_stream(m)? stream_buffer_size : 0);
-                    }
-                }
+                switch_product(mlist, old_product_id, product_id, stream_buffer_size);
             }
             if (has_stream_io && !first_frame_ready)
             {
@@ -1710,8 +2000,9 @@ int main(int argc, char **argv) {
                 {
                     if((!disable_opengl) && alpha_video && strncasecmp(alpha_engine, "opengl", 7)==0)
                     {
+                        // frame is read in place, its rows may be padded, see get_bgra_mat()
                         mainvideo.ctx.glTexture = gl_render_texture_alpha(mainvideo.ctx.glTexture, frame.data, frame.channels(), frame.cols, frame.rows, 
-                                    mainvideo.rect.x, mainvideo.rect.y, mainvideo.rect.width, mainvideo.rect.height, mainvideo.rotation, mainvideo.opacity, alpha_video[0]);
+                                    mainvideo.rect.x, mainvideo.rect.y, mainvideo.rect.width, mainvideo.rect.height, mainvideo.rotation, mainvideo.opacity, alpha_video[0], (int)frame.step);
                     }
                     else
                     {
@@ -1720,17 +2011,20 @@ int main(int argc, char **argv) {
                             if (enable_chromakeying)
                             {
                                 AUTOTIMED("Remove background run", (enable_debug || first_run));
-                                removeBackground(frame, frame, mask);
+                                ChromaKeyImage(frame, frame, mask, chroma_key);
                                 mainvideo.ctx.ftype = materialcontext::FT_BGRM;
                             }
-                            OverlapImage(mainvideo, outmat, output_width, output_height, frame, mask, output_alpha);
+                            if (disable_opengl)
+                                compositor.Add(mainvideo, outmat, output_width, output_height, frame, mask, output_alpha);
+                            else
+                                OverlapImage(mainvideo, outmat, output_width, output_height, frame, mask, output_alpha);
                         }
                         else
                         {
                             // always redraw mainvideo
                             AUTOTIMED("Render mainvideo run", (enable_debug || first_run));
                             mainvideo.ctx.glTexture = gl_render_texture(mainvideo.ctx.glTexture, frame.data, frame.channels(), frame.cols, frame.rows, 
-                                    mainvideo.rect.x, mainvideo.rect.y, mainvideo.rect.width, mainvideo.rect.height, mainvideo.rotation, mainvideo.opacity);
+                                    mainvideo.rect.x, mainvideo.rect.y, mainvideo.rect.width, mainvideo.rect.height, mainvideo.rotation, mainvideo.opacity, (int)frame.step);
                         }
                     }
                     continue;
@@ -1750,7 +2044,7 @@ int main(int argc, char **argv) {
                     AUTOTIMED("Render frame run", (enable_debug || first_run));
                     if (disable_opengl)
                     {
-                        OverlapImage(m, outmat, output_width, output_height, *pmat, mask, output_alpha);
+                        compositor.Add(m, outmat, output_width, output_height, *pmat, mask, output_alpha);
                     }
                     else
                     {
@@ -1758,10 +2052,10 @@ int main(int argc, char **argv) {
                         bool redraw = m.ctx.glTexture==0 || m.type==material::MT_Gif || m.type==material::MT_Video || m.type==material::MT_Time || m.type==material::MT_Clock;
                         if (m.ctx.ftype == materialcontext::FT_BGR)
                             m.ctx.glTexture = gl_render_texture_bgr(m.ctx.glTexture, redraw? pmat->data : NULL, pmat->cols, pmat->rows, 
-                                        m.rect.x, m.rect.y, m.rect.width, m.rect.height, m.rotation, m.opacity);
+                                        m.rect.x, m.rect.y, m.rect.width, m.rect.height, m.rotation, m.opacity, (int)pmat->step);
                         else
                             m.ctx.glTexture = gl_render_texture_bgra(m.ctx.glTexture, redraw? pmat->data : NULL, pmat->cols, pmat->rows, 
-                                        m.rect.x, m.rect.y, m.rect.width, m.rect.height, m.rotation, m.opacity);
+                                        m.rect.x, m.rect.y, m.rect.width, m.rect.height, m.rotation, m.opacity, (int)pmat->step);
                     }
                 }
             }
@@ -1814,10 +2108,12 @@ int main(int argc, char **argv) {
                     if (disable_opengl)
                     {
                         material m;
+                        m.type = material::MT_None;
                         m.ctx.ftype = materialcontext::FT_BGRA;
                         m.rect = {ffSubtitleEncodeThread.sub_x, ffSubtitleEncodeThread.sub_y, ffSubtitleEncodeThread.sub_w, ffSubtitleEncodeThread.sub_h};
-                        cv::Mat mask, mat(cv::Size(ffSubtitleEncodeThread.sub_w, ffSubtitleEncodeThread.sub_h), CV_8UC4, subMat.data());
-                        OverlapImage(m, outmat, output_width, output_height, mat, mask, output_alpha);
+                        // composed later, so own a copy of subMat
+                        cv::Mat mask, mat = cv::Mat(cv::Size(ffSubtitleEncodeThread.sub_w, ffSubtitleEncodeThread.sub_h), CV_8UC4, subMat.data()).clone();
+                        compositor.Add(m, outmat, output_width, output_height, mat, mask, output_alpha);
                     }
                     else
                     {
@@ -1833,6 +2129,13 @@ int main(int argc, char **argv) {
                 }
             }
 
+            // blend all layers in bands, on multiple threads
+            if (disable_opengl)
+            {
+                AUTOTIMED("Compose layers run", (enable_debug || first_run));
+                compositor.Compose(outmat);
+            }
+
             {
                 AUTOTIMED("Dowload image run", (enable_debug || first_run));
                 if (!disable_opengl)
@@ -1862,8 +2165,10 @@ int main(int argc, char **argv) {
                 }
                 if (!skip)
                 {
-                    cv::Mat subMat;
-                    cv::resize(base, subMat, cv::Size(substream_out.videoinfo.w, substream_out.videoinfo.h), 0, 0, cv::INTER_NEAREST);
+                    cv::Mat subMat, bgr = base;
+                    if (i420_compose)
+                        cv::cvtColor(base, bgr, COLOR_YUV2BGR_I420);
+                    cv::resize(bgr, subMat, cv::Size(substream_out.videoinfo.w, substream_out.videoinfo.h), 0, 0, cv::INTER_NEAREST);
                     substream_out.video_thread->Write(subMat.data, subMat.rows*subMat.cols*subMat.channels(), EC_RAWMEDIA_RAWVIDEO);
                     substream_out.cur_frameno ++;
                 }
@@ -1872,6 +2177,7 @@ int main(int argc, char **argv) {
             if (!output_alpha && !rawdata_out)
             {
                 AUTOTIMED("EncoderThread::Write1 run", (enable_debug || first_run));
+                if (!i420_compose) // already composed in yuv otherwise
                 { // from experience, opencv conversion to yuv420p is a little faster (about 10%) than ffmpeg/sws_scale
                     AUTOTIMED("CV::Convert YUV run", (enable_debug || first_run));
                     cv::cvtColor(base, yuv, COLOR_BGR2YUV_I420);
@@ -2027,7 +2333,14 @@ int main(int argc, char **argv) {
         // display
         if(enable_window && !frame.empty())
         {
-            imshow("Decorated Video", base);
+            if (i420_compose)
+            {
+                cv::Mat bgr;
+                cv::cvtColor(base, bgr, COLOR_YUV2BGR_I420);
+                imshow("Decorated Video", bgr);
+            }
+            else
+                imshow("Decorated Video", base);
 
             // press ESC to exit
             if(waitKey(25) == 27)
@@ -2056,9 +2369,16 @@ int main(int argc, char **argv) {
             }
         }
         first_run = (num < 3);
+        if (enable_debug && num && num % 250 == 0)
+        {
+            log_frame_pool_stats();
+            log_audio_ring_stats();
+        }
 
         ts += 1000.0 / fps; // miliseconds elapsed
     }
+    log_frame_pool_stats();
+    log_audio_ring_stats();
 
     LOG_INFO("Finished decoration process, total frames %d, total time %fms.", num, ts);
     if (mainvideo.type == material::MT_MainVideo ||
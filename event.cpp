@@ -29,7 +29,7 @@ public:
             {
                 if (bExit) // exit only when queue is empty
                     break;
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                eventBuffers.Wait(100); // woken by START/EXIT
                 continue;
             }
             if (writer < 0)
@@ -46,7 +46,7 @@ public:
                 LOG_INFO("Open envent notification fifo successfully.");
             }
             vector<unsigned char> buf;
-            if (!eventBuffers.PopMove(buf)) // empty
+            if (!eventBuffers.PopMove(buf, 100)) // empty, waited for a push
             {
                 if (bExit) // exit only when queue is empty
                 {
@@ -54,7 +54,6 @@ public:
                     writer = -1;
                     break;
                 }
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
                 continue;
             }
             int ret = write(writer, buf.data(), buf.size());
@@ -84,12 +83,14 @@ public:
         fifo_name = fifo;
         bExit.store(false);
         bStopped.store(false);
+        eventBuffers.Wake();
         if (runner == NULL)
             runner = new std::thread(&PushEventThread::RUN, this);
     }
     void EXIT(bool force = false)
     {
         bExit.store(true);
+        eventBuffers.Wake();
         if (!force)
         {
             if(runner->joinable())
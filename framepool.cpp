@@ -0,0 +1,133 @@
+#include <string.h>
+#include <iterator>
+#include "framepool.h"
+
+void FrameBuffer::clear()
+{
+    if (pool)
+        pool->Recycle(std::move(buf));
+    pool = NULL;
+    buf.clear();
+}
+
+// size classes are 8 steps per power of two, and at least 64 bytes apart
+static size_t class_step(size_t size)
+{
+    size_t p = 1;
+    while ((p << 1) && (p << 1) <= size)
+        p <<= 1;
+    return p/8 > 64? p/8 : 64;
+}
+
+size_t FramePool::ClassCeil(size_t size)
+{
+    size_t step = class_step(size);
+    return (size + step - 1) / step * step;
+}
+
+size_t FramePool::ClassFloor(size_t size)
+{
+    size_t step = class_step(size);
+    return size / step * step;
+}
+
+FrameBuffer FramePool::Acquire(size_t size)
+{
+    size_t cls = ClassCeil(size);
+    std::vector<unsigned char> buf;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto it = free_list.find(cls);
+        if (it != free_list.end() && it->second.size())
+        {
+            buf = std::move(it->second.back());
+            it->second.pop_back();
+            free_bytes -= buf.capacity();
+            free_count --;
+        }
+    }
+    if (buf.capacity() >= size)
+    {
+        reuses ++;
+    }
+    else
+    {
+        allocs ++;
+        alloc_bytes += cls;
+        buf.reserve(cls);
+    }
+    // within capacity, nothing is reallocated, and only the grown part is zeroed
+    buf.resize(size);
+    return FrameBuffer(this, std::move(buf));
+}
+
+FrameBuffer FramePool::Copy(const unsigned char *data, size_t size)
+{
+    FrameBuffer b = Acquire(size);
+    if (size)
+        memcpy(b.data(), data, size);
+    copies ++;
+    copy_bytes += size;
+    return b;
+}
+
+void FramePool::Recycle(std::vector<unsigned char> &&buf)
+{
+    size_t cls = ClassFloor(buf.capacity());
+    if (cls == 0)
+        return;
+    recycles ++;
+    std::lock_guard<std::mutex> lk(mutex);
+    if (free_bytes + buf.capacity() > max_bytes) // over limit, let it be freed
+        return;
+    free_bytes += buf.capacity();
+    free_count ++;
+    free_list[cls].push_back(std::move(buf));
+}
+
+void FramePool::SetLimit(size_t max)
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    max_bytes = max;
+    Trim();
+}
+
+// release free buffers of the largest classes first, until under the limit
+void FramePool::Trim()
+{
+    while (free_bytes > max_bytes && free_list.size())
+    {
+        auto it = std::prev(free_list.end());
+        while (free_bytes > max_bytes && it->second.size())
+        {
+            free_bytes -= it->second.back().capacity();
+            free_count --;
+            it->second.pop_back();
+        }
+        if (it->second.empty())
+            free_list.erase(it);
+    }
+}
+
+FramePoolStats FramePool::Stats()
+{
+    FramePoolStats s;
+    s.frames = frames;
+    s.allocs = allocs;
+    s.alloc_bytes = alloc_bytes;
+    s.reuses = reuses;
+    s.copies = copies;
+    s.copy_bytes = copy_bytes;
+    s.recycles = recycles;
+    std::lock_guard<std::mutex> lk(mutex);
+    s.free_buffers = free_count;
+    s.free_bytes = free_bytes;
+    return s;
+}
+
+FramePool &frame_pool()
+{
+    // never destroyed, buffers of static decoders may still be recycled at exit
+    static FramePool *pool = new FramePool(256*1024*1024);
+    return *pool;
+}
@@ -0,0 +1,101 @@
+//
+// recycled frame buffers for decoder queues
+//
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+class FramePool;
+
+// Move-only handle of a pooled buffer, the buffer goes back to its pool when the handle
+// is destroyed, cleared or assigned, instead of being freed
+class FrameBuffer
+{
+public:
+    FrameBuffer() : pool(NULL) {}
+    FrameBuffer(FramePool *p, std::vector<unsigned char> &&b) : pool(p), buf(std::move(b)) {}
+    FrameBuffer(FrameBuffer &&o) : pool(o.pool), buf(std::move(o.buf)) { o.pool = NULL; o.buf.clear(); }
+    FrameBuffer &operator=(FrameBuffer &&o)
+    {
+        if (this != &o)
+        {
+            clear();
+            pool = o.pool;
+            buf = std::move(o.buf);
+            o.pool = NULL;
+            o.buf.clear();
+        }
+        return *this;
+    }
+    FrameBuffer(const FrameBuffer &) = delete;
+    FrameBuffer &operator=(const FrameBuffer &) = delete;
+    ~FrameBuffer() { clear(); }
+
+    // return the buffer to the pool, the handle becomes empty
+    void clear();
+    bool empty() const { return buf.empty(); }
+    size_t size() const { return buf.size(); }
+    unsigned char *data() { return buf.data(); }
+    const unsigned char *data() const { return buf.data(); }
+    // the underlying vector, it may be swapped with another one of the same size,
+    // e.g. the caller's previous frame, which is recycled in place of it
+    std::vector<unsigned char> &vec() { return buf; }
+
+private:
+    FramePool *pool;
+    std::vector<unsigned char> buf;
+};
+
+// counters since start, divide by frames to get them per frame
+struct FramePoolStats
+{
+    uint64_t frames;        // frames handed over to queues
+    uint64_t allocs;        // buffers allocated because no free one of the size class was pooled
+    uint64_t alloc_bytes;
+    uint64_t reuses;        // buffers taken from the pool
+    uint64_t copies;        // frames copied instead of being handed over
+    uint64_t copy_bytes;
+    uint64_t recycles;      // frames put back after use, a frame freed by its consumer is not counted
+    uint64_t free_buffers;  // buffers currently pooled
+    uint64_t free_bytes;
+};
+
+// Free buffers are kept by size class, a class covers sizes between two steps of 1/8 of a
+// power of two, so that frames of the same (or a close) size reuse a buffer without
+// reallocating. Free buffers above max_bytes are released to the system.
+class FramePool
+{
+public:
+    explicit FramePool(size_t max_bytes) : max_bytes(max_bytes), free_bytes(0), free_count(0),
+        frames(0), allocs(0), alloc_bytes(0), reuses(0), copies(0), copy_bytes(0), recycles(0) {}
+
+    // get a buffer of size bytes, its content is undefined
+    FrameBuffer Acquire(size_t size);
+    // get a pooled copy of data, it is counted as a copy
+    FrameBuffer Copy(const unsigned char *data, size_t size);
+    // put a buffer back, called by FrameBuffer
+    void Recycle(std::vector<unsigned char> &&buf);
+    // limit of free bytes kept, free buffers above it are released
+    void SetLimit(size_t max_bytes);
+    // count one frame handed over, see FramePoolStats
+    void CountFrame() { frames ++; }
+    FramePoolStats Stats();
+
+    // smallest class size not less than size, and the largest one not greater than size
+    static size_t ClassCeil(size_t size);
+    static size_t ClassFloor(size_t size);
+
+private:
+    void Trim();
+
+    std::mutex mutex;
+    std::map<size_t, std::vector<std::vector<unsigned char>>> free_list; // by class size
+    size_t max_bytes, free_bytes, free_count;
+    std::atomic<uint64_t> frames, allocs, alloc_bytes, reuses, copies, copy_bytes, recycles;
+};
+
+// process wide pool shared by all decoders
+FramePool &frame_pool();
@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <atomic>
+#include <algorithm>
 #include "material.h"
 #include "matops.h"
 #include "decorateVideo.h"
@@ -17,6 +18,10 @@
 using namespace std;
 using namespace cv;
 
+extern int enable_premultiplied_alpha;
+extern int standby_products;
+extern int64_t standby_memory;
+
 material::MaterialType string2type(const string &s)
 {
     if(strncasecmp(s.c_str(), "video", s.length()) == 0)
@@ -312,6 +317,24 @@ bool check_has_stream(std::vector<material> &mlist)
     return false;
 }
 
+// decode field of video materials, one of auto, full, fast, lowres, keyframe
+static int parse_decode_reduce(const std::string &s, DecodeReduce &reduce)
+{
+    if (s.empty() || strcasecmp(s.c_str(), "auto") == 0)
+        reduce = DR_AUTO;
+    else if (strcasecmp(s.c_str(), "full") == 0)
+        reduce = DR_FULL;
+    else if (strcasecmp(s.c_str(), "fast") == 0)
+        reduce = DR_FAST;
+    else if (strcasecmp(s.c_str(), "lowres") == 0)
+        reduce = DR_LOWRES;
+    else if (strcasecmp(s.c_str(), "keyframe") == 0)
+        reduce = DR_KEYFRAME;
+    else
+        return -1;
+    return 0;
+}
+
 int parse_material(const std::string &s, material &mm, const char *data_dir, double x_ratio, double y_ratio)
 {
     material m = {
@@ -327,6 +350,7 @@ int parse_material(const std::string &s, material &mm, const char *data_dir, dou
         .rotation = 0,
         .opacity = 100,
         .clock_starttime = 0,
+        .decode_reduce = DR_AUTO,
         .font = {0},
         .fontsize = 0,
         .olsize = 0,
@@ -442,6 +466,13 @@ int parse_material(const std::string &s, material &mm, const char *data_dir, dou
                 if (m.opacity <= 0 || m.opacity > 100) // 0 is equal to 100
                     m.opacity = 100;
                 break;
+            case 10: // decode
+                if (parse_decode_reduce(s1, m.decode_reduce) < 0)
+                {
+                    LOG_ERROR("Invalid decode argument in material: %s", s.c_str());
+                    return -1;
+                }
+                break;
             default: 
                 break;
         }
@@ -577,12 +608,16 @@ void get_text_image(material &m, const char *text)
         mat = mat2;
     }
     m.ctx.ftype = materialcontext::FT_BGRA;
+    if (enable_premultiplied_alpha) // opacity is already in text color
+    {
+        mat = PremultiplyAlpha(mat, 100);
+        m.ctx.ftype = materialcontext::FT_PBGRA;
+    }
     if (rotation % 360)
     {
         cv::Point pos(m.rect.x, m.rect.y);
         mat = RotateMat(mat, pos, rotation % 360);
         m.rect = cv::Rect(pos.x, pos.y, mat.cols, mat.rows);
-        m.ctx.ftype = materialcontext::FT_BGRA;
     }
     m.opacity = 100;
     m.rotation = 0;
@@ -633,7 +668,11 @@ __decode_gif:
                     {
                         if (oldRect.width != mm.cols || oldRect.height != mm.rows)
                             cv::resize(mm, mm, cv::Size(oldRect.width, oldRect.height), 0.0, 0.0, cv::INTER_CUBIC);
-                        if (m.opacity > 0 && m.opacity < 100)
+                        if (enable_premultiplied_alpha)
+                        {
+                            mm = PremultiplyAlpha(mm, m.opacity);
+                        }
+                        else if (m.opacity > 0 && m.opacity < 100)
                         {
                             float fop = ((float)m.opacity)/100;
                             // extract alpha image
@@ -659,6 +698,8 @@ __decode_gif:
                 m.ctx.ftype = materialcontext::FT_BGRA;
                 if (disable_opengl || m.ctx.frames.size() < 100)
                 {
+                    if (enable_premultiplied_alpha)
+                        m.ctx.ftype = materialcontext::FT_PBGRA;
                     m.opacity = 100;
                     m.rotation = 0;
                 }
@@ -675,9 +716,13 @@ __decode_gif:
                                              m.rect.width, m.rect.height, "speed", AV_PIX_FMT_BGR24,
                                              AV_SAMPLE_FMT_S16, audioinfo->channel, audioinfo->samplerate);
             else // open in thread
+            {
                 m.ctx.reader = new_video_reader(m.path, m.type==material::MT_Video? true:false, m.volume>0? true:false,
                                              m.rect.width, m.rect.height, "speed", AV_PIX_FMT_BGR24,
                                              AV_SAMPLE_FMT_S16, audioinfo->channel, audioinfo->samplerate);
+                if (m.ctx.reader && m.type == material::MT_Video)
+                    m.ctx.reader->decode_reduce = m.decode_reduce;
+            }
             if(m.ctx.reader == NULL)
             {
                 if (check_is_stream(m))
@@ -767,7 +812,13 @@ __decode_gif:
                 m.rect.height = mat.rows * y_ratio;
             if (m.rect.width != mat.cols || m.rect.height != mat.rows)
                 cv::resize(mat, mat, cv::Size(m.rect.width, m.rect.height), 0.0, 0.0, cv::INTER_CUBIC);
-            if (m.opacity > 0 && m.opacity < 100)
+            if (enable_premultiplied_alpha &&
+                (mat.channels()==4 || (m.opacity > 0 && m.opacity < 100) || (m.rotation % 360)))
+            {
+                mat = PremultiplyAlpha(mat, m.opacity);
+                m.ctx.ftype = materialcontext::FT_PBGRA;
+            }
+            else if (m.opacity > 0 && m.opacity < 100)
             {
                 float fop = ((float)m.opacity)/100;
                 // extract alpha to gray image
@@ -795,7 +846,8 @@ __decode_gif:
                 cv::Point pos(m.rect.x, m.rect.y);
                 mat = RotateMat(mat, pos, m.rotation % 360);
                 m.rect = cv::Rect(pos.x, pos.y, mat.cols, mat.rows);
-                m.ctx.ftype = materialcontext::FT_BGRA;
+                if (m.ctx.ftype != materialcontext::FT_PBGRA)
+                    m.ctx.ftype = materialcontext::FT_BGRA;
             }
             m.opacity = 100;
             m.rotation = 0;
@@ -1007,6 +1059,16 @@ cv::Mat *read_next_frame(material &m, double ts, bool disable_opengl)
             while (m.ctx.cts + m.ctx.tstep < ts)
             {
                 use_old = false;
+                // frames before the last one due are dropped without being converted
+                if (m.ctx.cts + 2 * m.ctx.tstep < ts)
+                {
+                    int ret = read_thread_stream_skip_frame(m.ctx.reader);
+                    if (ret > 0)
+                    {
+                        m.ctx.cts += m.ctx.tstep;
+                        continue;
+                    }
+                }
                 std::vector<unsigned char> *buffer = NULL;
                 int ret = read_thread_stream_video_frame(m.ctx.reader, &buffer);
                 if(ret < 0)
@@ -1240,6 +1302,88 @@ int close_streamout_thread(streamoutinfo *stream, bool force)
     return 0;
 }
 
+// products shown before, the latest last
+static std::vector<int> product_history;
+static std::vector<int> standby_list;
+
+// Products other than product_id, the likeliest to be switched to first: the next one by id, as
+// products are usually presented in turn, then those shown most recently, then the rest in turn
+static std::vector<int> rank_products(std::vector<material> &mlist, int product_id)
+{
+    std::vector<int> ids, ranked;
+    for (auto &m : mlist)
+        if (m.product_id > 0 && m.product_id != product_id && std::find(ids.begin(), ids.end(), m.product_id) == ids.end())
+            ids.push_back(m.product_id);
+    std::sort(ids.begin(), ids.end(), [product_id](int a, int b) {
+        return (a > product_id) != (b > product_id)? a > product_id : a < b;
+    });
+    auto add = [&](int id) {
+        if (std::find(ranked.begin(), ranked.end(), id) == ranked.end())
+            ranked.push_back(id);
+    };
+    if (ids.size())
+        add(ids[0]);
+    for (auto it = product_history.rbegin(); it != product_history.rend(); ++it)
+        if (std::find(ids.begin(), ids.end(), *it) != ids.end())
+            add(*it);
+    for (int id : ids)
+        add(id);
+    return ranked;
+}
+
+void switch_product(std::vector<material> &mlist, int old_product_id, int product_id, int stream_buffer_size)
+{
+    if (old_product_id > 0 && old_product_id != product_id)
+    {
+        product_history.erase(std::remove(product_history.begin(), product_history.end(), old_product_id), product_history.end());
+        product_history.push_back(old_product_id);
+        if (product_history.size() > 16)
+            product_history.erase(product_history.begin());
+    }
+    auto decoded = [](const material &m) { return m.type == material::MT_Audio || m.type == material::MT_Video; };
+
+    // the likeliest products, skipping those over the memory left
+    std::vector<int> standby;
+    int64_t budget = standby_memory;
+    for (int id : rank_products(mlist, product_id))
+    {
+        if ((int)standby.size() >= standby_products)
+            break;
+        int64_t bytes = 0;
+        for (auto &m : mlist)
+            if (m.product_id == id && decoded(m))
+                bytes += standby_video_bytes(m.ctx.reader);
+        if (bytes > budget)
+            continue;
+        budget -= bytes;
+        standby.push_back(id);
+    }
+    if (standby != standby_list)
+    {
+        std::string ids;
+        for (int id : standby)
+            ids += " " + std::to_string(id);
+        LOG_INFO("Products on standby:%s, %lld MB", ids.empty()? " none" : ids.c_str(), (long long)((standby_memory - budget) >> 20));
+        standby_list = standby;
+    }
+
+    for (auto &m : mlist)
+    {
+        if (m.product_id <= 0 || !decoded(m))
+            continue;
+        int floor = check_is_stream(m)? stream_buffer_size : 0;
+        if (m.product_id == product_id)
+        {
+            if (old_product_id != product_id) // already started unless switched to
+                start_video_decoder_thread(m.ctx.reader, AV_STREAMING, floor);
+        }
+        else if (std::find(standby.begin(), standby.end(), m.product_id) != standby.end())
+            standby_video_decoder_thread(m.ctx.reader, AV_STREAMING, floor);
+        else
+            stop_video_decoder_thread(m.ctx.reader, AV_STREAMING, floor);
+    }
+}
+
 struct open_materials_param
 {
     std::vector<material> mlist;
@@ -1,10 +1,13 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
 #include <opencv2/opencv.hpp>
 #include "videoplayer.h"
 #include "videowriter.h"
+#include "blend.h"
 
+struct RotateMap;
 
 struct materialcontext
 {
@@ -17,13 +20,25 @@ struct materialcontext
     // frame type: 
     //   bgrm  - bgr with mask
     //   ibgra - inverted image of brga
-    enum ColorType { FT_None, FT_BGR, FT_BGRA, FT_BGRM, FT_IBGRA } ftype;
+    //   pbgra - bgra with premultiplied alpha, opacity already applied
+    //   i420  - planar yuv420p, image has height*3/2 rows of one channel
+    enum ColorType { FT_None, FT_BGR, FT_BGRA, FT_BGRM, FT_IBGRA, FT_PBGRA, FT_I420 } ftype;
     std::vector<cv::Mat> frames;
     std::vector<unsigned char> audio; // raw pcm s16le data
     std::vector<double> fps_times; // each frame's display time in second, e.g. 0.01s
     int bufindex; // current index in frames
     int audindex; // current index in audio
     int time_opacity, time_rotation;
+    int blend_rotation; // clockwise degree not applied to frames yet, they are rotated while blending
+    std::shared_ptr<const RotateMap> rotate_map; // cached inverse map of blend_rotation
+    int blend_opacity; // opacity (0-255) not applied to frames yet, it is applied while blending, 0 means none
+    BlendRowFunc blend_row; // blend kernel of the frame format, see ResolveBlend()
+    int blend_key; // frame format blend_row is resolved for
+    cv::Mat blend_src; // frame converted for an i420 base with blend_opacity/blend_rotation applied, see BandCompositor::Add()
+    const uchar *blend_src_data; // frame blend_src is converted from, it is converted again when any of these changes
+    double blend_src_cts;
+    int blend_src_opacity;
+    std::shared_ptr<const RotateMap> blend_src_map;
     double clock_x_ratio, clock_y_ratio;
 
     unsigned int glTexture; // opengl texture for rendering
@@ -43,6 +58,7 @@ struct material
     int rotation; // clockwise rotation degree, -360 - 360
     int opacity; // opacity percentage, 0 - 100
     int64_t clock_starttime; // starting timestamp in unix_timestamp seconds
+    DecodeReduce decode_reduce; // for video only, see parse_decode_reduce()
 
     // text attributes
     char font[1024];
@@ -129,6 +145,10 @@ int open_materials(std::vector<material> &mlist, double x_ratio, double y_ratio,
 // open materials in new thread
 int submit_open_materials(std::vector<material> &new_mlist, double x_ratio, double y_ratio, rawaudioinfo &rawaudio, material &mainaudio, int stream_buffer_size, int fps, bool disable_opengl, int product_id);
 std::vector<material> *check_open_materials();
+// Start the video/audio materials of product_id and stop those of other products, except the ones of
+// the --standby_products likeliest next products within --standby_memory, which are kept pre-rolled.
+// Called with old_product_id == product_id to update the products on standby, e.g. after adding materials
+void switch_product(std::vector<material> &mlist, int old_product_id, int product_id, int stream_buffer_size);
 void close_material(material &m);
 int read_next_audio(material &m, std::vector<unsigned char> &buf, int max_size);
 cv::Mat *read_next_frame(material &m, double ts, bool disable_opengl);// read a proper frame based on the current timestamp
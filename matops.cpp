@@ -3,6 +3,7 @@
 #include "matops.h"
 #include "AutoTime.h"
 #include "material.h"
+#include "blend.h"
 #if defined(CentOS) && defined(__x86_64__)
 #define ICV_BASE
 #include "iw/iw_core.h"
@@ -14,18 +15,29 @@ using namespace std;
 using namespace cv;
 
 extern int enable_debug;
+extern int enable_premultiplied_alpha;
+extern int enable_rotate_blend;
 
-void GetOverlapMatries(cv::Mat &outBase, cv::Mat &outImage, 
-                cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
+bool ResizeOverlapImage(cv::Mat &image, cv::Mat *mask, int w, int h)
 {
-    // check if need resize
     if((w && w != image.cols) || (h && h != image.rows))
     {
         AUTOTIMED("resize run", enable_debug);
         if(w==0) w = image.cols;
         if(h==0) h = image.rows;
         cv::resize(image, image, cv::Size(w, h), 0.0, 0.0, cv::INTER_LINEAR);
+        if (mask)
+            cv::resize(*mask, *mask, cv::Size(w, h), 0.0, 0.0, cv::INTER_LINEAR);
+        return true;
     }
+    return false;
+}
+
+void GetOverlapMatries(cv::Mat &outBase, cv::Mat &outImage, 
+                cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
+{
+    // check if need resize
+    ResizeOverlapImage(image, NULL, w, h);
 
     // calculate two interleaved matries
     int newx = x, newy = y, neww = image.cols, newh = image.rows;
@@ -64,14 +76,7 @@ static void GetOverlapMatries(cv::Mat &outBase, cv::Mat &outImage, cv::Mat &outM
                 cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h)
 {
     // check if need resize
-    if((w && w != image.cols) || (h && h != image.rows))
-    {
-        AUTOTIMED("resize run", enable_debug);
-        if(w==0) w = image.cols;
-        if(h==0) h = image.rows;
-        cv::resize(image, image, cv::Size(w, h), 0.0, 0.0, cv::INTER_LINEAR);
-        cv::resize(mask, mask, cv::Size(w, h), 0.0, 0.0, cv::INTER_LINEAR);
-    }
+    ResizeOverlapImage(image, &mask, w, h);
 
     // calculate two interleaved matries
     int newx = x, newy = y, neww = image.cols, newh = image.rows;
@@ -206,49 +211,21 @@ static void OverlapBGRAImageBGRA(cv::Mat &base, cv::Mat &image, int x, int y, in
     if(fg.empty())
         return;
 
-    static __uint128_t mask1 = (((__uint128_t)0xffULL) << 120) + (((__uint128_t)0xffULL) << 88) + (((__uint128_t)0xffULL) << 56) + (((__uint128_t)0xffULL) << 24);
-    static __uint128_t mask2 = (((__uint128_t)0xffffffULL) << 96) + (((__uint128_t)0xffffffULL) << 64) + (((__uint128_t)0xffffffULL) << 32) + (((__uint128_t)0xffffffULL));
+    for(int r=0; r<fg.rows; r++)
+        blend_bgra_over_bgra(bg.ptr<uchar>(r), fg.ptr<uchar>(r), fg.cols);
+}
+
+// bgra over bgr, no need to split image into bgr + mask
+static void OverlapBGRAImageBGR(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
+{
+    cv::Mat fg, bg;
+    GetOverlapMatries(bg, fg, base, image, x, y, w, h);
+
+    if(fg.empty())
+        return;
 
     for(int r=0; r<fg.rows; r++)
-    {
-        int c = 0;
-        int cols = fg.cols - 4;
-        for(; c<=cols; c+=4)
-        {
-            auto pix = *(__uint128_t *)fg.ptr<uchar>(r, c);
-            auto val = (pix & mask1);
-            if (val == mask1) // all ones
-            {
-                *(__uint128_t *)bg.ptr<uchar>(r, c) = pix;
-            }
-            else if (val) // not all zeros
-            {
-                auto pix2 = fg.ptr<uchar>(r, c);
-                for (auto c1 = 0; c1 < 4; c1 ++)
-                {
-                    float alpha = ((float)pix2[3]) / 255; // alpha threshold value
-                    float beta = 1 - alpha;
-                    auto dst = bg.ptr<uchar>(r, c+c1);
-                    dst[0] = beta*dst[0] + alpha*pix2[0];
-                    dst[1] = beta*dst[1] + alpha*pix2[1];
-                    dst[2] = beta*dst[2] + alpha*pix2[2];
-                    dst[3] = beta*dst[3] + alpha*pix2[3];
-                    pix2 += 4;
-                }
-            }
-        }
-        for (; c<fg.cols; c++)
-        {
-            auto pix2 = fg.ptr<uchar>(r, c);
-            float alpha = ((float)pix2[3]) / 255; // alpha threshold value
-            float beta = 1 - alpha;
-            auto dst = bg.ptr<uchar>(r, c);
-            dst[0] = beta*dst[0] + alpha*pix2[0];
-            dst[1] = beta*dst[1] + alpha*pix2[1];
-            dst[2] = beta*dst[2] + alpha*pix2[2];
-            dst[3] = beta*dst[3] + alpha*pix2[3];
-        }
-    }
+        blend_bgra_over_bgr(bg.ptr<uchar>(r), fg.ptr<uchar>(r), fg.cols);
 }
 
 void OverlapImageBGRM(cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h)
@@ -270,74 +247,8 @@ void OverlapImageBGRM(cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y
     if(fg.empty())
         return;
 
-    static __uint128_t mask1 = ~(__uint128_t)0;
-    static  __uint64_t mask2 = ~(__uint64_t)0;
-
     for(int r=0; r<fg.rows; r++)
-    {
-        int c = 0;
-        int cols = fg.cols - 16;
-        for(; c<=cols; c+=16)
-        {
-            auto msk = *(__uint128_t*)subMsk.ptr<uchar>(r, c);
-            if (msk == mask1) // all ones
-            {
-                memcpy(bg.ptr<uchar>(r, c), fg.ptr<uchar>(r, c), 48);
-            }
-            else if (msk) // not all zeros
-            {
-                auto pmsk8 = (__uint64_t*)subMsk.ptr<uchar>(r, c);
-                for (auto t = 0; t<=8; t+=8, pmsk8++)
-                {
-                    auto msk8 = *pmsk8;
-                    if (msk8 == mask2) // all ones
-                    {
-                        memcpy(bg.ptr<uchar>(r, c+t), fg.ptr<uchar>(r, c+t), 24);
-                    }
-                    else if (msk8) // not all zeros
-                    {
-                        auto pix = fg.ptr<uchar>(r, c+t);
-                        auto dst = bg.ptr<uchar>(r, c+t);
-                        auto pm = (uchar *)pmsk8;
-                        for (auto i=0; i<8; i++,pix+=3,dst+=3,pm++)
-                        {
-                            auto a = *pm;
-                            if(a > 240) // solid forground, memcpy
-                            {
-                                memcpy(dst, pix, 3);
-                            }
-                            else if(a > 10) // alpha is zero, skip
-                            {
-                                float alpha = ((float)a) / 255; // alpha threshold value
-                                float beta = 1-alpha;
-                                dst[0] = beta*dst[0] + alpha*pix[0];
-                                dst[1] = beta*dst[1] + alpha*pix[1];
-                                dst[2] = beta*dst[2] + alpha*pix[2];
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        for (; c < fg.cols; c++)
-        {
-            auto pix = fg.ptr<uchar>(r, c);
-            auto dst = bg.ptr<uchar>(r, c);
-            auto a = *subMsk.ptr<uchar>(r, c);
-            if(a > 240) // solid forground, memcpy
-            {
-                memcpy(dst, pix, 3);
-            }
-            else if(a > 10) // alpha is zero, skip
-            {
-                float alpha = ((float)a) / 255; // alpha threshold value
-                float beta = 1-alpha;
-                dst[0] = beta*dst[0] + alpha*pix[0];
-                dst[1] = beta*dst[1] + alpha*pix[1];
-                dst[2] = beta*dst[2] + alpha*pix[2];
-            }
-        }
-    }
+        blend_bgrm_over_bgr(bg.ptr<uchar>(r), fg.ptr<uchar>(r), subMsk.ptr<uchar>(r), fg.cols);
 }
 
 void OverlapImageBGRA(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
@@ -348,13 +259,44 @@ void OverlapImageBGRA(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
     }
     else
     {
-        cv::Mat imgs[2] {cv::Mat(image.size(), CV_8UC3), cv::Mat(image.size(), CV_8U)};
-        int from_to[] = {0, 0, 1, 1, 2, 2, 3, 3};
-        mixChannels(&image, 1, imgs, 2, from_to, 4);
-        OverlapImageBGRM(base, imgs[0], imgs[1], x, y, w, h);
+        OverlapBGRAImageBGR(base, image, x, y, w, h);
     }
 }
 
+void OverlapImagePBGRA(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
+{
+    cv::Mat fg, bg;
+    GetOverlapMatries(bg, fg, base, image, x, y, w, h);
+
+    if(fg.empty())
+        return;
+
+    for(int r=0; r<fg.rows; r++)
+    {
+        if (bg.channels() == 4)
+            blend_pbgra_over_bgra(bg.ptr<uchar>(r), fg.ptr<uchar>(r), fg.cols);
+        else
+            blend_pbgra_over_bgr(bg.ptr<uchar>(r), fg.ptr<uchar>(r), fg.cols);
+    }
+}
+
+cv::Mat PremultiplyAlpha(const cv::Mat &mat, int opacity)
+{
+    if (opacity <= 0 || opacity > 100) // 0 is equal to 100
+        opacity = 100;
+    opacity = (opacity * 255 + 50) / 100;
+
+    cv::Mat result(mat.size(), CV_8UC4);
+    for(int r=0; r<mat.rows; r++)
+    {
+        if (mat.channels() == 3)
+            premultiply_bgr(result.ptr<uchar>(r), mat.ptr<uchar>(r), mat.cols, opacity);
+        else
+            premultiply_bgra(result.ptr<uchar>(r), mat.ptr<uchar>(r), mat.cols, opacity);
+    }
+    return result;
+}
+
 void OverlapImageBGR(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h)
 {
     AUTOTIMED("OverlapImageBGR run", enable_debug);
@@ -692,45 +634,7 @@ cv::Mat text2Mat(const std::string &text, const std::string &font, int size,
 //   'b' - alpha at bottom
 cv::Mat MakeAlphaMat(cv::Mat frame, int alpha_mode, cv::Mat *pmask)
 {
-    cv::Mat mmat, amat;
-    int a = tolower(alpha_mode);
-    if (a == 'l') // alpha at left
-    {
-        amat = frame(cv::Rect(0, 0, frame.cols/2, frame.rows));
-        mmat = frame(cv::Rect(frame.cols/2, 0, frame.cols/2, frame.rows));
-    }
-    else if (a == 'r') // right
-    {
-        amat = frame(cv::Rect(frame.cols/2, 0, frame.cols/2, frame.rows));
-        mmat = frame(cv::Rect(0, 0, frame.cols/2, frame.rows));
-    }
-    else if (a == 't') // top
-    {
-        amat = frame(cv::Rect(0, 0, frame.cols, frame.rows/2));
-        mmat = frame(cv::Rect(0, frame.rows/2, frame.cols, frame.rows/2));
-    }
-    else if (a == 'b') // bottom
-    {
-        amat = frame(cv::Rect(0, frame.rows/2, frame.cols, frame.rows/2));
-        mmat = frame(cv::Rect(0, 0, frame.cols, frame.rows/2));
-    }
-    if (!amat.empty()) // alpha blending
-    {
-        if (pmask)
-        {
-            cvtColor(amat, *pmask, COLOR_BGR2GRAY);
-            return mmat;
-        }
-
-        cv::Mat mats[2] = {mmat, amat};
-        frame = cv::Mat(mmat.size(), CV_8UC4);
-        int from_to[] = {0,0, 1,1, 2,2, 4,3};
-        if (mmat.channels()==3) // 3-bgr, 4-bgra
-            from_to[6] = 3;
-        cv::mixChannels(mats, 2, &frame, 1, from_to, 4);
-    }
-
-    return frame;
+    return MakeAlphaMat(frame, alpha_mode, 0, 0, 100, false, pmask);
 }
 
 
@@ -845,6 +749,12 @@ cv::Mat RotateMat(cv::Mat mat, cv::Point &pos, int degree)
 #endif
 }
 
+// row step of frames read by video, see FFReader::disp_linesize
+static size_t display_step(FFReader *video)
+{
+    return video->disp_linesize? (size_t)video->disp_linesize : cv::Mat::AUTO_STEP;
+}
+
 cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelFormat fmt, bool disable_opengl, const char *alpha_video, cv::Mat *pmask)
 {
     if (fmt != AV_PIX_FMT_BGRA && fmt != AV_PIX_FMT_BGR24 && fmt != AV_PIX_FMT_NONE)
@@ -871,6 +781,16 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
     }
     bool needs_transpancy = (disable_opengl && 
         ((m.opacity > 0 && m.opacity < 100) || m.rotation % 360));
+    // non-90 degree rotation is done while blending, see OverlapRotatedImage()
+    bool rotate_blend = (disable_opengl && enable_rotate_blend && (m.rotation % 90));
+    m.ctx.blend_rotation = 0;
+    // premultiplied result is made in one pass from bgr or bgra, no need to convert to bgra first
+    bool premultiply = (needs_transpancy && enable_premultiplied_alpha && pmask == NULL);
+    // otherwise opacity is applied by the blend kernel of the layer, see ResolveBlend(),
+    // unless the frame is rotated by RotateMat() which needs the final alpha
+    bool blend_opacity = (needs_transpancy && !premultiply && !alpha_video &&
+            m.opacity > 0 && m.opacity < 100 && (rotate_blend || (m.rotation % 360) == 0));
+    m.ctx.blend_opacity = blend_opacity? (m.opacity * 255 + 50) / 100 : 0;
     if (fmt == AV_PIX_FMT_NONE)
     {
         fmt = video->out_pix_fmt;
@@ -879,7 +799,8 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
         else if (fmt != AV_PIX_FMT_BGRA && fmt != AV_PIX_FMT_BGR24)
             fmt = AV_PIX_FMT_BGR24;
     }
-    if (needs_transpancy)
+    if (needs_transpancy && ((!premultiply && !blend_opacity && !rotate_blend) ||
+            video->out_pix_fmt == AV_PIX_FMT_BGRA || video->out_pix_fmt == AV_PIX_FMT_RGBA))
         fmt = AV_PIX_FMT_BGRA;
     if (alpha_video)
         fmt = AV_PIX_FMT_BGR24;
@@ -887,7 +808,7 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
     if (video->out_pix_fmt == fmt) // no fmt conversion
     {
         mat = cv::Mat(cv::Size(video->disp_width, video->disp_height),
-                        fmt == AV_PIX_FMT_BGRA? CV_8UC4 : CV_8UC3, data);
+                        fmt == AV_PIX_FMT_BGRA? CV_8UC4 : CV_8UC3, data, display_step(video));
     }
     else
     {
@@ -905,7 +826,7 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
             c = fmt==AV_PIX_FMT_BGRA? cv::COLOR_RGB2BGRA : cv::COLOR_RGB2BGR;
         else if(video->out_pix_fmt == AV_PIX_FMT_RGBA)
             c = fmt==AV_PIX_FMT_BGRA? cv::COLOR_RGBA2BGRA : cv::COLOR_RGBA2BGR;
-        mat = cv::Mat(cv::Size(w, h), t, data);
+        mat = cv::Mat(cv::Size(w, h), t, data, t == CV_8U? cv::Mat::AUTO_STEP : display_step(video));
         cv::cvtColor(mat, mat, c);
     }
 
@@ -915,25 +836,25 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
     if (alpha_video)
     {
         auto a = tolower(alpha_video[0]);
-        if (a=='l' || a=='r')
-            oldRect.width *= 2;
-        else if (a=='t' || a=='b')
-            oldRect.height *= 2;
-        if (oldRect.width != mat.cols || oldRect.height != mat.rows)
-            cv::resize(mat, mat, cv::Size(oldRect.width, oldRect.height), 0.0, 0.0, cv::INTER_NEAREST);
-        mat = MakeAlphaMat(mat, a, pmask);
+        // scaling, merging of the color and alpha halves and opacity are done in one pass
+        mat = MakeAlphaMat(mat, a, oldRect.width, oldRect.height,
+                        needs_transpancy? m.opacity : 100, premultiply, pmask);
     }
-    else if (needs_transpancy)
+    else if (needs_transpancy && !rotate_blend) // rotated image is scaled while blending
     {
         if (oldRect.width != mat.cols || oldRect.height != mat.rows)
             cv::resize(mat, mat, cv::Size(oldRect.width, oldRect.height), 0.0, 0.0, cv::INTER_NEAREST);
     }
 
+    if (premultiply && !alpha_video)
+    {
+        mat = PremultiplyAlpha(mat, m.opacity);
+    }
     if (needs_transpancy)
     {
-        if (m.opacity > 0 && m.opacity < 100)
+        if (!premultiply && !alpha_video && !blend_opacity && m.opacity > 0 && m.opacity < 100)
         {
-            bool src_has_alpha = (video->out_pix_fmt == AV_PIX_FMT_BGRA || video->out_pix_fmt == AV_PIX_FMT_RGBA || alpha_video);
+            bool src_has_alpha = (video->out_pix_fmt == AV_PIX_FMT_BGRA || video->out_pix_fmt == AV_PIX_FMT_RGBA);
             float fop = ((float)m.opacity)/100;
             if (pmask && !pmask->empty()) // output alpha in pmask
             {
@@ -964,7 +885,20 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
                 }
             }
         }
-        if (m.rotation % 360)
+        if (rotate_blend)
+        {
+            if (m.ori_video_rect.width == 0 || m.ori_video_rect.height == 0)
+                m.ori_video_rect = m.rect;
+            if (pmask && !pmask->empty() && mat.channels()==4) // bgrm is rotated only if bgr
+            {
+                cv::insertChannel(*pmask, mat, 3);
+                pmask->release();
+            }
+            // frame is kept unrotated in its display rect, the inverse map is cached by GetRotateMap()
+            m.rect = m.ori_video_rect;
+            m.ctx.blend_rotation = m.rotation % 360;
+        }
+        else if (m.rotation % 360)
         {
             if (pmask && !pmask->empty()) // dont support rotation on mask for now, so insert back
             {
@@ -981,33 +915,592 @@ cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelF
         }
     }
 
-    m.ctx.ftype = (pmask && !pmask->empty())? materialcontext::FT_BGRM : \
+    if (premultiply)
+        m.ctx.ftype = materialcontext::FT_PBGRA;
+    else
+        m.ctx.ftype = (pmask && !pmask->empty())? materialcontext::FT_BGRM : \
                 (mat.channels()==3? materialcontext::FT_BGR : materialcontext::FT_BGRA);
     return mat;
 }
 
 
-void OverlapImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h)
+// map dst pixels [d0, d0+n) of an axis scaled from sn to dn pixels to source offsets,
+// pixel centers are aligned the same way as cv::resize
+static void GetScaleMap(int sn, int dn, int d0, int n, int cn, bool linear,
+                std::vector<int> &ofs0, std::vector<int> &ofs1, std::vector<short> &wt)
+{
+    double scale = (double)sn / dn;
+    ofs0.resize(n);
+    ofs1.resize(n);
+    wt.resize(n);
+    for (int i=0; i<n; i++)
+    {
+        int s0, w = 0;
+        if (linear)
+        {
+            double f = (d0 + i + 0.5) * scale - 0.5;
+            s0 = cvFloor(f);
+            w = cvRound((f - s0) * 256);
+            if (s0 < 0)
+            {
+                s0 = 0;
+                w = 0;
+            }
+        }
+        else
+        {
+            s0 = cvFloor((d0 + i) * scale);
+        }
+        if (s0 >= sn - 1)
+        {
+            s0 = sn - 1;
+            w = 0;
+        }
+        ofs0[i] = s0 * cn;
+        ofs1[i] = std::min(s0 + 1, sn - 1) * cn;
+        wt[i] = w;
+    }
+}
+
+cv::Mat MakeAlphaMat(const cv::Mat &frame, int alpha_mode, int w, int h, int opacity, bool premultiply, cv::Mat *pmask)
+{
+    cv::Rect crect, arect;
+    int hw = frame.cols/2, hh = frame.rows/2;
+    int a = tolower(alpha_mode);
+    if (a == 'l') // alpha at left
+    {
+        arect = cv::Rect(0, 0, hw, frame.rows);
+        crect = cv::Rect(hw, 0, hw, frame.rows);
+    }
+    else if (a == 'r') // right
+    {
+        arect = cv::Rect(hw, 0, hw, frame.rows);
+        crect = cv::Rect(0, 0, hw, frame.rows);
+    }
+    else if (a == 't') // top
+    {
+        arect = cv::Rect(0, 0, frame.cols, hh);
+        crect = cv::Rect(0, hh, frame.cols, hh);
+    }
+    else if (a == 'b') // bottom
+    {
+        arect = cv::Rect(0, hh, frame.cols, hh);
+        crect = cv::Rect(0, 0, frame.cols, hh);
+    }
+    if (arect.empty())
+        return frame;
+
+    AUTOTIMED("MakeAlphaMat run", enable_debug);
+    cv::Mat cmat = frame(crect), amat = frame(arect);
+    int cn = frame.channels();
+    if (w <= 0) w = cmat.cols;
+    if (h <= 0) h = cmat.rows;
+    if (opacity <= 0 || opacity > 100) // 0 is equal to 100
+        opacity = 100;
+    if (pmask)
+        premultiply = false;
+
+    // bgr color half is returned as is if not scaled, only the mask is made
+    bool keep_color = (pmask && cn == 3 && w == cmat.cols && h == cmat.rows);
+    cv::Mat result = keep_color? cmat : cv::Mat(h, w, pmask? CV_8UC3 : CV_8UC4);
+    if (pmask)
+        pmask->create(h, w, CV_8UC1);
+
+    // opacity of straight alpha or mask, premultiplied result gets it from premultiply_bgra()
+    uchar lut[256];
+    float fop = premultiply? 1.0f : ((float)opacity)/100;
+    for (int i=0; i<256; i++)
+        lut[i] = cv::saturate_cast<uchar>(i * fop);
+
+    std::vector<int> xofs, yofs, ofs1;
+    std::vector<short> wt;
+    GetScaleMap(cmat.cols, w, 0, w, cn, false, xofs, ofs1, wt);
+    GetScaleMap(cmat.rows, h, 0, h, 1, false, yofs, ofs1, wt);
+    cv::parallel_for_(cv::Range(0, h), [&](const cv::Range &range) {
+        for (int r = range.start; r < range.end; r++)
+        {
+            const uchar *c = cmat.ptr<uchar>(yofs[r]);
+            const uchar *s = amat.ptr<uchar>(yofs[r]);
+            uchar *d = result.ptr<uchar>(r);
+            if (pmask)
+            {
+                uchar *m = pmask->ptr<uchar>(r);
+                for (int i=0; i<w; i++)
+                {
+                    // the same fixed-point weights as cv::COLOR_BGR2GRAY
+                    const uchar *p = s + xofs[i];
+                    m[i] = lut[(p[0]*1868 + p[1]*9617 + p[2]*4899 + (1<<13)) >> 14];
+                }
+                if (keep_color)
+                    continue;
+                if (cn == 3)
+                    scale_row_nearest(d, c, xofs.data(), w, 3);
+                else
+                    for (int i=0; i<w; i++, d+=3)
+                        memcpy(d, c + xofs[i], 3);
+                continue;
+            }
+            // alpha is taken from the first channel of the alpha half
+            for (int i=0; i<w; i++, d+=4)
+            {
+                const uchar *p = c + xofs[i];
+                d[0] = p[0];
+                d[1] = p[1];
+                d[2] = p[2];
+                d[3] = lut[s[xofs[i]]];
+            }
+            if (premultiply)
+            {
+                d = result.ptr<uchar>(r);
+                premultiply_bgra(d, d, w, (opacity * 255 + 50) / 100);
+            }
+        }
+    });
+    return result;
+}
+
+BlendRowFunc GetBlendRowFunc(int ftype, int cn, int base_cn, bool has_opacity)
 {
     switch (ftype)
     {
     case materialcontext::FT_BGR:
-        OverlapImageBGR(base, image, x, y, w, h);
-        break;
+        return blend_get_row_func(BLEND_SRC_OPAQUE, cn, base_cn, has_opacity, false);
     case materialcontext::FT_BGRA:
-        OverlapImageBGRA(base, image, x, y, w, h);
-        break;
+        return blend_get_row_func(BLEND_SRC_STRAIGHT, cn, base_cn, has_opacity, false);
     case materialcontext::FT_BGRM:
-        OverlapImageBGRM(base, image, mask, x, y, w, h);
-        break;
+        return blend_get_row_func(BLEND_SRC_STRAIGHT, cn, base_cn, has_opacity, true);
+    case materialcontext::FT_PBGRA:
+        return blend_get_row_func(BLEND_SRC_PREMULTIPLIED, cn, base_cn, has_opacity, false);
     default:
-        break;
+        return NULL;
+    }
+}
+
+BlendRowFunc ResolveBlend(material &m, const cv::Mat &image, int base_cn)
+{
+    int key = m.ctx.ftype | (image.channels() << 8) | (base_cn << 12) | ((m.ctx.blend_opacity? 1 : 0) << 16);
+    if (m.ctx.blend_row && m.ctx.blend_key == key)
+        return m.ctx.blend_row;
+    m.ctx.blend_row = GetBlendRowFunc(m.ctx.ftype, image.channels(), base_cn, m.ctx.blend_opacity != 0);
+    m.ctx.blend_key = key;
+    return m.ctx.blend_row;
+}
+
+bool OverlapScaledImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h, int interpolation)
+{
+    cv::Mat none;
+    BlendRowFunc blend = GetBlendRowFunc(ftype, image.channels(), base.channels(), false);
+    if (!blend)
+        return false;
+    return OverlapScaledImage(blend, 0, base, image, ftype == materialcontext::FT_BGRM? mask : none, x, y, w, h, interpolation);
+}
+
+bool OverlapScaledImage(BlendRowFunc blend, int opacity, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h, int interpolation)
+{
+    int cn = image.channels();
+    bool has_mask = !mask.empty();
+    if (image.empty() || (has_mask && mask.size() != image.size()))
+        return false;
+    if(w==0) w = image.cols;
+    if(h==0) h = image.rows;
+
+    // visible part of the scaled image
+    cv::Rect roi = cv::Rect(x, y, w, h) & cv::Rect(0, 0, base.cols, base.rows);
+    if (roi.empty())
+        return true;
+
+    AUTOTIMED("OverlapScaledImage run", enable_debug);
+    bool linear = (interpolation != cv::INTER_NEAREST);
+    // maps and rows are kept per thread, so that bands of every frame reuse them without allocation
+    static thread_local std::vector<int> xofs0, xofs1, yofs0, yofs1, mofs0, mofs1;
+    static thread_local std::vector<short> wx, wy, mwx;
+    static thread_local std::vector<uchar> row, mrow;
+    GetScaleMap(image.cols, w, roi.x - x, roi.width, cn, linear, xofs0, xofs1, wx);
+    GetScaleMap(image.rows, h, roi.y - y, roi.height, 1, linear, yofs0, yofs1, wy);
+    if (has_mask)
+        GetScaleMap(mask.cols, w, roi.x - x, roi.width, 1, linear, mofs0, mofs1, mwx);
+
+    // only one scaled row is kept, which stays in L1 cache until blended
+    row.resize(roi.width * cn);
+    mrow.resize(has_mask? roi.width : 0);
+    for (int r=0; r<roi.height; r++)
+    {
+        uchar *d = base.ptr<uchar>(roi.y + r) + roi.x * base.channels();
+        uchar *s = row.data();
+        if (linear)
+            scale_row_linear(s, image.ptr<uchar>(yofs0[r]), image.ptr<uchar>(yofs1[r]), wy[r],
+                            xofs0.data(), xofs1.data(), wx.data(), roi.width, cn);
+        else
+            scale_row_nearest(s, image.ptr<uchar>(yofs0[r]), xofs0.data(), roi.width, cn);
+
+        if (has_mask)
+        {
+            if (linear)
+                scale_row_linear(mrow.data(), mask.ptr<uchar>(yofs0[r]), mask.ptr<uchar>(yofs1[r]), wy[r],
+                                mofs0.data(), mofs1.data(), mwx.data(), roi.width, 1);
+            else
+                scale_row_nearest(mrow.data(), mask.ptr<uchar>(yofs0[r]), mofs0.data(), roi.width, 1);
+        }
+        blend(d, s, mrow.data(), roi.width, opacity);
+    }
+    return true;
+}
+
+// convert n pixels of bgr/bgra to bgra, alpha is taken from mask if not null, or 255 if opaque
+static void ExpandToBGRA(uchar *dst, const uchar *src, const uchar *mask, int n, int cn, bool opaque)
+{
+    if (cn == 4 && !mask && !opaque)
+    {
+        memcpy(dst, src, n*4);
+        return;
+    }
+    for (int i=0; i<n; i++, dst+=4, src+=cn)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = mask? mask[i] : 255;
+    }
+}
+
+void OverlapImageI420(int ftype, cv::Mat &ym, cv::Mat &um, cv::Mat &vm, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h)
+{
+    if (image.empty())
+        return;
+
+    if (ftype == materialcontext::FT_I420) // copy planes, chroma planes can only be placed at even positions
+    {
+        int sw = image.cols, sh = image.rows * 2 / 3;
+        if(w==0) w = sw;
+        if(h==0) h = sh;
+        x &= ~1;
+        y &= ~1;
+        w &= ~1;
+        h &= ~1;
+        cv::Mat none, ys = image.rowRange(0, sh);
+        cv::Mat us(sh/2, sw/2, CV_8U, image.data + sw*sh);
+        cv::Mat vs(sh/2, sw/2, CV_8U, image.data + sw*sh + (sw/2)*(sh/2));
+        OverlapImage(materialcontext::FT_BGR, ym, ys, none, x, y, w, h);
+        OverlapImage(materialcontext::FT_BGR, um, us, none, x/2, y/2, w/2, h/2);
+        OverlapImage(materialcontext::FT_BGR, vm, vs, none, x/2, y/2, w/2, h/2);
+        return;
+    }
+
+    int cn = image.channels();
+    if (ftype != materialcontext::FT_BGR && ftype != materialcontext::FT_BGRA &&
+        ftype != materialcontext::FT_PBGRA && ftype != materialcontext::FT_BGRM)
+        return;
+    if (ftype == materialcontext::FT_BGRM && mask.size() != image.size())
+        return;
+    if(w==0) w = image.cols;
+    if(h==0) h = image.rows;
+
+    cv::Rect roi = cv::Rect(x, y, w, h) & cv::Rect(0, 0, ym.cols, ym.rows);
+    if (roi.empty())
+        return;
+
+    AUTOTIMED("OverlapImageI420 run", enable_debug);
+    bool scaled = (w != image.cols || h != image.rows);
+    // maps and rows are kept per thread, as OverlapScaledImage() does
+    static thread_local std::vector<int> xofs0, xofs1, yofs0, yofs1, mofs0, mofs1;
+    static thread_local std::vector<short> wx, wy, mwx;
+    static thread_local std::vector<uchar> srow, mrow, rows;
+    if (scaled)
+    {
+        GetScaleMap(image.cols, w, roi.x - x, roi.width, cn, true, xofs0, xofs1, wx);
+        GetScaleMap(image.rows, h, roi.y - y, roi.height, 1, true, yofs0, yofs1, wy);
+        if (ftype == materialcontext::FT_BGRM)
+            GetScaleMap(mask.cols, w, roi.x - x, roi.width, 1, true, mofs0, mofs1, mwx);
+    }
+
+    // blend by whole 2x2 blocks, pixels out of roi are transparent
+    int bx0 = roi.x & ~1, bx1 = (roi.x + roi.width + 1) & ~1;
+    int bn = bx1 - bx0, off = (roi.x - bx0) * 4, tail = (bx1 - roi.x - roi.width) * 4;
+    srow.resize(scaled? roi.width * cn : 0);
+    mrow.resize(scaled? roi.width : 0);
+    rows.resize(bn * 4 * 2);
+    bool opaque = (ftype == materialcontext::FT_BGR);
+    for (int by = roi.y & ~1; by < roi.y + roi.height; by += 2)
+    {
+        uchar *r[2] = {rows.data(), rows.data() + bn * 4};
+        for (int k=0; k<2; k++)
+        {
+            int yy = by + k - roi.y;
+            if (yy < 0 || yy >= roi.height)
+            {
+                memset(r[k], 0, bn * 4);
+                continue;
+            }
+            const uchar *src, *msk = NULL;
+            if (scaled)
+            {
+                scale_row_linear(srow.data(), image.ptr<uchar>(yofs0[yy]), image.ptr<uchar>(yofs1[yy]), wy[yy],
+                                xofs0.data(), xofs1.data(), wx.data(), roi.width, cn);
+                src = srow.data();
+                if (ftype == materialcontext::FT_BGRM)
+                {
+                    scale_row_linear(mrow.data(), mask.ptr<uchar>(yofs0[yy]), mask.ptr<uchar>(yofs1[yy]), wy[yy],
+                                    mofs0.data(), mofs1.data(), mwx.data(), roi.width, 1);
+                    msk = mrow.data();
+                }
+            }
+            else
+            {
+                src = image.ptr<uchar>(roi.y - y + yy) + (roi.x - x) * cn;
+                if (ftype == materialcontext::FT_BGRM)
+                    msk = mask.ptr<uchar>(roi.y - y + yy) + (roi.x - x);
+            }
+            if (off)
+                memset(r[k], 0, off);
+            if (tail)
+                memset(r[k] + bn * 4 - tail, 0, tail);
+            ExpandToBGRA(r[k] + off, src, msk, roi.width, cn, opaque);
+        }
+        blend_bgra_over_i420(ym.ptr<uchar>(by) + bx0, ym.ptr<uchar>(by + 1) + bx0,
+                            um.ptr<uchar>(by / 2) + bx0 / 2, vm.ptr<uchar>(by / 2) + bx0 / 2,
+                            r[0], r[1], bn, ftype == materialcontext::FT_PBGRA);
+    }
+}
+
+void OverlapImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h)
+{
+    cv::Mat none;
+    BlendRowFunc blend = GetBlendRowFunc(ftype, image.channels(), base.channels(), false);
+    if (blend)
+        OverlapImage(blend, 0, base, image, ftype == materialcontext::FT_BGRM? mask : none, x, y, w, h);
+}
+
+void OverlapImage(BlendRowFunc blend, int opacity, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h)
+{
+    if (image.empty() || (!mask.empty() && mask.size() != image.size()))
+        return;
+    // scale while blending if image is not at display size, instead of resizing it first
+    if ((w && w != image.cols) || (h && h != image.rows))
+    {
+        OverlapScaledImage(blend, opacity, base, image, mask, x, y, w, h, INTER_LINEAR);
+        return;
+    }
+
+    cv::Rect roi = cv::Rect(x, y, image.cols, image.rows) & cv::Rect(0, 0, base.cols, base.rows);
+    if (roi.empty())
+        return;
+    int cn = image.channels(), bcn = base.channels();
+    for (int r=0; r<roi.height; r++)
+    {
+        int sy = roi.y - y + r, sx = roi.x - x;
+        blend(base.ptr<uchar>(roi.y + r) + roi.x * bcn, image.ptr<uchar>(sy) + sx * cn,
+            mask.empty()? NULL : mask.ptr<uchar>(sy) + sx, roi.width, opacity);
+    }
+}
+
+std::shared_ptr<const RotateMap> GetRotateMap(material &m, const cv::Mat &image)
+{
+    int sw = image.cols, sh = image.rows;
+    int w = m.rect.width? m.rect.width : sw;
+    int h = m.rect.height? m.rect.height : sh;
+    int degree = m.ctx.blend_rotation;
+    auto &cached = m.ctx.rotate_map;
+    if (cached && cached->sw == sw && cached->sh == sh && cached->w == w && cached->h == h && cached->degree == degree)
+        return cached;
+
+    AUTOTIMED("GetRotateMap run", enable_debug);
+    // always make a new map, the old one may still be used by queued layers
+    auto map = std::make_shared<RotateMap>();
+    map->sw = sw;
+    map->sh = sh;
+    map->w = w;
+    map->h = h;
+    map->degree = degree;
+    double rad = degree * CV_PI / 180, c = cos(rad), s = sin(rad);
+    int bw = cvRound(fabs(w * c) + fabs(h * s)), bh = cvRound(fabs(w * s) + fabs(h * c));
+    map->bbox = cv::Rect((w - bw) / 2, (h - bh) / 2, bw, bh); // the same position as RotateMat()
+
+    // center of a dst pixel is rotated back around the rect center, then scaled to source pixels,
+    // moving one pixel right in dst moves (c*fx, -s*fy) in source
+    double fx = (double)sw / w, fy = (double)sh / h;
+    double ax = c * fx, ay = -s * fy;
+    map->dxx = cvRound(ax * 65536);
+    map->dxy = cvRound(ay * 65536);
+    map->x0.resize(bh);
+    map->n.resize(bh);
+    map->sx.resize(bh);
+    map->sy.resize(bh);
+    for (int r=0; r<bh; r++)
+    {
+        double dx = map->bbox.x + 0.5 - w / 2.0, dy = map->bbox.y + r + 0.5 - h / 2.0;
+        double u = (dx * c + dy * s + w / 2.0) * fx, v = (-dx * s + dy * c + h / 2.0) * fy;
+        int su = cvRound(u * 65536), sv = cvRound(v * 65536);
+        auto inside = [&](int i)->bool {
+            int64_t x = su + (int64_t)i * map->dxx, y = sv + (int64_t)i * map->dxy;
+            return x >= 0 && y >= 0 && (x >> 16) < sw && (y >> 16) < sh;
+        };
+        // span of p + a*i in [0, n) for both axes
+        double lo = 0, hi = bw - 1;
+        auto clip = [&](double p, double a, double n) {
+            if (fabs(a) < 1e-9)
+            {
+                if (p < 0 || p >= n)
+                    hi = -1;
+                return;
+            }
+            double i0 = -p / a, i1 = (n - p) / a;
+            lo = std::max(lo, std::min(i0, i1));
+            hi = std::min(hi, std::max(i0, i1));
+        };
+        clip(u, ax, sw);
+        clip(v, ay, sh);
+        int i0 = 0, i1 = -1;
+        if (lo <= hi)
+        {
+            i0 = std::max(0, (int)ceil(lo));
+            i1 = std::min(bw - 1, (int)floor(hi));
+        }
+        // fix the ends by the fixed point positions used while blending
+        while (i0 <= i1 && !inside(i0))
+            i0++;
+        while (i1 >= i0 && !inside(i1))
+            i1--;
+        if (i0 <= i1)
+        {
+            while (i0 > 0 && inside(i0 - 1))
+                i0--;
+            while (i1 < bw - 1 && inside(i1 + 1))
+                i1++;
+        }
+        map->x0[r] = i0;
+        map->n[r] = std::max(0, i1 - i0 + 1);
+        map->sx[r] = su + i0 * map->dxx;
+        map->sy[r] = sv + i0 * map->dxy;
+    }
+    cached = map;
+    return cached;
+}
+
+bool OverlapRotatedImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, const RotateMap &map)
+{
+    cv::Mat none;
+    BlendRowFunc blend = GetBlendRowFunc(ftype, image.channels(), base.channels(), false);
+    if (!blend)
+        return false;
+    return OverlapRotatedImage(blend, 0, base, image, ftype == materialcontext::FT_BGRM? mask : none, x, y, map);
+}
+
+bool OverlapRotatedImage(BlendRowFunc blend, int opacity, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, const RotateMap &map)
+{
+    int cn = image.channels();
+    bool has_mask = !mask.empty();
+    if (image.empty() || image.cols != map.sw || image.rows != map.sh || (has_mask && mask.size() != image.size()))
+        return false;
+
+    int bx = x + map.bbox.x, by = y + map.bbox.y;
+    int r0 = std::max(0, -by), r1 = std::min(map.bbox.height, base.rows - by);
+    if (r0 >= r1)
+        return true;
+
+    AUTOTIMED("OverlapRotatedImage run", enable_debug);
+    int step = (int)image.step[0], mstep = has_mask? (int)mask.step[0] : 0;
+    // one sampled row is kept in L1 cache until blended, as OverlapScaledImage() does
+    static thread_local std::vector<int> ofs;
+    static thread_local std::vector<uchar> row, mrow;
+    ofs.resize(map.bbox.width);
+    row.resize(map.bbox.width * cn);
+    mrow.resize(has_mask? map.bbox.width : 0);
+    for (int r=r0; r<r1; r++)
+    {
+        int x0 = bx + map.x0[r];
+        int k = std::max(0, -x0); // pixels left of base
+        int n = std::min(map.n[r], base.cols - x0) - k;
+        if (n <= 0)
+            continue;
+        int sx = map.sx[r] + k * map.dxx, sy = map.sy[r] + k * map.dxy;
+        for (int i=0; i<n; i++, sx += map.dxx, sy += map.dxy)
+        {
+            ofs[i] = (sy >> 16) * step + (sx >> 16) * cn;
+            if (has_mask)
+                mrow[i] = mask.data[(sy >> 16) * mstep + (sx >> 16)];
+        }
+        uchar *d = base.ptr<uchar>(by + r) + (x0 + k) * base.channels();
+        scale_row_nearest(row.data(), image.data, ofs.data(), n, cn);
+        blend(d, row.data(), mrow.data(), n, opacity);
+    }
+    return true;
+}
+
+cv::Mat ToPBGRA(int ftype, cv::Mat &image, cv::Mat &mask, int opacity)
+{
+    cv::Mat pbgra;
+    if (!ToPBGRA(ftype, image, mask, opacity, pbgra))
+        return cv::Mat();
+    return pbgra;
+}
+
+bool ToPBGRA(int ftype, cv::Mat &image, cv::Mat &mask, int opacity, cv::Mat &dst)
+{
+    if (ftype == materialcontext::FT_PBGRA)
+    {
+        dst = image;
+        return true;
+    }
+    int cn = image.channels();
+    if ((ftype != materialcontext::FT_BGR && ftype != materialcontext::FT_BGRA && ftype != materialcontext::FT_BGRM) ||
+        (cn != 3 && cn != 4) || (ftype == materialcontext::FT_BGRA && cn != 4) ||
+        (ftype == materialcontext::FT_BGRM && mask.size() != image.size()))
+        return false;
+
+    dst.create(image.size(), CV_8UC4);
+    for (int r=0; r<image.rows; r++)
+    {
+        uchar *d = dst.ptr<uchar>(r);
+        if (ftype == materialcontext::FT_BGR && cn == 3)
+        {
+            premultiply_bgr(d, image.ptr<uchar>(r), image.cols, opacity);
+            continue;
+        }
+        if (ftype != materialcontext::FT_BGRA)
+            ExpandToBGRA(d, image.ptr<uchar>(r), ftype == materialcontext::FT_BGRM? mask.ptr<uchar>(r) : NULL,
+                        image.cols, cn, ftype == materialcontext::FT_BGR);
+        premultiply_bgra(d, ftype == materialcontext::FT_BGRA? image.ptr<uchar>(r) : d, image.cols, opacity);
+    }
+    return true;
+}
+
+bool RotateImage(int ftype, cv::Mat &image, cv::Mat &mask, int opacity, const RotateMap &map, cv::Mat &dst)
+{
+    // the premultiplied image is converted into a buffer kept per thread
+    static thread_local cv::Mat converted;
+    cv::Mat pbgra = image, none;
+    if (ftype != materialcontext::FT_PBGRA)
+    {
+        if (!ToPBGRA(ftype, image, mask, opacity, converted))
+            return false;
+        pbgra = converted;
     }
+    // premultiplied image over a transparent one is copied as is
+    dst.create(map.bbox.size(), CV_8UC4);
+    dst.setTo(cv::Scalar::all(0));
+    OverlapRotatedImage(materialcontext::FT_PBGRA, dst, pbgra, none, -map.bbox.x, -map.bbox.y, map);
+    return true;
 }
 
 void OverlapImage(material &m, cv::Mat &base, int display_width, int display_height, cv::Mat &image, cv::Mat &mask, bool output_alpha)
 {
-    if (base.empty())
+    if (base.empty() && (m.ctx.blend_rotation || m.ctx.blend_opacity))
+        base = cv::Mat::zeros(cv::Size(display_width, display_height), output_alpha? CV_8UC4 : CV_8UC3);
+    if (!base.empty())
+    {
+        // kernel of the layer format is resolved once, not per frame
+        cv::Mat none;
+        cv::Mat &lmask = (m.ctx.ftype == materialcontext::FT_BGRM)? mask : none;
+        BlendRowFunc blend = ResolveBlend(m, image, base.channels());
+        if (!blend)
+            return;
+        if (m.ctx.blend_rotation) // frame is not rotated yet, see get_bgra_mat()
+            OverlapRotatedImage(blend, m.ctx.blend_opacity, base, image, lmask, m.rect.x, m.rect.y, *GetRotateMap(m, image));
+        else
+            OverlapImage(blend, m.ctx.blend_opacity, base, image, lmask,
+                m.rect.x, m.rect.y, m.rect.width, m.rect.height);
+    }
+    else
     {
         if (m.rect.x == 0 && m.rect.y == 0 && m.rect.width == display_width &&  m.rect.height == display_height)
         {
@@ -1044,10 +1537,5 @@ void OverlapImage(material &m, cv::Mat &base, int display_width, int display_hei
                 m.rect.x, m.rect.y, m.rect.width, m.rect.height);
         }
     }
-    else
-    {
-        OverlapImage(m.ctx.ftype, base, image, mask, 
-            m.rect.x, m.rect.y, m.rect.width, m.rect.height);
-    }
 }
 
@@ -7,7 +7,11 @@
 #include "3rd/cvxfont/cvxfont.h"
 #include "videoplayer.h"
 #include "material.h"
+#include "blend.h"
 
+// Resize image (and mask if not null) in place to w/h, zero means keeping the original size
+// return true if resized
+bool ResizeOverlapImage(cv::Mat &image, cv::Mat *mask, int w, int h);
 // Calculate overlapping matries
 void GetOverlapMatries(cv::Mat &outBase, cv::Mat &outImage, 
                 cv::Mat &base, cv::Mat &image, int x, int y, int w, int h);
@@ -16,12 +20,60 @@ void GetOverlapMatries(cv::Mat &outBase, cv::Mat &outImage,
 void OverlapImageBGRM(cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h);
 // Blend image with base at x/y, shrink to w/h if needed
 void OverlapImageBGRA(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h);
+// Blend premultiplied-alpha image with base at x/y, shrink to w/h if needed
+void OverlapImagePBGRA(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h);
 // Merge image on top of base
 void OverlapImageBGR(cv::Mat &base, cv::Mat &image, int x, int y, int w, int h);
+// Row kernel blending an image of ftype and cn channels onto a base of base_cn channels,
+// see blend_get_row_func(), return NULL if not supported
+BlendRowFunc GetBlendRowFunc(int ftype, int cn, int base_cn, bool has_opacity);
+// Row kernel of m for image onto a base of base_cn channels, it is kept in m.ctx and resolved again
+// only if ftype, channels or opacity of frames change, e.g. after MOD
+BlendRowFunc ResolveBlend(material &m, const cv::Mat &image, int base_cn);
+
+// Blend image scaled to w/h with base at x/y, sampling rows on the fly without a resized image,
+// interpolation is cv::INTER_LINEAR or cv::INTER_NEAREST. Return false if ftype/channels are not supported
+bool OverlapScaledImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h, int interpolation);
+// Blend image with base by ftype, scale while blending if w/h differs from image size
 void OverlapImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h);
+// The same as above, but by a resolved row kernel, so that nothing is checked or converted per frame.
+// opacity (0-255) is used if the kernel has opacity, mask is used if not empty and must be of image size
+bool OverlapScaledImage(BlendRowFunc blend, int opacity, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h, int interpolation);
+void OverlapImage(BlendRowFunc blend, int opacity, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h);
+// Blend image with an i420 image, which is given as y/u/v planes of the same area with even width/height,
+// x/y/w/h are in luma pixels. FT_I420 image is copied plane by plane at even positions
+void OverlapImageI420(int ftype, cv::Mat &ym, cv::Mat &um, cv::Mat &vm, cv::Mat &image, cv::Mat &mask, int x, int y, int w, int h);
+// Inverse map of an image rotated clockwise by degree around the center of its display rect w/h.
+// For each row of the rotated bounding box, it keeps the span of pixels inside the rect and the
+// source position of its first pixel, so that rotation can be fused with blending.
+struct RotateMap
+{
+    int sw, sh, w, h, degree;   // source image size, display size and degree the map is made for
+    cv::Rect bbox;              // rotated bounding box, relative to the display rect
+    int dxx, dxy;               // source x/y step of one dst pixel along a row, 16.16 fixed point
+    std::vector<int> x0, n;     // span of each row, x0 is relative to bbox
+    std::vector<int> sx, sy;    // source position of the first pixel of each span, 16.16 fixed point
+};
+// Get the inverse map of m.ctx.blend_rotation for image, it is cached in m until image size,
+// rect size or rotation changes
+std::shared_ptr<const RotateMap> GetRotateMap(material &m, const cv::Mat &image);
+// Blend image rotated by map with base, x/y is the position of the display rect (not the bounding box).
+// Return false if ftype/channels are not supported
+bool OverlapRotatedImage(int ftype, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, const RotateMap &map);
+bool OverlapRotatedImage(BlendRowFunc blend, int opacity, cv::Mat &base, cv::Mat &image, cv::Mat &mask, int x, int y, const RotateMap &map);
+// Rotate image by map into dst, a premultiplied BGRA image of the bounding box size with opacity (0-255)
+// applied, dst is reused if it has the size already. Return false if ftype/channels are not supported
+bool RotateImage(int ftype, cv::Mat &image, cv::Mat &mask, int opacity, const RotateMap &map, cv::Mat &dst);
+// Convert image of ftype to premultiplied BGRA with opacity (0-255) applied, FT_PBGRA is returned as is
+cv::Mat ToPBGRA(int ftype, cv::Mat &image, cv::Mat &mask, int opacity);
+// Same as above, converting into dst, which is reused if it has the size already, and shares image if FT_PBGRA
+bool ToPBGRA(int ftype, cv::Mat &image, cv::Mat &mask, int opacity, cv::Mat &dst);
 // Used when base may be empty, in that case, base will be created from image, so that no blending happens
 void OverlapImage(material &m, cv::Mat &base, int display_width, int display_height, cv::Mat &image, cv::Mat &mask, bool output_alpha);
 
+// Convert BGR/BGRA image to a new premultiplied BGRA image, with opacity (0-100) applied at the same time
+cv::Mat PremultiplyAlpha(const cv::Mat &mat, int opacity);
+
 // Remove green background color using opencv methods, return BGRA result
 int removeBackground(cv::Mat &frame, cv::Mat &result);
 // Remove green background, return BGR result + single channel mask
@@ -55,6 +107,11 @@ cv::Mat RotateMat(cv::Mat mat, cv::Point &pos, int degree);
 //   'b' - alpha at bottom
 //  - pmask, if non-null, returns single channel mask and BGR frame
 cv::Mat MakeAlphaMat(cv::Mat frame, int alpha_mode, cv::Mat *pmask);
+// the same as above, but the result is made at w/h in one pass, sampling the color half and alpha half
+// of frame directly (nearest, like cv::resize), zero w/h means half size of frame
+//  - opacity, 0-100, multiplied into alpha or mask, 0 is equal to 100
+//  - premultiply, return premultiplied BGRA instead of BGRA, ignored if pmask is non-null
+cv::Mat MakeAlphaMat(const cv::Mat &frame, int alpha_mode, int w, int h, int opacity, bool premultiply, cv::Mat *pmask);
 
 cv::Mat get_bgra_mat(unsigned char *data, int length, int format, int width, int height, int out_fmt, material &m, bool disable_opengl);
 cv::Mat get_bgra_mat(FFReader *video, material &m, unsigned char *data, AVPixelFormat fmt, bool disable_opengl, const char *alpha_video, cv::Mat *pmask);
@@ -114,7 +114,15 @@ static vector<GLuint> allTextures;
 #define GLCall(x) x
 #endif
 
-GLuint create_texture(int width, int height, GLint format, bool repeat = false, void *buffer = NULL) {
+// Rows of images uploaded are stride bytes apart, e.g. frames of padded rows (FFReader::disp_linesize),
+// a stride of 0 resets it to packed rows. The stride must be whole pixels
+static void set_unpack_stride(int stride, int channels)
+{
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, stride > 0? stride / channels : 0);
+}
+
+// rows of buffer are stride bytes apart, or packed if stride is 0
+GLuint create_texture(int width, int height, GLint format, bool repeat = false, void *buffer = NULL, int stride = 0) {
 	GLuint texture = 0;
 	glActiveTexture(GL_TEXTURE0);
 	glGenTextures(1, &texture);
@@ -137,7 +145,9 @@ GLuint create_texture(int width, int height, GLint format, bool repeat = false,
 	}
 	GLint fmt = (format==GL_BGRA? GL_RGBA : (format==GL_BGR? GL_RGB : format));
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	set_unpack_stride(buffer? stride : 0, format==GL_BGR? 3 : 4);
 	glTexImage2D(GL_TEXTURE_2D, 0, fmt, width, height, 0, format, GL_UNSIGNED_BYTE, buffer);
+	set_unpack_stride(0, 0);
 	glBindTexture(GL_TEXTURE_2D, 0);
 	return texture;
 }
@@ -412,7 +422,7 @@ int gl_reset_screen()
 }
 
 // upload bgr image and render to framebuffer
-int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity)
+int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int stride)
 {
 	AUTOTIMED("OpenGL draw BGR image Run", enable_debug);
 
@@ -421,7 +431,7 @@ int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, in
 
 	if (textureId == 0)
 	{
-		textureId = create_texture(imgw, imgh, GL_BGR, false, buffer);
+		textureId = create_texture(imgw, imgh, GL_BGR, false, buffer, stride);
 		allTextures.push_back(textureId);
 		buffer = NULL; // already loaded, dont load again later
 	}
@@ -432,7 +442,9 @@ int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, in
 	{
 		// set alignment to 1, so that data can be processed by opencv
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		set_unpack_stride(stride, 3);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, imgw, imgh, GL_BGR, GL_UNSIGNED_BYTE, buffer);
+		set_unpack_stride(0, 0);
 		if (scaleprefer==SP_QUALITY)
 			glGenerateMipmap(GL_TEXTURE_2D);
 	}
@@ -476,13 +488,13 @@ int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, in
 	return textureId;
 }
 
-int gl_render_texture_bgra(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity)
+int gl_render_texture_bgra(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int stride)
 {
 	AUTOTIMED("OpenGL draw BGRA image Run", enable_debug);
 
 	if (textureId == 0)
 	{
-		textureId = create_texture(imgw, imgh, GL_BGRA, false, buffer);
+		textureId = create_texture(imgw, imgh, GL_BGRA, false, buffer, stride);
 		allTextures.push_back(textureId);
 		buffer = NULL; // already loaded, dont load again later
 	}
@@ -493,7 +505,9 @@ int gl_render_texture_bgra(int textureId, uint8_t *buffer, int imgw, int imgh, i
 	{
 		// set alignment to 1, so that data can be processed by opencv
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		set_unpack_stride(stride, 4);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, imgw, imgh, GL_BGRA, GL_UNSIGNED_BYTE, buffer);
+		set_unpack_stride(0, 0);
 		if (scaleprefer==SP_QUALITY)
 			glGenerateMipmap(GL_TEXTURE_2D);
 	}
@@ -538,12 +552,12 @@ int gl_render_texture_bgra(int textureId, uint8_t *buffer, int imgw, int imgh, i
 }
 
 // buffer must be bgra format
-int gl_render_texture(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity)
+int gl_render_texture(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int stride)
 {
 	if (channels == 3)
-		return gl_render_texture_bgr(textureId, buffer, imgw, imgh, x, y, w, h, rotation, opacity);
+		return gl_render_texture_bgr(textureId, buffer, imgw, imgh, x, y, w, h, rotation, opacity, stride);
 	else
-		return gl_render_texture_bgra(textureId, buffer, imgw, imgh, x, y, w, h, rotation, opacity);
+		return gl_render_texture_bgra(textureId, buffer, imgw, imgh, x, y, w, h, rotation, opacity, stride);
 }
 
 // alpha_mode:
@@ -551,13 +565,13 @@ int gl_render_texture(int textureId, uint8_t *buffer, int channels, int imgw, in
 //   'r' - right
 //   't' - top
 //   'b' - bottom
-int gl_render_texture_alpha(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int alpha_mode)
+int gl_render_texture_alpha(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int alpha_mode, int stride)
 {
 	AUTOTIMED("OpenGL draw half-alpha image Run", enable_debug);
 
 	if (textureId == 0)
 	{
-		textureId = create_texture(imgw, imgh, channels==3? GL_BGR : GL_BGRA, false, buffer);
+		textureId = create_texture(imgw, imgh, channels==3? GL_BGR : GL_BGRA, false, buffer, stride);
 		allTextures.push_back(textureId);
 		buffer = NULL; // already loaded, dont load again later
 	}
@@ -568,7 +582,9 @@ int gl_render_texture_alpha(int textureId, uint8_t *buffer, int channels, int im
 	{
 		// set alignment to 1, so that data can be processed by opencv
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		set_unpack_stride(stride, channels);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, imgw, imgh, channels==3? GL_BGR : GL_BGRA, GL_UNSIGNED_BYTE, buffer);
+		set_unpack_stride(0, 0);
 		if (scaleprefer==SP_QUALITY)
 			glGenerateMipmap(GL_TEXTURE_2D);
 	}
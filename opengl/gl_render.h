@@ -20,21 +20,23 @@ int gl_reset_screen();
 
 int gl_delete_texture(int texture);
 
+// stride of the uploading functions is the bytes per row of buffer, 0 if rows are packed
+
 // upload bgr image and render to framebuffer
-int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity);
+int gl_render_texture_bgr(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int stride = 0);
 
 // upload bgra image and render to framebuffer
-int gl_render_texture_bgra(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity);
+int gl_render_texture_bgra(int textureId, uint8_t *buffer, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int stride = 0);
 
 // upload bgr or bgra image and do render to framebuffer
-int gl_render_texture(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity);
+int gl_render_texture(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int stride = 0);
 
 // alpha_mode:
 //   'l' - alpha video at left side
 //   'r' - right
 //   't' - top
 //   'b' - bottom
-int gl_render_texture_alpha(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int alpha_mode);
+int gl_render_texture_alpha(int textureId, uint8_t *buffer, int channels, int imgw, int imgh, int x, int y, int w, int h, int rotation, int opacity, int alpha_mode, int stride = 0);
 
 enum MARK_RENDER_MODE
 {
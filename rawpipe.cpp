@@ -0,0 +1,140 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "rawpipe.h"
+#include "3rd/log/LOGHelp.h"
+
+#undef	__MODULE__
+#define __MODULE__ "RawPipe"
+
+RawPipe::RawPipe(int fd, bool owned, int pipe_size, size_t ring_size) : fd(fd), owned(owned),
+    head(0), count(0), eof(false), pipe_bytes(0), bytes(0), reads(0)
+{
+    size_t size = 64*1024;
+    while (size < ring_size)
+        size <<= 1;
+    ring.resize(size);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+        return;
+#ifdef F_SETPIPE_SZ
+    pipe_bytes = fcntl(fd, F_GETPIPE_SZ);
+    if (pipe_bytes >= 0 && pipe_size > pipe_bytes)
+    {
+        int n = fcntl(fd, F_SETPIPE_SZ, pipe_size);
+        if (n < 0) // above /proc/sys/fs/pipe-max-size for unprivileged users
+            LOG_ERROR("Failed to enlarge pipe from %d to %d bytes, error=%d:%s", pipe_bytes, pipe_size, errno, strerror(errno));
+        else
+            pipe_bytes = n;
+    }
+    if (pipe_bytes < 0)
+        pipe_bytes = 0;
+#endif
+}
+
+RawPipe::~RawPipe()
+{
+    if (owned && fd >= 0)
+        close(fd);
+}
+
+bool RawPipe::Fill(size_t n)
+{
+    n = std::min(n, ring.size());
+    while (count < n)
+    {
+        // the free space as up to two spans, the whole of it is asked for
+        size_t tail = (head + count) & (ring.size() - 1);
+        size_t free = ring.size() - count;
+        struct iovec iov[2];
+        iov[0].iov_base = ring.data() + tail;
+        iov[0].iov_len = std::min(free, ring.size() - tail);
+        iov[1].iov_base = ring.data();
+        iov[1].iov_len = free - iov[0].iov_len;
+        ssize_t r = readv(fd, iov, iov[1].iov_len? 2 : 1);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            eof = r == 0;
+            return false;
+        }
+        reads ++;
+        bytes += r;
+        count += r;
+    }
+    return true;
+}
+
+void RawPipe::Take(unsigned char *dst, size_t n)
+{
+    size_t len = std::min(n, ring.size() - head);
+    memcpy(dst, ring.data() + head, len);
+    memcpy(dst + len, ring.data(), n - len);
+    Consume(n);
+}
+
+void RawPipe::Consume(size_t n)
+{
+    count -= n;
+    head = count? (head + n) & (ring.size() - 1) : 0;
+}
+
+bool RawPipe::Read(void *dst, size_t n)
+{
+    unsigned char *d = (unsigned char *)dst;
+    size_t m = std::min(n, count);
+    Take(d, m);
+    d += m;
+    n -= m;
+    if (n < ring.size() / 4)
+    {
+        if (n && !Fill(n))
+            return false;
+        Take(d, n);
+        return true;
+    }
+
+    // a frame, the ring is empty (head is 0), the body goes to dst and what follows it to the ring
+    while (n)
+    {
+        struct iovec iov[2];
+        iov[0].iov_base = d;
+        iov[0].iov_len = n;
+        iov[1].iov_base = ring.data();
+        iov[1].iov_len = ring.size();
+        ssize_t r = readv(fd, iov, 2);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            eof = r == 0;
+            return false;
+        }
+        reads ++;
+        bytes += r;
+        size_t got = std::min((size_t)r, n);
+        d += got;
+        n -= got;
+        count = r - got;
+    }
+    return true;
+}
+
+bool RawPipe::Skip(size_t n)
+{
+    while (n)
+    {
+        if (count == 0 && !Fill(1))
+            return false;
+        size_t m = std::min(n, count);
+        Consume(m);
+        n -= m;
+    }
+    return true;
+}
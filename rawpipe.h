@@ -0,0 +1,53 @@
+//
+// buffered reading of raw inputs from fifos, stdin and files
+//
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Reads the <MsgHead><payload> stream of a raw input into a power of two ring, with read()/readv()
+// calls as large as the data available, instead of stdio refilling 4KB at a time. Headers are
+// parsed from the ring, while a body of at least a quarter of the ring is read straight into the
+// caller's buffer, together with the bytes after it into the ring by the same readv(). A fifo is
+// enlarged to pipe_size bytes by F_SETPIPE_SZ if it is smaller, so that a writer of frames that
+// fit in it is not blocked by every frame. It costs throughput as the buffer falls out of cache,
+// so pipe_size is 0 by default, keeping the system size.
+// Not thread safe, it is used by the thread reading its FFReader.
+class RawPipe
+{
+public:
+    // fd is closed by the destructor if owned
+    RawPipe(int fd, bool owned, int pipe_size, size_t ring_size = 4*1024*1024);
+    ~RawPipe();
+    RawPipe(const RawPipe &) = delete;
+    RawPipe &operator=(const RawPipe &) = delete;
+
+    // move the next n bytes to dst, return false if the input ends or fails before, see Eof()
+    bool Read(void *dst, size_t n);
+    // drop the next n bytes, as Read() does
+    bool Skip(size_t n);
+    // the end of input is reached, rather than reading failed
+    bool Eof() const { return eof; }
+
+    // buffer size of the fifo, 0 if the input is not a fifo
+    int PipeSize() const { return pipe_bytes; }
+    // bytes read and read()/readv() calls made, for diagnostics
+    uint64_t Bytes() const { return bytes; }
+    uint64_t Reads() const { return reads; }
+
+private:
+    // buffer at least n (up to the ring size) bytes
+    bool Fill(size_t n);
+    // move n buffered bytes to dst
+    void Take(unsigned char *dst, size_t n);
+    void Consume(size_t n);
+
+    int fd;
+    bool owned;
+    std::vector<unsigned char> ring;
+    size_t head, count;
+    bool eof;
+    int pipe_bytes;
+    uint64_t bytes, reads;
+};
@@ -5,6 +5,29 @@
 #include <chrono>
 #include <atomic>
 #include <condition_variable>
+
+// Wakes a producer waiting for room in any of several queues, e.g. a decoder filling
+// both video and audio queues, see SafeQueue::SetNotifier()
+class QueueNotifier
+{
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+public:
+    void Notify()
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_cv.notify_all();
+    }
+    // wait until pred() is true or timeout (ms), return pred()
+    template<typename Pred>
+    bool Wait(Pred pred, int timeout)
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        return m_cv.wait_for(lk, std::chrono::milliseconds(timeout), pred);
+    }
+};
+
 template<typename T>
 class SafeQueue
 {
@@ -14,9 +37,52 @@ private:
     std::mutex m_qmutex;
     std::condition_variable m_cv;
     std::queue<T> m_q;
+    int m_below;                // size the producer waits for in WaitBelow(), -1 if not waiting
+    QueueNotifier *m_notifier;  // notified when size drops to m_low or below
+    int m_low;
+
+    // called with m_qmutex held after the queue shrinks, return true if m_notifier
+    // should be notified after m_qmutex is released
+    bool Shrunk()
+    {
+        if (m_below >= 0 && (int)m_q.size() <= m_below)
+            m_cv.notify_all();
+        return m_notifier && (int)m_q.size() <= m_low;
+    }
 public:
-    SafeQueue() : m_abort(false) {}
+    SafeQueue() : m_abort(false), m_below(-1), m_notifier(NULL), m_low(0) {}
     ~SafeQueue() {}
+
+    // notify n whenever size drops to the low watermark or below
+    void SetNotifier(QueueNotifier *n, int low)
+    {
+        std::lock_guard<std::mutex> lk(m_qmutex);
+        m_notifier = n;
+        m_low = low;
+    }
+    // Block the producer until size drops to size or below (the low watermark), instead of
+    // sleeping. Return false on timeout (ms) or abort. Only one producer may wait at a time
+    bool WaitBelow(int size, int timeout)
+    {
+        std::unique_lock<std::mutex> lk(m_qmutex);
+        m_below = size;
+        bool ok = m_cv.wait_for(lk, std::chrono::milliseconds(timeout),
+                [this, size] { return (int)m_q.size() <= size || m_abort; });
+        m_below = -1;
+        return ok && !m_abort;
+    }
+    // Idle until something happens to the queue (push, abort, resume or Wake()) or timeout (ms),
+    // for threads waiting in another state, e.g. stopped
+    void Wait(int timeout)
+    {
+        std::unique_lock<std::mutex> lk(m_qmutex);
+        m_cv.wait_for(lk, std::chrono::milliseconds(timeout));
+    }
+    void Wake()
+    {
+        std::lock_guard<std::mutex> lk(m_qmutex);
+        m_cv.notify_all();
+    }
     void Abort()
     {
         m_abort.store(true);
@@ -61,6 +127,10 @@ public:
         }
         t = m_q.front();
         m_q.pop();
+        bool notify = Shrunk();
+        lk.unlock();
+        if (notify)
+            m_notifier->Notify();
         return true;
     }
 
@@ -81,6 +151,10 @@ public:
         }
         t = std::move(m_q.front());
         m_q.pop();
+        bool notify = Shrunk();
+        lk.unlock();
+        if (notify)
+            m_notifier->Notify();
         return true;
     }
 
@@ -101,6 +175,10 @@ public:
         }
         val = m_q.front();
         m_q.pop();
+        bool notify = Shrunk();
+        lk.unlock();
+        if (notify)
+            m_notifier->Notify();
         return true;
     }
 
@@ -126,29 +204,41 @@ public:
     }
     void Clear()
     {
-        std::lock_guard<std::mutex> lk(m_qmutex);
+        std::unique_lock<std::mutex> lk(m_qmutex);
         while(m_q.size()) m_q.pop();
+        bool notify = Shrunk();
+        lk.unlock();
+        if (notify)
+            m_notifier->Notify();
     }
     int Floors(int floors)
     {
-        std::lock_guard<std::mutex> lk(m_qmutex);
+        std::unique_lock<std::mutex> lk(m_qmutex);
         int discard = 0;
         while (m_q.size() > floors)
         {
             m_q.pop();
             ++discard;
         }
+        bool notify = discard && Shrunk();
+        lk.unlock();
+        if (notify)
+            m_notifier->Notify();
         return discard;
     }
     int Discard(int discard)
     {
-        std::lock_guard<std::mutex> lk(m_qmutex);
+        std::unique_lock<std::mutex> lk(m_qmutex);
         int i = 0;
         while (i < discard)
         {
             m_q.pop();
             i ++;
         }
+        bool notify = i && Shrunk();
+        lk.unlock();
+        if (notify)
+            m_notifier->Notify();
         return i;
     }
 };
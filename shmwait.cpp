@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#ifndef MacOS
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include "shmwait.h"
+#include "3rd/shmqueue/shm_queue.h"
+#include "3rd/log/LOGHelp.h"
+
+#undef	__MODULE__
+#define __MODULE__ "ShmWaiter"
+
+static int64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ShmWaiter::ShmWaiter(struct shm_queue *sq) : sq(sq), epfd(-1), wakefd(-1), woken(false), sleeps(0), missed(0), polling(false)
+{
+#ifndef MacOS
+    if (sq_get_sig_ele_num(sq) <= 0)
+    {
+        LOG_INFO("Writer of shm queue %d does not signal readers, polling it every %dms", sq_get_shmid(sq), poll_interval);
+        return;
+    }
+    int fifo = sq_get_eventfd(sq);
+    if (fifo < 0)
+    {
+        LOG_ERROR("Failed to get event fd of shm queue %d, polling it every %dms, err=%s", sq_get_shmid(sq), poll_interval, sq_errorstr(sq));
+        return;
+    }
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fifo;
+    bool ok = wakefd >= 0 && epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fifo, &ev) == 0;
+    ev.data.fd = wakefd;
+    if (!ok || epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) != 0)
+    {
+        LOG_ERROR("Failed to wait for shm queue %d by epoll, polling it every %dms, error=%d:%s", sq_get_shmid(sq), poll_interval, errno, strerror(errno));
+        if (epfd >= 0)
+            close(epfd);
+        epfd = -1;
+    }
+#endif
+}
+
+ShmWaiter::~ShmWaiter()
+{
+    if (epfd >= 0)
+        close(epfd);
+    if (wakefd >= 0)
+        close(wakefd);
+}
+
+void ShmWaiter::Wake()
+{
+    woken.store(true);
+#ifndef MacOS
+    uint64_t one = 1;
+    if (wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0)
+        LOG_ERROR("Failed to wake shm waiter, error=%d:%s", errno, strerror(errno));
+#endif
+}
+
+int ShmWaiter::Get(void *buf, int buf_sz, struct timeval *enqueue_time, int timeout)
+{
+    return Wait(buf, buf_sz, NULL, enqueue_time, timeout);
+}
+
+int ShmWaiter::Peek(void **data, struct timeval *enqueue_time, int timeout)
+{
+    return Wait(NULL, 0, data, enqueue_time, timeout);
+}
+
+int ShmWaiter::Take(void *buf, int buf_sz, void **data, struct timeval *enqueue_time)
+{
+    return data? sq_peek(sq, data, enqueue_time) : sq_get(sq, buf, buf_sz, enqueue_time);
+}
+
+int ShmWaiter::Wait(void *buf, int buf_sz, void **data, struct timeval *enqueue_time, int timeout)
+{
+    int64_t deadline = now_ms() + timeout;
+    bool slept_out = false; // the last wait ran to max_wait without a signal
+    while (true)
+    {
+        int length = Take(buf, buf_sz, data, enqueue_time);
+        if (length > 0 && slept_out && ++missed >= max_missed && epfd >= 0 && !polling)
+        {
+            // e.g. a writer of another key signals another fifo, the fifo is still waited on for
+            // poll_interval at a time, and a signal of it switches back
+            LOG_ERROR("Missed %d signals of shm queue %d, polling it every %dms until it is signaled again", missed, sq_get_shmid(sq), poll_interval);
+            polling = true;
+            missed = 0;
+        }
+        if (length != 0 || woken)
+            return length;
+        int64_t left = deadline - now_ms();
+        if (left <= 0)
+            return 0;
+        sleeps ++;
+#ifndef MacOS
+        if (epfd >= 0)
+        {
+            // armed before looking again, an element put from then on signals the fifo
+            sq_sigon(sq);
+            length = Take(buf, buf_sz, data, enqueue_time);
+            if (length != 0)
+            {
+                sq_sigoff(sq);
+                return length;
+            }
+            struct epoll_event ev[2];
+            int wait = polling? poll_interval : max_wait;
+            int n = epoll_wait(epfd, ev, 2, (int)std::min<int64_t>(left, wait));
+            sq_sigoff(sq);
+            bool signaled = false;
+            for (int i = 0; i < n; i++)
+            {
+                if (ev[i].data.fd != wakefd)
+                {
+                    sq_consume_event(sq);
+                    signaled = true;
+                }
+            }
+            if (signaled)
+            {
+                missed = 0;
+                if (polling)
+                {
+                    LOG_INFO("Shm queue %d is signaled again, waiting for its signals instead of polling", sq_get_shmid(sq));
+                    polling = false;
+                }
+            }
+            slept_out = n == 0 && left > wait;
+            if (n < 0 && errno != EINTR)
+            {
+                LOG_ERROR("Failed to wait for shm queue %d, polling it every %dms from now on, error=%d:%s", sq_get_shmid(sq), poll_interval, errno, strerror(errno));
+                close(epfd);
+                epfd = -1;
+            }
+            continue;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min<int64_t>(left, poll_interval)));
+    }
+}
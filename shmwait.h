@@ -0,0 +1,51 @@
+//
+// waiting for the elements of a shm queue without polling
+//
+#pragma once
+#include <sys/time.h>
+#include <atomic>
+
+struct shm_queue;
+
+// Gets the elements of a shm:// input, sleeping in epoll_wait() on the fifo its writer signals (see
+// sq_get_eventfd()) while the queue is empty, instead of polling it every 10ms. Queues whose
+// writer does not signal (sig_ele_num of 0) are still polled, and so is a queue whose signals are
+// missed, until a signal arrives again. Wake() ends the waits from any thread.
+// Get() is called by one thread, the one reading the FFReader.
+class ShmWaiter
+{
+public:
+    explicit ShmWaiter(struct shm_queue *sq);
+    ~ShmWaiter();
+    ShmWaiter(const ShmWaiter &) = delete;
+    ShmWaiter &operator=(const ShmWaiter &) = delete;
+
+    // Get the first element into buf as sq_get() does, waiting up to timeout (ms) while the queue is
+    // empty. Return the length, 0 on timeout or after Wake(), or < 0 on failure
+    int Get(void *buf, int buf_sz, struct timeval *enqueue_time, int timeout);
+    // Get the first element in place as sq_peek() does, it is removed by sq_release()
+    int Peek(void **data, struct timeval *enqueue_time, int timeout);
+    // from now on Get() returns 0 at once if the queue is empty, e.g. for the reader being closed
+    void Wake();
+    bool Woken() const { return woken; }
+    // false if the queue is polled
+    bool Evented() const { return epfd >= 0 && !polling; }
+    // times Get() went to sleep, for diagnostics
+    long Sleeps() const { return sleeps; }
+
+    static const int poll_interval = 10; // ms between sq_get() of a queue not signaled
+    static const int max_wait = 100;     // ms, a signal lost to a racing writer is made up for by then
+    static const int max_missed = 3;     // elements in a row found after max_wait, before polling until signaled again
+
+private:
+    // wait for an element taken by sq_peek() if data is not NULL, or sq_get() otherwise
+    int Wait(void *buf, int buf_sz, void **data, struct timeval *enqueue_time, int timeout);
+    int Take(void *buf, int buf_sz, void **data, struct timeval *enqueue_time);
+
+    struct shm_queue *sq;
+    int epfd, wakefd; // the fifo fd is owned by sq
+    std::atomic_bool woken;
+    long sleeps;
+    int missed; // elements in a row found after a wait ran out instead of being signaled
+    bool polling; // signals were missed, the fifo is waited on for poll_interval at a time
+};
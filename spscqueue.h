@@ -0,0 +1,293 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include "safequeue.h"
+
+// Bounded lock-free queue of exactly one producer thread and one consumer thread, for the
+// decoder -> render and render -> encoder hand-offs, with the interface of SafeQueue they use.
+//
+// The ring has a power of two slots, the consumer's and the producer's indexes are on cache
+// lines of their own, each side keeps a copy of the other's index and reloads it only when the
+// ring looks empty or full. Push, pop and Size() take no lock, the mutex is only taken by a side
+// blocked on an empty or full ring (or below a watermark), and by the other side to wake it.
+//
+//  - PushMove() is called by the producer only
+//  - PopMove(), Clear(), Floors() and Discard() by the consumer only, they destroy popped frames
+//  - Flush() drops everything queued so far from any thread, the frames are destroyed by the
+//    consumer's next call
+template<typename T>
+class SpscQueue
+{
+private:
+    // read-only after construction
+    std::vector<T> m_ring;
+    size_t m_mask;
+    QueueNotifier *m_notifier;  // notified when size drops to m_low or below
+    int m_low;
+    char m_pad0[64];
+
+    // consumer side
+    std::atomic<size_t> m_head;
+    size_t m_tail_cache;
+    char m_pad1[64];
+
+    // producer side
+    std::atomic<size_t> m_tail;
+    size_t m_head_cache;
+    char m_pad2[64];
+
+    // shared, rarely written
+    std::atomic<size_t> m_flush;    // slots before it are dropped, see Flush()
+    std::atomic<int> m_below;       // size the producer waits for, -1 if not waiting
+    std::atomic<int> m_waiters;     // threads blocked in Block(), the other side locks only if any
+    std::atomic<unsigned> m_wakes;  // bumped by Wake(), ends all blocking waits
+    std::atomic_bool m_abort;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    // wait until pred() is true, timeout (ms), or Wake() after wakes was read, return pred()
+    template<typename Pred>
+    bool Block(Pred pred, int timeout, unsigned wakes)
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_waiters.fetch_add(1);
+        m_cv.wait_for(lk, std::chrono::milliseconds(timeout), [&] { return pred() || m_wakes.load() != wakes; });
+        m_waiters.fetch_sub(1);
+        return pred();
+    }
+    // wake the other side if it is blocked, called after publishing an index
+    void Signal()
+    {
+        if (m_waiters.load() == 0)
+            return;
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_cv.notify_all();
+    }
+    // called by the consumer after the queue shrinks from before to after
+    void Shrunk(size_t before, size_t after)
+    {
+        int below = m_below.load();
+        if (below >= 0 && (int)after <= below)
+            Signal();
+        if (m_notifier && (int)before > m_low && (int)after <= m_low)
+            m_notifier->Notify();
+    }
+    // consumer: destroy the slots dropped by Flush()
+    void Skip()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t flush = m_flush.load(std::memory_order_acquire);
+        if (flush <= head)
+            return;
+        for (; head < flush; head++)
+            m_ring[head & m_mask] = T();
+        m_head.store(head);
+    }
+    // consumer: size from its own view, reloading the producer's index only if it looks empty
+    size_t Readable()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_tail_cache <= head)
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+        return m_tail_cache - head;
+    }
+    // consumer: exact size, for watermarks
+    size_t Queued()
+    {
+        m_tail_cache = m_tail.load(std::memory_order_acquire);
+        return m_tail_cache - m_head.load(std::memory_order_relaxed);
+    }
+    // consumer: pop one, the queue has at least one
+    void PopOne(T *t)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (t)
+            *t = std::move(m_ring[head & m_mask]);
+        else
+            m_ring[head & m_mask] = T();
+        m_head.store(head + 1);
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) : m_notifier(NULL), m_low(0), m_head(0), m_tail_cache(0),
+        m_tail(0), m_head_cache(0), m_flush(0), m_below(-1), m_waiters(0), m_wakes(0), m_abort(false)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        m_ring.resize(n);
+        m_mask = n - 1;
+    }
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    size_t Capacity() const { return m_mask + 1; }
+
+    // notify n whenever size drops to the low watermark or below, set before use
+    void SetNotifier(QueueNotifier *n, int low)
+    {
+        m_notifier = n;
+        m_low = low;
+    }
+
+    // Push at the tail, blocking while the ring is full. Return false if aborted, or woken by
+    // Wake() while full, in which case val is dropped
+    bool PushMove(T &&val)
+    {
+        if (m_abort)
+            return false;
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask)
+        {
+            unsigned wakes = m_wakes.load();
+            m_below.store((int)m_mask);
+            while ((m_head_cache = m_head.load(std::memory_order_acquire)), tail - m_head_cache > m_mask)
+            {
+                Block([this, tail] { return tail - m_head.load() <= m_mask || m_abort; }, 100, wakes);
+                if (m_abort || m_wakes.load() != wakes)
+                {
+                    m_below.store(-1);
+                    return false;
+                }
+            }
+            m_below.store(-1);
+        }
+        m_ring[tail & m_mask] = std::move(val);
+        m_tail.store(tail + 1);
+        Signal();
+        return true;
+    }
+
+    // push unless the ring is full or aborted, for a producer that must not block,
+    // e.g. one filling the queues of several consumers
+    bool TryPushMove(T &&val)
+    {
+        if (m_abort)
+            return false;
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask)
+        {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask)
+                return false;
+        }
+        m_ring[tail & m_mask] = std::move(val);
+        m_tail.store(tail + 1);
+        Signal();
+        return true;
+    }
+
+    // Pop from the head, waiting up to timeout (ms) if empty. Return false if empty or aborted
+    bool PopMove(T &t, int timeout = 0)
+    {
+        Skip();
+        if (Readable() == 0)
+        {
+            if (timeout <= 0)
+                return false;
+            Block([this] { return Size() > 0 || m_abort; }, timeout, m_wakes.load());
+            Skip();
+        }
+        if (m_abort || Readable() == 0)
+            return false;
+        size_t before = Queued();
+        PopOne(&t);
+        Shrunk(before, before - 1);
+        return true;
+    }
+
+    // frames queued, from any thread, it may be stale by the time it returns
+    int Size()
+    {
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t flush = m_flush.load(std::memory_order_acquire);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        if (flush > head)
+            head = flush;
+        return tail > head? (int)(tail - head) : 0;
+    }
+
+    // consumer: drop all
+    void Clear()
+    {
+        Skip();
+        size_t before = Queued();
+        for (size_t i = 0; i < before; i++)
+            PopOne(NULL);
+        Shrunk(before, 0);
+    }
+    // consumer: drop the oldest ones until floors are left, return the number dropped
+    int Floors(int floors)
+    {
+        Skip();
+        size_t before = Queued();
+        int discard = 0;
+        for (size_t n = before; (int)n > floors; n--, discard++)
+            PopOne(NULL);
+        if (discard)
+            Shrunk(before, before - discard);
+        return discard;
+    }
+    // consumer: drop up to discard of the oldest ones, return the number dropped
+    int Discard(int discard)
+    {
+        Skip();
+        size_t before = Queued();
+        int i = 0;
+        for (; i < discard && (size_t)i < before; i++)
+            PopOne(NULL);
+        if (i)
+            Shrunk(before, before - i);
+        return i;
+    }
+    // any thread: drop all queued so far, they are destroyed by the consumer's next call,
+    // e.g. the decoder resetting its queues on reopen
+    void Flush()
+    {
+        size_t before = Size();
+        size_t tail = m_tail.load();
+        size_t flush = m_flush.load();
+        while (flush < tail && !m_flush.compare_exchange_weak(flush, tail))
+            ;
+        if (m_notifier && (int)before > m_low)
+            m_notifier->Notify();
+        Signal();
+    }
+
+    // producer: block until size drops to size or below (the low watermark), return false
+    // on timeout (ms), abort or Wake()
+    bool WaitBelow(int size, int timeout)
+    {
+        unsigned wakes = m_wakes.load();
+        m_below.store(size);
+        bool ok = Block([this, size] { return Size() <= size || m_abort; }, timeout, wakes);
+        m_below.store(-1);
+        return ok && !m_abort;
+    }
+    // idle until Wake(), Abort(), Resume() or timeout (ms), for threads waiting in another state
+    void Wait(int timeout)
+    {
+        Block([] { return false; }, timeout, m_wakes.load());
+    }
+    void Wake()
+    {
+        m_wakes.fetch_add(1);
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_cv.notify_all();
+    }
+    void Abort()
+    {
+        m_abort.store(true);
+        Wake();
+    }
+    void Resume()
+    {
+        m_abort.store(false);
+        Wake();
+    }
+};
@@ -1,11 +1,20 @@
 #include <vector>
 #include <string>
 #include <thread>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <opencv2/opencv.hpp>
 #include "videoplayer.h"
 #include "AutoTime.h"
 #include "decorateVideo.h"
 #include "safequeue.h"
+#include "spscqueue.h"
+#include "decodepool.h"
 #include "event.h"
 #include "material.h"
 #include "3rd/shmqueue/shm_queue.h"
@@ -22,6 +31,11 @@ extern "C"
 }
 
 extern int enable_debug;
+extern int enable_lazy_convert;
+extern int enable_source_sharing;
+extern int64_t loop_cache_size;
+extern int shm_timeout;
+extern int raw_pipe_size;
 
 #define STAT_RUNTIME enable_debug
 
@@ -128,12 +142,15 @@ void mverge_audio(std::vector<pcm_info> &pcms, int pcm_length, std::vector<unsig
     }
 }
 
+static void drop_video_frames(FFReader *video, int keep);
+static void drop_key_frame(FFReader *video);
+
 static void read_video_close_only(FFReader *video)
 {
-    video->buffers.clear();
+    drop_video_frames(video, 0);
+    drop_key_frame(video);
     video->rawBuffer.clear();
-    video->rawAudio.clear();
-    video->audio_size = 0;
+    video->rawAudio.Release();
     if(video->swsCtx)
     {
         sws_freeContext(video->swsCtx);
@@ -153,9 +170,9 @@ static void read_video_close_only(FFReader *video)
         av_frame_free(&video->audioFrame);
     if(video->m_swrCtx)
         swr_free(&video->m_swrCtx);
-    if(video->fraw && video->fraw != stdin)
+    if(video->fraw)
     {
-        fclose(video->fraw);
+        delete video->fraw;
         video->fraw = NULL;
     }
     if(video->fshm)
@@ -167,6 +184,112 @@ static void read_video_close_only(FFReader *video)
     video->audio_pts_time = -1.0;
 }
 
+static int get_sws_flags(FFReader *video)
+{
+    int flag = SWS_BILINEAR; // scale_prefer default is both
+    if (video->scale_prefer && strncasecmp(video->scale_prefer, "quality", 7)==0)
+        flag = video->width > video->disp_width ? SWS_BICUBIC : SWS_BICUBLIN;
+    else if (video->scale_prefer && strncasecmp(video->scale_prefer, "speed", 5)==0)
+        flag = SWS_FAST_BILINEAR;
+    else if (video->scale_prefer && strncasecmp(video->scale_prefer, "both", 4)==0)
+        flag = SWS_BILINEAR;
+    return flag;
+}
+
+// Rows of frames converted to packed rgb are padded to whole blocks of 64 pixels, a multiple of
+// 64 bytes that is whole pixels for the GL_UNPACK_ROW_LENGTH of gl uploads too.
+// The simd converters of sws_scale() work on blocks of 8 or 16 pixels, and leave the last
+// pixels of a row black if the block does not fit in the line size, e.g. for phone videos of
+// widths not a multiple of 8. Planar formats and raw inputs keep unpadded rows.
+static void set_display_layout(FFReader *video)
+{
+    AVPixelFormat fmt = video->out_pix_fmt;
+    bool rgb = fmt == AV_PIX_FMT_BGR24 || fmt == AV_PIX_FMT_RGB24 || fmt == AV_PIX_FMT_BGRA || fmt == AV_PIX_FMT_RGBA;
+    if (rgb && !video->fraw && !video->fshm)
+    {
+        video->disp_linesize = av_image_get_linesize(fmt, FFALIGN(video->disp_width, 64), 0);
+        video->buffersize = video->disp_linesize * video->disp_height;
+    }
+    else
+    {
+        video->disp_linesize = 0;
+        video->buffersize = av_image_get_buffer_size(fmt, video->disp_width, video->disp_height, 1);
+    }
+}
+
+// planes of a converted frame at dst, laid out by set_display_layout()
+static int fill_display_arrays(FFReader *video, unsigned char *dst, uint8_t *data[4], int linesize[4])
+{
+    int ret = av_image_fill_arrays(data, linesize, dst, video->out_pix_fmt, video->disp_width, video->disp_height, 1);
+    if (ret >= 0 && video->disp_linesize)
+        linesize[0] = video->disp_linesize;
+    return ret;
+}
+
+// Set up the cheapest decoding of the source for the display size, see DecodeReduce.
+// Source and display sizes are compared before the display size is swapped for rotation
+static void set_decode_reduce(FFReader *video, const AVCodec *codec, AVCodecContext *ctx, bool rotation_90)
+{
+    video->keyframe_only = false;
+    video->key_pts_time = -1.0;
+    drop_key_frame(video);
+    if (video->decode_reduce == DR_FULL)
+        return;
+    int dw = rotation_90? video->disp_height : video->disp_width;
+    int dh = rotation_90? video->disp_width : video->disp_height;
+    double ratio = (dw > 0 && dh > 0 && ctx->width > 0 && ctx->height > 0)?
+        std::min((double)ctx->width / dw, (double)ctx->height / dh) : 1.0;
+    DecodeReduce mode = video->decode_reduce;
+    if (mode == DR_AUTO)
+    {
+        if (ratio >= 8.0)
+            mode = DR_KEYFRAME;
+        else if (ratio >= 2.0)
+            mode = codec->max_lowres > 0? DR_LOWRES : DR_FAST;
+        else
+            return;
+    }
+    int lowres = 0;
+    if (mode == DR_LOWRES || mode == DR_KEYFRAME)
+    {
+        while (lowres < codec->max_lowres && ratio >= (2 << lowres))
+            lowres ++;
+        if (mode == DR_LOWRES && lowres == 0 && codec->max_lowres > 0) // asked for
+            lowres = 1;
+    }
+    ctx->lowres = lowres;
+    ctx->skip_loop_filter = AVDISCARD_ALL;
+    ctx->skip_idct = AVDISCARD_BIDIR;
+    ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+    if (mode == DR_KEYFRAME)
+    {
+        ctx->skip_frame = AVDISCARD_NONKEY;
+        video->keyframe_only = true;
+    }
+    LOG_INFO("Reduced decoding of %s: %dx%d shown at %dx%d, lowres %d%s", video->filename.c_str(),
+             ctx->width, ctx->height, dw, dh, lowres, video->keyframe_only? ", key frames only" : "");
+}
+
+// In keyframe_only mode, the previous key frame is shown in place of the frames skipped until
+// the next one, return the number of its copies to queue before the next one, so that frames
+// are not shown ahead of their audio
+static int key_frame_repeats(FFReader *video)
+{
+    if (!video->keyframe_only)
+        return 0;
+    double fps = video->fps < 1.0? 25.0 : video->fps;
+    int gap = video->key_pts_time < 0.0? 0 : (int)((video->video_pts_time - video->key_pts_time) * fps + 0.5) - 1;
+    video->key_pts_time = video->video_pts_time;
+    return std::max(0, std::min(gap, (int)(fps * 10))); // bounded on broken timestamps
+}
+
+static void drop_key_frame(FFReader *video)
+{
+    if (video->key_decoded)
+        av_frame_free(&video->key_decoded);
+    video->key_frame.clear();
+}
+
 int open_video_reader(FFReader *video)
 {
     if (video->fraw || video->fshm || video->formatCtx) // already opened
@@ -252,7 +375,7 @@ int open_video_reader(FFReader *video)
             }
             // get decoder
             avCodecCtx = avcodec_alloc_context3(avCode);
-            avCodecCtx->thread_count = 16;
+            avCodecCtx->thread_count = video->codec_threads > 0? video->codec_threads : decode_pool().Threads();
             if (avcodec_parameters_to_context(avCodecCtx, codecParameters) != 0)
             {
                 LOG_ERROR("avcodec_parameters_to_context failed, path:%s", video->filename.c_str());
@@ -267,6 +390,7 @@ int open_video_reader(FFReader *video)
                     avCodecCtx->pix_fmt = AV_PIX_FMT_YUVA420P;
                 }
             }
+            set_decode_reduce(video, avCode, avCodecCtx, rotation_90);
             // open decoder
             ret = avcodec_open2(avCodecCtx, avCode, nullptr);
             if (ret < 0)
@@ -314,10 +438,9 @@ int open_video_reader(FFReader *video)
             frame = av_frame_alloc();
             // scale image output
             displayFrame = av_frame_alloc();
-            video->buffersize = av_image_get_buffer_size(video->out_pix_fmt, video->disp_width, video->disp_height, 1);
+            set_display_layout(video);
             video->displayBuffer.resize(video->buffersize);
-            if (av_image_fill_arrays(displayFrame->data, displayFrame->linesize,
-                video->displayBuffer.data(), video->out_pix_fmt, video->disp_width, video->disp_height, 1) < 0)
+            if (fill_display_arrays(video, video->displayBuffer.data(), displayFrame->data, displayFrame->linesize) < 0)
             {
                 fprintf(stderr, "av_image_fill_arrays create dst image failed, path:%s\n", video->filename.c_str());
                 error = -1;
@@ -325,15 +448,8 @@ int open_video_reader(FFReader *video)
             }
             displayFrame->width = video->disp_width;
             displayFrame->height = video->disp_height;
-            int flag = SWS_BILINEAR; // scale_prefer default is both
-            if (video->scale_prefer && strncasecmp(video->scale_prefer, "quality", 7)==0)
-                flag = video->width > video->disp_width ? SWS_BICUBIC : SWS_BICUBLIN;
-            else if (video->scale_prefer && strncasecmp(video->scale_prefer, "speed", 5)==0)
-                flag = SWS_FAST_BILINEAR;
-            else if (video->scale_prefer && strncasecmp(video->scale_prefer, "both", 4)==0)
-                flag = SWS_BILINEAR;
             swsCtx = sws_getContext(video->width, video->height, avCodecCtx->pix_fmt,
-                video->disp_width, video->disp_height, video->out_pix_fmt, flag, NULL, NULL, NULL);
+                video->disp_width, video->disp_height, video->out_pix_fmt, get_sws_flags(video), NULL, NULL, NULL);
             if (!swsCtx)
             {
                 LOG_ERROR("swsCtx create fail path:%s", video->filename.c_str());
@@ -368,7 +484,7 @@ int open_video_reader(FFReader *video)
 
             // retrieve audio decoder
             video->avAudioCodecCtx = avcodec_alloc_context3(avAudioCode);
-            video->avAudioCodecCtx->thread_count = 16;
+            video->avAudioCodecCtx->thread_count = video->codec_threads > 0? video->codec_threads : decode_pool().Threads();
             if ((ret=avcodec_parameters_to_context(video->avAudioCodecCtx, audioCodecParameters)) != 0)
             {
                 LOG_ERROR("avcodec_parameters_to_context(AUDIO) failed, ret=%d", ret);
@@ -407,7 +523,7 @@ int open_video_reader(FFReader *video)
                 error = -1;
                 break;
             }
-            video->audio_size = 0;
+            video->rawAudio.Clear();
         }
     }while(0);
 
@@ -446,11 +562,17 @@ FFReader *new_video_reader(const char *filename, bool decode_video, bool decode_
     video->audioStreamIndex = -1;
     video->colorRange = video->colorSpace = 0;
     video->update_time.store(0);
-    video->audio_size = 0;
+    video->rawAudio.Clear();
     video->video_pts_time = -1.0;
     video->audio_pts_time = -1.0;
     video->audio_adjusted = false;
     video->rotation = 0.0;
+    video->lazy_convert = false;
+    video->codec_threads = 0;
+    video->decode_reduce = DR_FULL;
+    video->keyframe_only = false;
+    video->key_pts_time = -1.0;
+    video->key_decoded = NULL;
 
     if(!decode_audio && !decode_video)
     {
@@ -536,7 +658,7 @@ FFReader *open_raw_video(const char *filename, int disp_width, int disp_height,
     video->aud_channel = aud_channel;
     video->product_id = 0;
     video->update_time.store(0);
-    video->audio_size = 0;
+    video->rawAudio.Clear();
     video->video_pts_time = -1.0;
     video->audio_pts_time = -1.0;
     video->audio_adjusted = false;
@@ -560,7 +682,7 @@ FFReader *open_raw_video(const char *filename, int disp_width, int disp_height,
         video->framesize = 0;
     }
     if(aud_fmt)
-        video->rawAudio.resize(1024*1024);
+        video->rawAudio.Reserve(1024*1024);
     if (video->decode_video)
     {
         if (av_image_fill_arrays(video->displayFrame->data, video->displayFrame->linesize,
@@ -597,15 +719,19 @@ FFReader *open_raw_video(const char *filename, int disp_width, int disp_height,
 
     if (strncmp(filename, "-", 2)==0)
     {
-        video->fraw = stdin;
+        video->fraw = new RawPipe(STDIN_FILENO, false, raw_pipe_size);
     }
     else if (strncmp(filename, "shm://", 6)==0)
     {
         video->fshm = sq_open_by_shmid(atoi(filename+6));
+        if (video->fshm)
+            video->shmWait = new ShmWaiter(video->fshm);
     }
     else
     {
-        video->fraw = fopen(filename, "rb");
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+            video->fraw = new RawPipe(fd, true, raw_pipe_size);
     }
     if (video->fraw==NULL && video->fshm==NULL)
     {
@@ -629,6 +755,27 @@ FFReader *open_raw_video(const char *filename, int disp_width, int disp_height,
 
 static const int AudioBufferSize = 192000;
 
+// Append n bytes of pcm to rawAudio, copied from data, or read from f if data is NULL,
+// return -1 if reading fails. A full buffer drops the stale audio, see AudioRing::WriteSpans()
+static int append_raw_audio(FFReader *video, const void *data, size_t n, RawPipe *f)
+{
+    if (video->rawAudio.Size() + n > video->rawAudio.MaxSize())
+        LOG_ERROR("Warning: audio buffer of %s exceeds max of %dM, reset to 0", video->filename.c_str(), (int)(video->rawAudio.MaxSize() >> 20));
+    unsigned char *span[2];
+    size_t len[2];
+    int spans = video->rawAudio.WriteSpans(n, span, len);
+    for (int i = 0; i < spans; i++)
+    {
+        if (data)
+            memcpy(span[i], (const unsigned char *)data + (i? len[0] : 0), len[i]);
+        else if (!f->Read(span[i], len[i]))
+            return -1;
+    }
+    if (spans)
+        video->rawAudio.Commit(n);
+    return 0;
+}
+
 int decode_audio_frame(FFReader *video, AVPacket *packet)
 {
     int ret = avcodec_send_packet(video->avAudioCodecCtx, packet);
@@ -656,21 +803,7 @@ int decode_audio_frame(FFReader *video, AVPacket *packet)
             break;
         }
         int bytes = av_samples_get_buffer_size(NULL, video->aud_channel, nbsamples, AV_SAMPLE_FMT_S16, 1);
-        if(bytes + video->audio_size > video->rawAudio.size())
-        {
-            if(video->rawAudio.size() > 10*1024*1024)
-            {
-                LOG_ERROR("Warning: audio buffer size (%d) exceeds max of 10M, reset to 0", (int)video->rawAudio.size());
-                video->audio_size = 0;
-            }
-            else
-            {
-                LOG_ERROR("Warning: increasing audio buffer size to %d", (int)video->rawAudio.size()+1024*1024);
-                video->rawAudio.resize(video->rawAudio.size()+1024*1024);
-            }
-        }
-        memcpy(video->rawAudio.data()+video->audio_size, outdata, bytes);
-        video->audio_size += bytes;
+        append_raw_audio(video, outdata, bytes, NULL);
         video->audio_pts_time = video->audioFrame->pts * video->audio_timebase;
         LOG_DEBUG("recv audio, packet_dts=%lld, packet_pts=%lld, packet_pos=%lld, frame_dts=%lld, frame_pts=%lld, frame_pos=%lld, pts_time=%f, length=%d", packet->dts, packet->pts, packet->pos, video->audioFrame->pkt_dts, video->audioFrame->pts, video->audioFrame->pkt_pos, video->audio_pts_time, bytes);
 
@@ -686,6 +819,116 @@ int decode_audio_frame(FFReader *video, AVPacket *packet)
     return ret;
 }
 
+// point displayFrame at displayBuffer again, after the buffer is swapped with another one
+static void set_display_buffer(FFReader *video)
+{
+    if (video->displayFrame)
+        fill_display_arrays(video, video->displayBuffer.data(), video->displayFrame->data, video->displayFrame->linesize);
+}
+
+// Hand the frame in buffer over to a pooled handle without copying, buffer gets a recycled one
+// of the same size in place of it, so that the next frame is scaled straight into pooled memory
+static FrameBuffer take_frame_buffer(FFReader *video, std::vector<unsigned char> *buffer)
+{
+    FrameBuffer fb;
+    if (buffer != &video->displayBuffer && buffer != &video->rawBuffer)
+    {
+        fb = frame_pool().Copy(buffer->data(), buffer->size());
+    }
+    else
+    {
+        fb = frame_pool().Acquire(buffer->size());
+        fb.vec().swap(*buffer);
+        if (buffer == &video->displayBuffer)
+            set_display_buffer(video);
+    }
+    frame_pool().CountFrame();
+    return fb;
+}
+
+#ifdef FFMPEG_DECODE_COLORSPACE
+// set the source colorspace and range of sws from frame
+static void set_sws_colorspace(SwsContext *sws, const AVFrame *frame)
+{
+    int srcRange = 0;
+    if (frame->color_range == AVCOL_RANGE_JPEG)
+        srcRange = 1;
+    int srcCS = SWS_CS_DEFAULT;
+    if (frame->colorspace == AVCOL_SPC_BT709)
+        srcCS = SWS_CS_ITU709;
+    else if (frame->colorspace == AVCOL_SPC_FCC)
+        srcCS = SWS_CS_FCC;
+    else if (frame->colorspace == AVCOL_SPC_SMPTE240M)
+        srcCS = SWS_CS_SMPTE240M;
+    else if (frame->colorspace == AVCOL_SPC_BT2020_CL || frame->colorspace == AVCOL_SPC_BT2020_NCL)
+        srcCS = SWS_CS_BT2020;
+    else if (frame->colorspace == AVCOL_SPC_UNSPECIFIED)
+    {
+        if (frame->height > 576)
+            srcCS = SWS_CS_ITU709;
+    }
+    sws_setColorspaceDetails(sws, sws_getCoefficients(srcCS), srcRange,
+        sws_getCoefficients(SWS_CS_DEFAULT), 0, 0, 1 << 16, 1 << 16);
+}
+#endif
+
+// Scale a decoded frame into dst of video->buffersize bytes, in out_pix_fmt at display size
+static int scale_video_frame(FFReader *video, SwsContext *sws, AVFrame *frame, unsigned char *dst)
+{
+    uint8_t *dst_data[4];
+    int dst_linesize[4];
+    fill_display_arrays(video, dst, dst_data, dst_linesize);
+    if (sws_scale(sws, frame->data, frame->linesize, 0, frame->height, dst_data, dst_linesize) < 0)
+    {
+        LOG_ERROR("sws_scale failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Convert and scale a decoded frame into dst of video->buffersize bytes, in out_pix_fmt at display size
+static int convert_video_frame(FFReader *video, SwsContext *sws, AVFrame *frame, unsigned char *dst)
+{
+#ifdef FFMPEG_DECODE_COLORSPACE
+    if (frame->color_range != video->colorRange || frame->colorspace != video->colorSpace)
+    {
+        set_sws_colorspace(sws, frame);
+        video->colorRange = frame->color_range;
+        video->colorSpace = frame->colorspace;
+    }
+#endif
+    return scale_video_frame(video, sws, frame, dst);
+}
+
+// first decoded frame not read yet in lazy_convert mode, caller owns it
+static AVFrame *take_decoded_frame(FFReader *video)
+{
+    if (video->decoded.empty())
+        return NULL;
+    AVFrame *frame = video->decoded.front();
+    video->decoded.erase(video->decoded.begin());
+    return frame;
+}
+
+// number of frames decoded but not read yet
+static int pending_video_frames(FFReader *video)
+{
+    return (int)(video->buffers.size() + video->decoded.size());
+}
+
+// drop frames decoded but not read yet, except the last keep ones
+static void drop_video_frames(FFReader *video, int keep)
+{
+    if ((int)video->buffers.size() > keep)
+        video->buffers.erase(video->buffers.begin(), video->buffers.end() - keep);
+    while ((int)video->decoded.size() > keep)
+    {
+        AVFrame *frame = take_decoded_frame(video);
+        av_frame_free(&frame);
+    }
+}
+
 int decode_video_frame(FFReader *video, AVPacket *packet, std::vector<uint8_t> **video_buffer)
 {
     int error = 0;
@@ -698,91 +941,82 @@ int decode_video_frame(FFReader *video, AVPacket *packet, std::vector<uint8_t> *
     {
         video->video_pts_time = video->frame->pts * video->video_timebase;
         LOG_DEBUG("recv video, packet_dts=%lld, packet_pts=%lld, packet_pos=%lld, frame_dts=%lld, frame_pts=%lld, frame_pos=%lld, pts_time=%f", packet->dts, packet->pts, packet->pos, video->frame->pkt_dts, video->frame->pts, packet->pos, video->video_pts_time);
-        if (video_buffer && *video_buffer == &video->displayBuffer) // duplicate for reuse
+        int repeats = key_frame_repeats(video);
+        if (video->lazy_convert) // keep a reference of the decoded frame, it is converted when read
         {
-            video->rawBuffer.resize(video->displayBuffer.size());
-            memcpy(video->rawBuffer.data(), video->displayBuffer.data(), video->displayBuffer.size());
-            *video_buffer = &video->rawBuffer;
-        }
-        // read video
-        if ((video->width % 8) && video->frame->format==AV_PIX_FMT_YUV420P && // 不是8对齐，ffmpeg读出BGR会有黑边，自己转
-                (video->out_pix_fmt==AV_PIX_FMT_BGR24 || video->out_pix_fmt==AV_PIX_FMT_BGRA))
-        {
-            cv::Mat m1(cv::Size(video->width, video->height*3/2), CV_8U);
-            ret = av_image_copy_to_buffer(m1.data, video->width*video->height*3/2,
-                        video->frame->data, video->frame->linesize,
-                        AV_PIX_FMT_YUV420P, video->width, video->height, 1);
-            if (ret < 0)
+            AVFrame *decoded = av_frame_clone(video->frame);
+            av_frame_unref(video->frame);
+            if (!decoded)
             {
-                av_frame_unref(video->frame);
-                LOG_ERROR("av_image_copy_to_buffer failed");
+                LOG_ERROR("av_frame_clone failed");
                 error = -1;
                 break;
             }
-            int dst_type = video->out_pix_fmt==AV_PIX_FMT_BGRA? CV_8UC4 : CV_8UC3;
-            int dst_color = video->out_pix_fmt==AV_PIX_FMT_BGRA? cv::COLOR_YUV2BGRA_I420 : cv::COLOR_YUV2BGR_I420;
-            if (video->disp_width==video->width && video->disp_height==video->height)
+            for (int i = 0; i < repeats && video->key_decoded; i++)
             {
-                cv::Mat m2(cv::Size(video->width, video->height), dst_type, video->displayBuffer.data());
-                cv::cvtColor(m1, m2, dst_color);
-            }
-            else
-            {
-                cv::Mat m2(cv::Size(video->width, video->height), dst_type);
-                cv::Mat m3(cv::Size(video->disp_width, video->disp_height), dst_type, video->displayBuffer.data());
-                cv::cvtColor(m1, m2, dst_color);
-                cv::resize(m2, m3, cv::Size(video->disp_width, video->disp_height));
-            }
-        }
-        else
-        {
-#ifdef FFMPEG_DECODE_COLORSPACE
-            if (video->frame->color_range != video->colorRange || video->frame->colorspace != video->colorSpace)
-            {
-                int srcRange = 0;
-                if (video->frame->color_range == AVCOL_RANGE_JPEG)
-                    srcRange = 1;
-                int srcCS = SWS_CS_DEFAULT;
-                if (video->frame->colorspace == AVCOL_SPC_BT709)
-                    srcCS = SWS_CS_ITU709;
-                else if (video->frame->colorspace == AVCOL_SPC_FCC)
-                    srcCS = SWS_CS_FCC;
-                else if (video->frame->colorspace == AVCOL_SPC_SMPTE240M)
-                    srcCS = SWS_CS_SMPTE240M;
-                else if (video->frame->colorspace == AVCOL_SPC_BT2020_CL || video->frame->colorspace == AVCOL_SPC_BT2020_NCL)
-                    srcCS = SWS_CS_BT2020;
-                else if (video->frame->colorspace == AVCOL_SPC_UNSPECIFIED)
+                AVFrame *copy = av_frame_clone(video->key_decoded);
+                if (!copy)
                 {
-                    if (video->frame->height > 576)
-                        srcCS = SWS_CS_ITU709;
+                    LOG_ERROR("av_frame_clone failed, %d copies of key frame are not queued", repeats - i);
+                    break;
                 }
-                sws_setColorspaceDetails(video->swsCtx, sws_getCoefficients(srcCS), srcRange,
-                    sws_getCoefficients(SWS_CS_DEFAULT), 0, 0, 1 << 16, 1 << 16);
-                video->colorRange = video->frame->color_range;
-                video->colorSpace = video->frame->colorspace;
+                video->decoded.push_back(copy);
             }
-#endif
-            ret = sws_scale(video->swsCtx, video->frame->data,
-                video->frame->linesize, 0, video->frame->height, video->displayFrame->data, video->displayFrame->linesize);
-            if (ret < 0)
+            video->decoded.push_back(decoded);
+            if (video->keyframe_only) // a reference, to be repeated before the next key frame
             {
-                av_frame_unref(video->frame);
-                LOG_ERROR("sws_scale failed");
-                error = -1;
-                break;
+                if (video->key_decoded)
+                    av_frame_free(&video->key_decoded);
+                video->key_decoded = av_frame_clone(decoded);
             }
+            if (video_buffer && *video_buffer == NULL) // only tells a frame is ready, see take_decoded_frame()
+                *video_buffer = &video->displayBuffer;
+            continue;
+        }
+        if (video_buffer && *video_buffer == &video->displayBuffer) // keep it in rawBuffer for reuse
+        {
+            video->rawBuffer.swap(video->displayBuffer);
+            video->displayBuffer.resize(video->rawBuffer.size());
+            set_display_buffer(video);
+            *video_buffer = &video->rawBuffer;
+        }
+        // read video
+        if (convert_video_frame(video, video->swsCtx, video->frame, video->displayBuffer.data()) < 0)
+        {
+            av_frame_unref(video->frame);
+            error = -1;
+            break;
         }
 
-        if(video_buffer && *video_buffer == NULL)
+        const FrameBuffer &key = video->key_frame;
+        if (key.size() != video->displayBuffer.size()) // none, or of another display size
+            repeats = 0;
+        const std::vector<unsigned char> *last = &video->displayBuffer;
+        if (repeats == 0 && video_buffer && *video_buffer == NULL)
         {
             *video_buffer = &video->displayBuffer;
         }
         else
         {
-            std::vector<unsigned char> r(video->displayBuffer.size());
-            memcpy(r.data(), video->displayBuffer.data(), video->displayBuffer.size());
-            video->buffers.push_back(std::move(r));
+            // copies of the previous key frame go first, the first one in displayBuffer if nothing is read yet
+            FrameBuffer fresh = take_frame_buffer(video, &video->displayBuffer);
+            for (int i = 0; i < repeats; i++)
+            {
+                if (video_buffer && *video_buffer == NULL)
+                {
+                    memcpy(video->displayBuffer.data(), key.data(), key.size());
+                    *video_buffer = &video->displayBuffer;
+                }
+                else
+                {
+                    video->buffers.push_back(frame_pool().Copy(key.data(), key.size()));
+                }
+            }
+            video->buffers.push_back(std::move(fresh));
+            last = &video->buffers.back().vec();
         }
+        if (video->keyframe_only) // to be repeated before the next key frame
+            video->key_frame = frame_pool().Copy(last->data(), last->size());
 
         // 释放src frame
         av_frame_unref(video->frame);
@@ -808,9 +1042,9 @@ int read_rawvideo_frame(FFReader *video, std::vector<unsigned char> **buffer)
     {
         {
         AUTOTIMED(("[rawvideo] read header, size: "+std::to_string(sizeof(header))).c_str(), STAT_RUNTIME);
-        if (fread(&header, sizeof(header), 1, video->fraw) != 1)
+        if (!video->fraw->Read(&header, sizeof(header)))
         {
-            if (feof(video->fraw))
+            if (video->fraw->Eof())
             {
                 LOG_INFO("eof occur.");
                 return 0;
@@ -839,9 +1073,9 @@ int read_rawvideo_frame(FFReader *video, std::vector<unsigned char> **buffer)
         {
             {
             AUTOTIMED("[rawvideo] read ext audio header, size: 4", STAT_RUNTIME);
-            if (fread(&extaudioheader, sizeof(extaudioheader), 1, video->fraw) != 1)
+            if (!video->fraw->Read(&extaudioheader, sizeof(extaudioheader)))
             {
-                if (feof(video->fraw))
+                if (video->fraw->Eof())
                 {
                     LOG_INFO("eof occur.");
                     break;
@@ -855,21 +1089,16 @@ int read_rawvideo_frame(FFReader *video, std::vector<unsigned char> **buffer)
         {
             LOG_INFO("Switching product from %d to %d", video->product_id, extaudioheader.product_id);
             video->product_id = extaudioheader.product_id;
-            video->audio_size = 0;
+            video->rawAudio.Clear();
         }
         if (header.len <= 0 || header.len > 1024*1024)
         {
             LOG_ERROR("Error: bad header audio length of %d (max allowed is 1M)!", header.len);
             return -1;
         }
-        if(header.len + video->audio_size > video->rawAudio.size())
+        if (append_raw_audio(video, NULL, header.len, video->fraw) < 0)
         {
-            LOG_INFO("Warning: increasing rawaudio buffer size to %d", (int)video->rawAudio.size()+1024*1024);
-            video->rawAudio.resize(video->rawAudio.size()+1024*1024);
-        }
-        if (fread(video->rawAudio.data()+video->audio_size, header.len, 1, video->fraw) != 1)
-        {
-            if (feof(video->fraw))
+            if (video->fraw->Eof())
             {
                 LOG_INFO("eof occur.");
                 return 0;
@@ -877,13 +1106,13 @@ int read_rawvideo_frame(FFReader *video, std::vector<unsigned char> **buffer)
             LOG_ERROR("Failed to read raw audio frame, err=%d:%s", errno, strerror(errno));
             return -1;
         }
-        video->audio_size += header.len;
     }
     {
         AUTOTIMED(("[rawvideo] read body size: "+std::to_string(video->framesize)).c_str(), STAT_RUNTIME);
-        if (fread(video->rawBuffer.data(), video->framesize, 1, video->fraw) != 1)
+        // straight into rawBuffer, which take_frame_buffer() hands over to the decoder queue
+        if (!video->fraw->Read(video->rawBuffer.data(), video->framesize))
         {
-            if (feof(video->fraw))
+            if (video->fraw->Eof())
             {
                 LOG_INFO("eof occur.");
                 return 0;
@@ -929,9 +1158,9 @@ static int read_rawaudio_frame(FFReader *video, int max_length)
     {
         {
         AUTOTIMED(("[rawaudio] read header, size: "+std::to_string(sizeof(header))).c_str(), STAT_RUNTIME);
-        if (fread(&header, sizeof(header), 1, video->fraw) != 1)
+        if (!video->fraw->Read(&header, sizeof(header)))
         {
-            if (feof(video->fraw))
+            if (video->fraw->Eof())
             {
                 LOG_INFO("eof occur.");
                 break;
@@ -950,10 +1179,9 @@ static int read_rawaudio_frame(FFReader *video, int max_length)
         {
             LOG_ERROR("Warning: read_rawaudio_frame() encounters video, read and discard!");{
             AUTOTIMED(("[rawaudio] read video body size: "+std::to_string(header.len)).c_str(), STAT_RUNTIME);
-            video->rawBuffer.resize(header.len);
-            if (fread(video->rawBuffer.data(), header.len, 1, video->fraw) != 1)
+            if (!video->fraw->Skip(header.len))
             {
-                if (feof(video->fraw))
+                if (video->fraw->Eof())
                 {
                     LOG_INFO("eof occur.");
                     break;
@@ -969,9 +1197,9 @@ static int read_rawaudio_frame(FFReader *video, int max_length)
         {
             {
             AUTOTIMED(("[rawaudio] read ext audio header, size: 8, body length: " + std::to_string(header.len)).c_str(), STAT_RUNTIME);
-            if (fread(&extaudioheader, sizeof(extaudioheader), 1, video->fraw) != 1)
+            if (!video->fraw->Read(&extaudioheader, sizeof(extaudioheader)))
             {
-                if (feof(video->fraw))
+                if (video->fraw->Eof())
                 {
                     printf("eof occur.\n");
                     break;
@@ -986,21 +1214,16 @@ static int read_rawaudio_frame(FFReader *video, int max_length)
             LOG_ERROR("Switching product from %d to %d", video->product_id, extaudioheader.product_id);
             video->product_id = extaudioheader.product_id;
             video->rawBuffer.clear();
-            video->audio_size = 0;
+            video->rawAudio.Clear();
         }
         if (header.len <= 0 || header.len > 1024*1024)
         {
             LOG_ERROR("Error: bad header audio length of %d (max allowed is 1M)!", header.len);
             return -1;
         }
-        if(header.len + video->audio_size > video->rawAudio.size())
-        {
-            LOG_INFO("Warning: increasing rawaudio buffer size to %d", (int)video->rawAudio.size()+1024*1024);
-            video->rawAudio.resize(video->rawAudio.size()+1024*1024);
-        }
-        if (fread(video->rawAudio.data()+video->audio_size, header.len, 1, video->fraw) != 1)
+        if (append_raw_audio(video, NULL, header.len, video->fraw) < 0)
         {
-            if (feof(video->fraw))
+            if (video->fraw->Eof())
             {
                 LOG_INFO("eof occur.");
                 break;
@@ -1008,44 +1231,57 @@ static int read_rawaudio_frame(FFReader *video, int max_length)
             LOG_ERROR("Failed to read raw audio frame, err=%d:%s", errno, strerror(errno));
             return -1;
         }
-        video->audio_size += header.len;
-        if (video->audio_size + AUDIO_DELTA >= max_length)
+        if (video->rawAudio.Size() + AUDIO_DELTA >= max_length)
             break;
     }
     return 0;
 }
 
+// Removes the element peeked from a shm:// input when going out of scope, the element is read
+// in place until then
+struct ShmPeeked
+{
+    struct shm_queue *sq;
+    unsigned char *data;
+    explicit ShmPeeked(struct shm_queue *sq) : sq(sq), data(NULL) {}
+    ~ShmPeeked()
+    {
+        if (data)
+            sq_release(sq);
+    }
+};
+
 int read_rawvideo_frame_shm(FFReader *video, std::vector<unsigned char> **buffer)
 {
     *buffer = NULL;
     MsgHead *header = NULL;
     ExtMsgHeadExtAudio *extaudioheader = NULL;
-    static std::vector<unsigned char> rawdata(32*1024*1024);
+    ShmPeeked frame(video->fshm); // video frame left in shm, converted from there
     int length = 0;
-    uint64_t timeout_ms = 0;
 
     while(true) // buffer all raw audio at video->rawAudio until one video frame is encountered
     {
         AUTOTIMED("[rawvideo_shm] read packet", STAT_RUNTIME);
         struct timeval enTime;
-        while((length=sq_get(video->fshm, rawdata.data(), rawdata.size(), &enTime)) == 0) // FIXME: there must be some mechanism to get out of here!!!
-        {
+        ShmPeeked packet(video->fshm);
+        void *elem = NULL;
+        long sleeps = video->shmWait->Sleeps();
+        length = video->shmWait->Peek(&elem, &enTime, shm_timeout);
+        if (video->shmWait->Sleeps() != sleeps)
             AUTOTIME_SKIP();
-            timeout_ms += 10;
-            if (timeout_ms > 60000) // 1 minute
-            {
+        if (length > 0)
+            packet.data = (unsigned char *)elem;
+        if (length == 0)
+        {
+            if (!video->shmWait->Woken())
                 LOG_ERROR("Read rawvideo from shm timeout! path=%s", video->filename.c_str());
-                break;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            continue;
+            return -1;
         }
         if (length < 0)
         {
             LOG_ERROR("Failed to read rawvideo from shm(path=%s), err=%s", video->filename.c_str(), sq_errorstr(video->fshm));
             return -1;
         }
-        timeout_ms = 0;
         if (!video->aud_fmt) // pure video frame without header
         {
             if (length != video->framesize) // video
@@ -1053,8 +1289,7 @@ int read_rawvideo_frame_shm(FFReader *video, std::vector<unsigned char> **buffer
                 LOG_ERROR("Error: bad video length in shm(path=%s), expect %d, got %d!", video->filename.c_str(), video->framesize, length);
                 return -1;
             }
-            unsigned char *data = rawdata.data();
-            memcpy(video->rawBuffer.data(), data, video->framesize);
+            std::swap(frame.data, packet.data);
             break;
         }
         if (length < sizeof(MsgHead))
@@ -1062,7 +1297,7 @@ int read_rawvideo_frame_shm(FFReader *video, std::vector<unsigned char> **buffer
             LOG_ERROR("Error: bad packet length in shm(path=%s), length=%d!", video->filename.c_str(), length);
             return -1;
         }
-        header = (MsgHead *)rawdata.data();
+        header = (MsgHead *)packet.data;
         extaudioheader = NULL;
         if (header->ver != 1 || (header->type != EC_RAWMEDIA_VIDEO &&
             header->type != EC_RAWMEDIA_AUDIO && header->type != EC_RAWMEDIA_EXT_AUDIO))
@@ -1082,13 +1317,13 @@ int read_rawvideo_frame_shm(FFReader *video, std::vector<unsigned char> **buffer
                 LOG_ERROR("Error: bad packet length for video, expect %d, got %d", sizeof(MsgHead) + header->len, length);
                 return -1;
             }
-            unsigned char *data = rawdata.data()+sizeof(MsgHead);
-            memcpy(video->rawBuffer.data(), data, video->framesize);
+            std::swap(frame.data, packet.data);
+            frame.data += sizeof(MsgHead);
             break;
         }
         else // AUDIO
         {
-            unsigned char *data = rawdata.data()+sizeof(MsgHead);
+            unsigned char *data = packet.data+sizeof(MsgHead);
             if (header->type == EC_RAWMEDIA_EXT_AUDIO) // ExtAudio
             {
                 if (length < sizeof(MsgHead) + sizeof(ExtMsgHeadExtAudio) + header->len)
@@ -1096,32 +1331,28 @@ int read_rawvideo_frame_shm(FFReader *video, std::vector<unsigned char> **buffer
                     LOG_ERROR("Error: bad packet length for ext audio, expect %d, got %d", sizeof(MsgHead) + sizeof(ExtMsgHeadExtAudio) + header->len, length);
                     return -1;
                 }
-                extaudioheader = (ExtMsgHeadExtAudio *)(rawdata.data()+sizeof(MsgHead));
-                data = rawdata.data()+sizeof(MsgHead)+sizeof(ExtMsgHeadExtAudio);
+                extaudioheader = (ExtMsgHeadExtAudio *)(packet.data+sizeof(MsgHead));
+                data = packet.data+sizeof(MsgHead)+sizeof(ExtMsgHeadExtAudio);
             }
             if (extaudioheader && extaudioheader->product_id != video->product_id) // switch product, clear buffer
             {
                 LOG_INFO("Switching product from %d to %d\n", video->product_id, extaudioheader->product_id);
                 video->product_id = extaudioheader->product_id;
-                video->audio_size = 0;
+                video->rawAudio.Clear();
             }
             if (header->len <= 0 || header->len > 1024*1024)
             {
                 LOG_ERROR("Error: bad header audio length of %d (max allowed is 1M)!", header->len);
                 return -1;
             }
-            if(header->len + video->audio_size > video->rawAudio.size())
-            {
-                LOG_ERROR("Warning: increasing rawaudio buffer size to %d", (int)video->rawAudio.size()+1024*1024);
-                video->rawAudio.resize(video->rawAudio.size()+1024*1024);
-            }
-            memcpy(video->rawAudio.data()+video->audio_size, data, header->len);
-            video->audio_size += header->len;
+            append_raw_audio(video, data, header->len, NULL);
         }
     }
 
     if (video->pix_fmt == video->out_pix_fmt && video->width == video->disp_width && video->height == video->disp_height)
     {
+        // the only copy, rawBuffer is handed over to the decoder queue as it is
+        memcpy(video->rawBuffer.data(), frame.data, video->framesize);
         *buffer = &video->rawBuffer;
         return 0;
     }
@@ -1129,7 +1360,7 @@ int read_rawvideo_frame_shm(FFReader *video, std::vector<unsigned char> **buffer
     {
         AUTOTIMED("[rawvideo] scale frame", STAT_RUNTIME);
         if (av_image_fill_arrays(video->frame->data, video->frame->linesize,
-            video->rawBuffer.data(), video->pix_fmt, video->width, video->height, 1) < 0)
+            frame.data, video->pix_fmt, video->width, video->height, 1) < 0)
         {
             LOG_ERROR("av_image_fill_arrays create src image failed");
             return -1;
@@ -1151,9 +1382,7 @@ static int read_rawaudio_frame_shm(FFReader *video, int max_length)
 {
     MsgHead *header = NULL;
     ExtMsgHeadExtAudio *extaudioheader = NULL;
-    static std::vector<unsigned char> rawdata(32*1024*1024);
     int length = 0;
-    uint64_t timeout_ms = 0;
 
     if (!video->aud_fmt)
     {
@@ -1165,16 +1394,19 @@ static int read_rawaudio_frame_shm(FFReader *video, int max_length)
     {
         AUTOTIMED("[rawaudio_shm] read packet", STAT_RUNTIME);
         struct timeval enTime;
-        while((length=sq_get(video->fshm, rawdata.data(), rawdata.size(), &enTime)) == 0)
-        {
+        ShmPeeked packet(video->fshm);
+        void *elem = NULL;
+        long sleeps = video->shmWait->Sleeps();
+        length = video->shmWait->Peek(&elem, &enTime, shm_timeout);
+        if (video->shmWait->Sleeps() != sleeps)
             AUTOTIME_SKIP();
-            timeout_ms += 10;
-            if (timeout_ms > 60000) // 1 minute
-            {
-                break;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            continue;
+        if (length > 0)
+            packet.data = (unsigned char *)elem;
+        if (length == 0)
+        {
+            if (!video->shmWait->Woken())
+                LOG_ERROR("Read rawaudio from shm timeout! path=%s", video->filename.c_str());
+            return -1;
         }
         if (length < 0)
         {
@@ -1186,8 +1418,7 @@ static int read_rawaudio_frame_shm(FFReader *video, int max_length)
             LOG_ERROR("Error: bad packet length in shm(path=%s), length=%d!", video->filename.c_str(), length);
             return -1;
         }
-        timeout_ms = 0;
-        header = (MsgHead *)rawdata.data();
+        header = (MsgHead *)packet.data;
         extaudioheader = NULL;
         if (header->ver != 1 || (header->type != EC_RAWMEDIA_VIDEO &&
             header->type != EC_RAWMEDIA_AUDIO && header->type != EC_RAWMEDIA_EXT_AUDIO))
@@ -1202,7 +1433,7 @@ static int read_rawaudio_frame_shm(FFReader *video, int max_length)
         }
         else // AUDIO
         {
-            unsigned char *data = rawdata.data()+sizeof(MsgHead);
+            unsigned char *data = packet.data+sizeof(MsgHead);
             if (header->type == EC_RAWMEDIA_EXT_AUDIO) // ExtAudio
             {
                 if (length < sizeof(MsgHead) + sizeof(ExtMsgHeadExtAudio) + header->len)
@@ -1210,29 +1441,23 @@ static int read_rawaudio_frame_shm(FFReader *video, int max_length)
                     LOG_ERROR("Error: bad packet length for ext audio, expect %d, got %d", sizeof(MsgHead) + sizeof(ExtMsgHeadExtAudio) + header->len, length);
                     return -1;
                 }
-                extaudioheader = (ExtMsgHeadExtAudio *)(rawdata.data()+sizeof(MsgHead));
-                data = rawdata.data()+sizeof(MsgHead)+sizeof(ExtMsgHeadExtAudio);
+                extaudioheader = (ExtMsgHeadExtAudio *)(packet.data+sizeof(MsgHead));
+                data = packet.data+sizeof(MsgHead)+sizeof(ExtMsgHeadExtAudio);
             }
             if (extaudioheader && extaudioheader->product_id != video->product_id) // switch product, clear buffer
             {
                 LOG_INFO("Switching product from %d to %d", video->product_id, extaudioheader->product_id);
                 video->product_id = extaudioheader->product_id;
-                video->audio_size = 0;
+                video->rawAudio.Clear();
             }
             if (header->len <= 0 || header->len > 1024*1024)
             {
                 LOG_ERROR("Error: bad header audio length of %d (max allowed is 1M)!", header->len);
                 return -1;
             }
-            if(header->len + video->audio_size > video->rawAudio.size())
-            {
-                LOG_ERROR("Warning: increasing rawaudio buffer size to %d", (int)video->rawAudio.size()+1024*1024);
-                video->rawAudio.resize(video->rawAudio.size()+1024*1024);
-            }
-            memcpy(video->rawAudio.data()+video->audio_size, data, header->len);
-            video->audio_size += header->len;
+            append_raw_audio(video, data, header->len, NULL);
         }
-        if (video->audio_size + AUDIO_DELTA >= max_length)
+        if (video->rawAudio.Size() + AUDIO_DELTA >= max_length)
             break;
     }
     return 0;
@@ -1262,6 +1487,14 @@ int read_video_frame(FFReader *video, std::vector<unsigned char> **buffer)
         return ret;
     }
 
+    // frames decoded in lazy_convert mode are taken by take_decoded_frame()
+    if (video->decoded.size())
+    {
+        *buffer = &video->displayBuffer;
+        video->update_time.store(time(NULL));
+        return 0;
+    }
+
     // get from buffers
     if (video->buffers.size())
     {
@@ -1270,7 +1503,9 @@ int read_video_frame(FFReader *video, std::vector<unsigned char> **buffer)
             LOG_INFO("Warning: buffer size changed from %u to %u", video->displayBuffer.size(), video->buffers[0].size());
             video->displayBuffer.resize(video->buffers[0].size());
         }
-        memcpy(video->displayBuffer.data(), video->buffers[0].data(), video->buffers[0].size());
+        // swapped instead of copied, the previous display buffer is recycled by the erased handle
+        video->displayBuffer.swap(video->buffers[0].vec());
+        set_display_buffer(video);
         video->buffers.erase(video->buffers.begin());
         *buffer = &video->displayBuffer;
         video->update_time.store(time(NULL));
@@ -1311,8 +1546,14 @@ int read_video_frame(FFReader *video, std::vector<unsigned char> **buffer)
                 if (video->update_time + 1 < currtime && check_is_stream(video->filename.c_str()))
                 {
                     LOG_INFO("update_time is too old (%d seconds ago), clear buffers", currtime - video->update_time);
-                    video->buffers.clear();
-                    video->audio_size = 0;
+                    if (!video->lazy_convert && *buffer == &video->displayBuffer && video->buffers.size())
+                    {
+                        // copies of the previous key frame are queued before the frame just decoded, show it instead
+                        video->displayBuffer.swap(video->buffers.back().vec());
+                        set_display_buffer(video);
+                    }
+                    drop_video_frames(video, video->lazy_convert? 1 : 0); // frame just decoded is kept
+                    video->rawAudio.Clear();
                     video->audio_adjusted = false; // need to re-adjust audio
                 }
                 video->update_time.store(currtime);
@@ -1325,7 +1566,7 @@ int read_video_frame(FFReader *video, std::vector<unsigned char> **buffer)
         }
         else if (video->decode_audio && packet->stream_index == video->audioStreamIndex) // audio stream
         {
-            int old_audio_size = video->audio_size;
+            int old_audio_size = video->rawAudio.Size();
             decode_audio_frame(video, packet);
             av_packet_unref(packet);
             av_packet_free(&packet);
@@ -1335,9 +1576,8 @@ int read_video_frame(FFReader *video, std::vector<unsigned char> **buffer)
                 if (video->update_time + 1 < currtime && check_is_stream(video->filename.c_str()))
                 {
                     LOG_INFO("update_time is too old (%d seconds ago), clear buffers", currtime - video->update_time);
-                    video->buffers.clear();
-                    memmove(video->rawAudio.data(), video->rawAudio.data() + old_audio_size, video->audio_size - old_audio_size);
-                    video->audio_size -= old_audio_size;
+                    drop_video_frames(video, 0);
+                    video->rawAudio.Consume(old_audio_size);
                     video->audio_adjusted = false; // need to re-adjust audio
                 }
                 video->update_time.store(currtime);
@@ -1356,10 +1596,10 @@ double get_audio_buffer_psttime(FFReader *video)
 {
     if (video->audio_pts_time < 0.0)
         return video->audio_pts_time;
-    if (video->audio_size <= 0)
+    if (video->rawAudio.Size() <= 0)
         return video->audio_pts_time;
 
-    auto ms = ((double)video->audio_size) / (double)(video->aud_bitrate * 2 * video->aud_channel);
+    auto ms = ((double)video->rawAudio.Size()) / (double)(video->aud_bitrate * 2 * video->aud_channel);
     if (video->audio_pts_time > ms)
         return video->audio_pts_time - ms;
     return 0.0;
@@ -1369,11 +1609,11 @@ double get_video_buffer_psttime(FFReader *video)
 {
     if (video->video_pts_time < 0.0)
         return video->video_pts_time;
-    if (video->buffers.size() <= 0)
+    if (pending_video_frames(video) <= 0)
         return video->video_pts_time;
 
     double fps = video->fps < 1.0? 25.0 : video->fps;
-    auto ms = (double)(((double)video->buffers.size()) / fps);
+    auto ms = (double)(((double)pending_video_frames(video)) / fps);
     if (video->video_pts_time > ms)
         return video->video_pts_time - ms;
     return 0.0;
@@ -1394,7 +1634,7 @@ int read_audio_data(FFReader *video, std::vector<unsigned char> &buffer, int max
     int error = 0;
 
     // get from buffers
-    if(video->audio_size + AUDIO_DELTA >= max_length)
+    if(video->rawAudio.Size() + AUDIO_DELTA >= max_length)
     {
 _read_pcm_buffer:
         // adjust audio output according to video pts
@@ -1403,7 +1643,7 @@ _read_pcm_buffer:
         {
             double v_pts = get_video_buffer_psttime(video);
             double a_pts = get_audio_buffer_psttime(video);
-            LOG_INFO("get_audio: v_pts=%f, a_pts=%f, audio_size=%d, video_size=%d", v_pts, a_pts, video->audio_size, video->buffers.size());
+            LOG_INFO("get_audio: v_pts=%f, a_pts=%f, audio_size=%d, video_size=%d", v_pts, a_pts, video->rawAudio.Size(), video->buffers.size());
 
             if (a_pts >= 0.0)
             {
@@ -1420,18 +1660,17 @@ _read_pcm_buffer:
                     if (bytes > AUDIO_ADJUST_DELTA)
                     {
                         bytes = bytes & 0xffffff00;
-                        if (bytes > video->audio_size)
+                        if (bytes > video->rawAudio.Size())
                         {
-                            LOG_ERROR("Warning: audio is too old, discard all %d bytes (diff: %d)", video->audio_size, bytes);
-                            video->audio_size = 0;
+                            LOG_ERROR("Warning: audio is too old, discard all %d bytes (diff: %d)", video->rawAudio.Size(), bytes);
+                            video->rawAudio.Clear();
                             buffer.clear();
                             return 0;
                         }
                         if (bytes > 0)
                         {
-                            LOG_ERROR("Warning: audio is too old, discard %d bytes (all: %d)", bytes, video->audio_size);
-                            memmove(video->rawAudio.data(), video->rawAudio.data() + bytes, video->audio_size - bytes);
-                            video->audio_size -= bytes;
+                            LOG_ERROR("Warning: audio is too old, discard %d bytes (all: %d)", bytes, video->rawAudio.Size());
+                            video->rawAudio.Consume(bytes);
                         }
                     }
                 }
@@ -1449,13 +1688,10 @@ _read_pcm_buffer:
                 video->audio_adjusted = true;
             }
         }
-        if(max_length > video->audio_size || max_length == 0)
-            max_length = video->audio_size;
+        if(max_length > video->rawAudio.Size() || max_length == 0)
+            max_length = video->rawAudio.Size();
         buffer.resize(max_length);
-        memcpy(buffer.data(), video->rawAudio.data(), max_length);
-        if(video->audio_size > max_length)
-            memmove(video->rawAudio.data(), video->rawAudio.data()+max_length, video->audio_size - max_length);
-        video->audio_size -= max_length;
+        video->rawAudio.Read(buffer.data(), max_length); // copied from up to two spans in place
         video->update_time.store(time(NULL));
         return 0;
     }
@@ -1511,7 +1747,7 @@ _read_pcm_buffer:
             if(ret < 0)
             {
                 error = (ret==AVERROR_EOF||ret==AVERROR(EAGAIN))? 0 : -1;
-                if(ret == AVERROR(EAGAIN) && video->audio_size + AUDIO_DELTA < max_length) // need more data
+                if(ret == AVERROR(EAGAIN) && video->rawAudio.Size() + AUDIO_DELTA < max_length) // need more data
                     continue;
                 if(error==0)
                     goto _read_pcm_buffer;
@@ -1521,28 +1757,25 @@ _read_pcm_buffer:
             if (video->update_time + 1 < currtime && check_is_stream(video->filename.c_str()))
             {
                 LOG_INFO("update_time is too old (%d seconds ago), clear buffers", currtime - video->update_time);
-                if (video->buffers.size() > 1) // keep last
-                {
-                    video->buffers.erase(video->buffers.begin(), video->buffers.begin()+video->buffers.size()-1);
-                }
-                video->audio_size = 0;
+                drop_video_frames(video, 1); // keep last
+                video->rawAudio.Clear();
             //    video->audio_adjusted = false; // need to re-adjust audio
             }
             video->update_time.store(currtime);
-            if(video->audio_size + AUDIO_DELTA >= max_length)
+            if(video->rawAudio.Size() + AUDIO_DELTA >= max_length)
                 goto _read_pcm_buffer;
             continue;
         }
         else if (packet->stream_index == video->audioStreamIndex) // audio stream
         {
-            int old_audio_size = video->audio_size;
+            int old_audio_size = video->rawAudio.Size();
             ret = decode_audio_frame(video, packet);
             av_packet_unref(packet);
             av_packet_free(&packet);
             if(ret < 0)
             {
                 error = (ret==AVERROR_EOF||ret==AVERROR(EAGAIN))? 0 : -1;
-                if(ret == AVERROR(EAGAIN) && video->audio_size + AUDIO_DELTA < max_length) // need more data
+                if(ret == AVERROR(EAGAIN) && video->rawAudio.Size() + AUDIO_DELTA < max_length) // need more data
                     continue;
                 if(error==0)
                     goto _read_pcm_buffer;
@@ -1552,13 +1785,12 @@ _read_pcm_buffer:
             if (video->update_time + 1 < currtime && check_is_stream(video->filename.c_str()))
             {
                 LOG_INFO("update_time is too old (%d seconds ago), clear buffers", currtime - video->update_time);
-                video->buffers.clear();
-                memmove(video->rawAudio.data(), video->rawAudio.data() + old_audio_size, video->audio_size - old_audio_size);
-                video->audio_size -= old_audio_size;
+                drop_video_frames(video, 0);
+                video->rawAudio.Consume(old_audio_size);
             //    video->audio_adjusted = false; // need to re-adjust audio
             }
             video->update_time.store(currtime);
-            if(video->audio_size + AUDIO_DELTA >= max_length)
+            if(video->rawAudio.Size() + AUDIO_DELTA >= max_length)
                 goto _read_pcm_buffer;
             continue; 
         }
@@ -1575,6 +1807,7 @@ int read_video_close(FFReader *&video)
     if(video)
     {
         read_video_close_only(video);
+        delete video->shmWait; // kept with the reader, it may be woken by the decoder exiting
         delete video;
         video = nullptr;
     }
@@ -1795,13 +2028,19 @@ struct RawFrame
 {
     int product_id;
     int reopen_time;
-    std::vector<unsigned char> video_data;
+    FrameBuffer video_data;
     std::vector<unsigned char> audio_data;
 };
 
+struct AVFrameFree
+{
+    void operator()(AVFrame *frame) const { av_frame_free(&frame); }
+};
+
 struct RawVFrame
 {
-    std::vector<unsigned char> video_data;
+    FrameBuffer video_data;
+    std::unique_ptr<AVFrame, AVFrameFree> frame; // decoded frame not converted yet, in lazy_convert mode
 };
 
 struct RawAFrame
@@ -1810,117 +2049,637 @@ struct RawAFrame
     std::vector<unsigned char> audio_data;
 };
 
+// bytes held by loop caches of all decoders, limited by --loop_cache_size
+static std::atomic<int64_t> loop_cache_used(0);
+
+static int64_t frame_bytes(const RawVFrame &f)
+{
+    int64_t n = f.video_data.size();
+    if (f.frame)
+    {
+        for (int i = 0; i < AV_NUM_DATA_POINTERS && f.frame->buf[i]; i++)
+            n += f.frame->buf[i]->size;
+    }
+    return n;
+}
+
+// a frame of the cache for the queue, decoded frames are referenced, converted ones copied
+static RawVFrame clone_raw_frame(const RawVFrame &f)
+{
+    RawVFrame c;
+    if (f.frame)
+        c.frame.reset(av_frame_clone(f.frame.get()));
+    else if (!f.video_data.empty())
+        c.video_data = frame_pool().Copy(f.video_data.data(), f.video_data.size());
+    return c;
+}
+
+// Frames of one pass of a looping video material, recorded as they are decoded from the start
+// of the file. Once the pass reaches EOF, they are replayed instead of reopening and decoding
+// the file again, and the reader is closed
+struct LoopCache
+{
+    std::vector<RawVFrame> video;
+    std::vector<RawAFrame> audio;
+    size_t vpos, apos; // next frames to replay
+    int64_t bytes;
+    bool recording, complete;
+    bool disabled; // over budget, not recorded again
+    SwsContext *sws; // converts frames of lazy_convert mode as they are recorded
+    int colorSpace, colorRange; // of sws
+
+    LoopCache() : vpos(0), apos(0), bytes(0), recording(false), complete(false), disabled(false),
+                  sws(NULL), colorSpace(-1), colorRange(-1) {}
+    ~LoopCache()
+    {
+        Reset();
+        if (sws)
+            sws_freeContext(sws);
+    }
+
+    void Reset()
+    {
+        video.clear();
+        audio.clear();
+        loop_cache_used -= bytes;
+        bytes = 0;
+        vpos = apos = 0;
+        recording = complete = false;
+    }
+    // record from the first frame of a freshly opened file
+    void Start()
+    {
+        Reset();
+        recording = !disabled && loop_cache_size > 0;
+    }
+    // account n more bytes, or give up recording if the budget is exceeded
+    bool Reserve(int64_t n, const std::string &name)
+    {
+        if (loop_cache_used.fetch_add(n) + n > loop_cache_size)
+        {
+            loop_cache_used -= n;
+            LOG_INFO("Warning: loop cache budget (%lld MB) is used up, %s is decoded on every loop",
+                     (long long)(loop_cache_size >> 20), name.c_str());
+            Reset();
+            disabled = true;
+            return false;
+        }
+        bytes += n;
+        return true;
+    }
+    // A decoded frame of lazy_convert mode is recorded converted to the display size, which is
+    // what is shown on every loop and takes a fraction of the decoded one. The decoded frame is
+    // kept if convert is false, for the source shared at native size, whose consumers convert
+    // it to their own sizes
+    void Record(const RawVFrame &f, FFReader *reader, bool convert)
+    {
+        if (!recording)
+            return;
+        if (!f.frame || !convert)
+        {
+            if (Reserve(frame_bytes(f), reader->filename))
+                video.push_back(clone_raw_frame(f));
+            return;
+        }
+        if (!Reserve(reader->buffersize, reader->filename))
+            return;
+        RawVFrame c;
+        c.video_data = frame_pool().Acquire(reader->buffersize);
+        if (Convert(f.frame.get(), reader, c.video_data.data()) < 0)
+        {
+            LOG_ERROR("Warning: failed to convert frames of %s for the loop cache, it is decoded on every loop",
+                      reader->filename.c_str());
+            Reset();
+            disabled = true;
+            return;
+        }
+        video.push_back(std::move(c));
+    }
+    void Record(const RawAFrame &f, const std::string &name)
+    {
+        if (recording && Reserve(f.audio_data.size(), name))
+            audio.push_back(RawAFrame{f.product_id, f.audio_data});
+    }
+    // End of the pass, cut both tracks to the shorter one, so that they wrap around together and
+    // do not drift apart over the loops. The last audio frame, cut at EOF, is padded with silence
+    void Finish(FFReader *reader)
+    {
+        recording = false;
+        if (video.size() && audio.size())
+        {
+            size_t n = std::min(video.size(), audio.size());
+            int64_t cut = 0;
+            for (size_t i = n; i < video.size(); i++)
+                cut += frame_bytes(video[i]);
+            for (size_t i = n; i < audio.size(); i++)
+                cut += audio[i].audio_data.size();
+            bytes -= cut;
+            loop_cache_used -= cut;
+            video.erase(video.begin() + n, video.end());
+            audio.erase(audio.begin() + n, audio.end());
+            std::vector<unsigned char> &last = audio.back().audio_data;
+            size_t full = n > 1? audio[n - 2].audio_data.size() : last.size();
+            if (last.size() < full)
+            {
+                bool u8 = reader->aud_samplefmt == AV_SAMPLE_FMT_U8 || reader->aud_samplefmt == AV_SAMPLE_FMT_U8P;
+                int64_t pad = full - last.size();
+                bytes += pad;
+                loop_cache_used += pad;
+                last.resize(full, u8? 0x80 : 0);
+            }
+        }
+        complete = video.size() || audio.size();
+    }
+
+private:
+    int Convert(AVFrame *frame, FFReader *reader, unsigned char *dst)
+    {
+        sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+            reader->disp_width, reader->disp_height, reader->out_pix_fmt, get_sws_flags(reader), NULL, NULL, NULL);
+        if (!sws)
+            return -1;
+#ifdef FFMPEG_DECODE_COLORSPACE
+        // not reader->colorRange, which belongs to the reading thread converting the queued frames
+        if (frame->color_range != colorRange || frame->colorspace != colorSpace)
+        {
+            set_sws_colorspace(sws, frame);
+            colorRange = frame->color_range;
+            colorSpace = frame->colorspace;
+        }
+#endif
+        return scale_video_frame(reader, sws, frame, dst);
+    }
+};
+
 class FFVideoDecodeThread;
 int cache_video_data(FFVideoDecodeThread *decoder, int frame_num);
+static void adopt_stream_info(FFReader *video, const FFReader *src);
 
-class FFVideoDecodeThread
+class FFVideoDecodeThread : public DecodeTask
 {
 public:
-    FFVideoDecodeThread() : bExit(false), bStopped(false), bEOF(false), video(NULL), runner(NULL), error_ret(0), cache_mode(AV_TOGETHER), floor_size(0)
+    FFVideoDecodeThread() : bExit(false), bStopped(false), bEOF(false), video(NULL), runner(NULL), error_ret(0), cache_mode(AV_TOGETHER), floor_size(0), lazy_sws(NULL),
+        videoQueue(queue_capacity), vQueue(queue_capacity), aQueue(queue_capacity), pooled(false), loopable(false), live(false), closed(false), filling(false), reconnecting(false), retry_at(0), last_read(0), notifier(&wake),
+        source(NULL), opened(false), standby(0), rewind(false)
     {
+        SetNotifier(&wake);
     }
     ~FFVideoDecodeThread()
     {
+        if (lazy_sws)
+            sws_freeContext(lazy_sws);
     }
-    void RUN()
+    // watermarks of the queues, cache_video_data() fills them up to max_queue_size, and then
+    // waits until they are read down to min_queue_size
+    static const int max_queue_size = 100;
+    static const int min_queue_size = max_queue_size*8/10;
+    // slots of the rings, the frames of a packet may be pushed above max_queue_size
+    static const int queue_capacity = 128;
+    // frames decoded by a slice of the decode pool, before others are given a turn
+    static const int pool_slice = 4;
+    // frames queued by a decoder on standby, the first ones shown when its product is switched to
+    static const int preroll_frames = 4;
+
+    enum StepResult
     {
-        const int max_queque_size = 100;
-        const int min_queue_size = max_queque_size*8/10;
-        while (!bExit)
+        STEP_BUSY,  // more to do right away
+        STEP_IDLE,  // wait until Runnable()
+        STEP_RETRY, // wait until retry_at
+        STEP_EXIT,  // finished
+    };
+
+    // readers taking any queue down to the low watermark wake n to decode again
+    void SetNotifier(QueueNotifier *n)
+    {
+        notifier = n;
+        videoQueue.SetNotifier(n, min_queue_size);
+        vQueue.SetNotifier(n, min_queue_size);
+        aQueue.SetNotifier(n, min_queue_size);
+    }
+
+    // end pushes blocked on a full ring
+    void WakeQueues()
+    {
+        videoQueue.Wake();
+        vQueue.Wake();
+        aQueue.Wake();
+    }
+
+    // Call f with each decoder whose queues are filled by this one, the active consumers of a
+    // shared source, or this one itself
+    template<typename F>
+    void ForSinks(F f)
+    {
+        if (source_key.empty())
         {
-            if (!bStopped && open_video_reader(video) < 0) // if open failed, try again every 1 second
+            f(this);
+            return;
+        }
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        for (auto c : consumers)
+            if (IsSink(c))
+                f(c);
+    }
+    // consumers on standby are pre-rolled only by a source on standby, a running source would
+    // leave them with stale frames
+    bool IsSink(FFVideoDecodeThread *c)
+    {
+        return !c->bStopped && !c->bExit && (!c->standby || standby);
+    }
+    // frames queued by d, a pre-rolled decoder on standby counts as full
+    int Filled(FFVideoDecodeThread *d, int n)
+    {
+        int frames = d->standby;
+        return frames && n >= frames? max_queue_size : n;
+    }
+
+    // frames in the emptiest queue filled by cache_video_data(), max_queue_size if nothing to fill
+    int Queued()
+    {
+        if (cache_mode == AV_TOGETHER)
+            return videoQueue.Size();
+        int n = max_queue_size;
+        ForSinks([&](FFVideoDecodeThread *d) { n = std::min(n, SinkQueued(d)); });
+        return n;
+    }
+    int SinkQueued(FFVideoDecodeThread *d)
+    {
+        int n = max_queue_size;
+        if (video->decode_video)
+            n = std::min(n, d->vQueue.Size());
+        if (video->decode_audio)
+            n = std::min(n, d->aQueue.Size());
+        return Filled(d, n);
+    }
+    int VideoQueued()
+    {
+        int n = max_queue_size;
+        ForSinks([&](FFVideoDecodeThread *d) { n = std::min(n, Filled(d, d->vQueue.Size())); });
+        return n;
+    }
+    int AudioQueued()
+    {
+        int n = max_queue_size;
+        ForSinks([&](FFVideoDecodeThread *d) { n = std::min(n, Filled(d, d->aQueue.Size())); });
+        return n;
+    }
+    // video frames left in the fullest queue being read, the file is rewound when all are consumed
+    int VideoLeft()
+    {
+        int n = 0;
+        ForSinks([&](FFVideoDecodeThread *d) {
+            if (!d->standby)
+                n = std::max(n, d->vQueue.Size());
+        });
+        return n;
+    }
+    // drop everything queued, on reopening the reader
+    void FlushQueues()
+    {
+        ForSinks([](FFVideoDecodeThread *d) {
+            d->videoQueue.Flush();
+            d->vQueue.Flush();
+            d->aQueue.Flush();
+            d->reopen_time.store(time(NULL));
+        });
+    }
+    void SetError(int ret)
+    {
+        error_ret = ret;
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        for (auto c : consumers)
+            c->error_ret = ret;
+    }
+
+    // Step() has something to do
+    bool Runnable()
+    {
+        if (bExit)
+            return true;
+        if (retry_at)
+            return steady_ms() >= retry_at;
+        if (bStopped || video == NULL)
+            return bStopped && !closed;
+        if (rewind)
+            return true;
+        if (bEOF) // normal videos rewind when all frames are consumed, not while on standby
+            return !standby && (cache_mode != AV_STREAMING || live || VideoLeft() == 0);
+        return filling || Queued() <= min_queue_size;
+    }
+
+    // when the reader runs out of frames, at the rate it has been reading them, the earliest
+    // of all consumers of a shared source
+    int64_t Deadline()
+    {
+        if (bExit || bStopped || video == NULL || bEOF)
+            return 0;
+        if (standby) // pre-rolled when no decoder being read needs the pool
+            return INT64_MAX;
+        double fps = video->fps < 1.0? 25.0 : video->fps;
+        int64_t deadline = INT64_MAX;
+        ForSinks([&](FFVideoDecodeThread *d) {
+            deadline = std::min(deadline, d->last_read + (int64_t)(SinkQueued(d) * 1000.0 / fps));
+        });
+        return deadline;
+    }
+
+    bool Run()
+    {
+        return Step(pool_slice) != STEP_EXIT;
+    }
+
+    // One round of decoding, fills the queues by up to slice frames, or up to max_queue_size if 0.
+    // Called by RUN() of the own thread, or by Run() in the decode pool
+    StepResult Step(int slice)
+    {
+        if (bExit)
+            return STEP_EXIT;
+        if (retry_at)
+        {
+            if (steady_ms() < retry_at)
+                return STEP_RETRY;
+            retry_at = 0;
+        }
+        if (rewind.exchange(false)) // put on standby, pre-roll from the beginning as if reopened
+        {
+            read_video_close_only(video);
+            FlushQueues();
+            loop.vpos = loop.apos = 0;
+            bEOF.store(false);
+        }
+        if (!bStopped && !loop.complete) // frames of a cached loop are replayed without the reader
+        {
+            bool fresh = video && !video->formatCtx;
+            if (open_video_reader(video) < 0) // if open failed, try again every 1 second
             {
-                videoQueue.Clear();
-                vQueue.Clear();
-                aQueue.Clear();
-                reopen_time.store(time(NULL));
-                for(auto i=0; !bExit && i<10; i++)
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
+                FlushQueues();
+                retry_at = steady_ms() + 1000;
+                return STEP_RETRY;
             }
-            if (bStopped || video==NULL)
+            if (fresh && loopable)
+                loop.Start();
+            if (fresh && !opened)
+                Opened();
+        }
+        if (bStopped || video==NULL)
+        {
+            if (bStopped && !closed)
             {
-                if (bExit) // exit only when queue is empty
-                    break;
-                if (bStopped)
+                read_video_close_only(video);
+                FlushQueues();
+                loop.vpos = loop.apos = 0; // restarted from the beginning, as reopened files are
+                closed = true;
+            }
+            return STEP_IDLE; // woken by START/EXIT
+        }
+        closed = false;
+        if (!bEOF)
+        {
+            int target = slice? std::min(max_queue_size, Queued() + slice) : max_queue_size;
+            int ret = loop.complete? ReplayLoop(target) : cache_video_data(this, target);
+            if (ret < 0)
+            {
+                if (cache_mode != AV_STREAMING)
                 {
-                    read_video_close_only(video);
-                    videoQueue.Clear();
-                    vQueue.Clear();
-                    aQueue.Clear();
-                    reopen_time.store(time(NULL));
+                    // should report it
+                    SetError(ret);
+                    return STEP_EXIT;
                 }
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                continue;
+                // for streaming, we will always retry
+                bEOF.store(true);
             }
+            // when queues are full, wait until they are read down to the low watermark
             if (!bEOF)
             {
-                int ret = cache_video_data(this, max_queque_size);
-                if (ret < 0)
-                {
-                    if (cache_mode != AV_STREAMING)
-                    {
-                        // should report it
-                        error_ret = ret;
-                        break;
-                    }
-                    // for streaming, we will always retry
-                    bEOF.store(true);
-                }
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                filling = !bExit && Queued() < max_queue_size;
+                return filling? STEP_BUSY : STEP_IDLE;
             }
-            if (bEOF)
+        }
+        filling = false;
+        if (standby) // shorter than the pre-roll, rewound once read
+            return STEP_IDLE;
+        if (cache_mode != AV_STREAMING) // for normal video, exit when EOF occurs
+        {
+            LOG_INFO("Video decoder thread exit on EOF, file: %s", video->filename.c_str());
+            return STEP_EXIT;
+        }
+        if (live)
+        {
+            // may be camera is down, wait 1s and try again
+            if (!reconnecting)
             {
-                if (cache_mode == AV_STREAMING)
-                {
-                    if (check_is_stream(video->filename.c_str()))
-                    {
-                        // may be camera is down, sleep 1s and try again
-                        for(auto i=0; !bExit && i<10; i++)
-                            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                        LOG_ERROR("Warning: stream %s is down, reconnecting...", video->filename.c_str());
-                    }
-                    else // normal video, wait until all frames are consumned
-                    {
-                        while (!bExit && vQueue.Size() > 0)
-                        {
-                            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                        }
-                        LOG_DEBUG("%s %s is EOF, rewinding", video->decode_video? "Video" : "Audio", video->filename.c_str());
-                    }
-                    if(bExit)
-                        break;
-                    int ret = reopen_video_reader(video);
-                    if (ret == 0)
-                    {
-                        videoQueue.Clear();
-                        vQueue.Clear();
-                        aQueue.Clear();
-                        reopen_time.store(time(NULL));
-                        bEOF.store(false); // try again
-                    }
-                }
-                else // for normal video, exit when EOF occurs
-                {
-                    LOG_INFO("Video decoder thread exit on EOF, file: %s", video->filename.c_str());
-                    break;
-                }
+                reconnecting = true;
+                retry_at = steady_ms() + 1000;
+                return STEP_RETRY;
             }
+            reconnecting = false;
+            LOG_ERROR("Warning: stream %s is down, reconnecting...", video->filename.c_str());
+        }
+        else if (loop.recording) // end of the first pass, replay it from now on
+        {
+            loop.Finish(video);
+            if (loop.complete)
+            {
+                LOG_INFO("Loop of %s is cached, %d video frames, %d audio frames, %lld KB", video->filename.c_str(),
+                         (int)loop.video.size(), (int)loop.audio.size(), (long long)(loop.bytes >> 10));
+                read_video_close_only(video); // the demuxer and decoder are not needed any more
+                bEOF.store(false);
+                return STEP_BUSY;
+            }
+        }
+        if (!live) // normal video, wait until all frames are consumned
+        {
+            if (VideoLeft() > 0)
+                return STEP_IDLE;
+            LOG_DEBUG("%s %s is EOF, rewinding", video->decode_video? "Video" : "Audio", video->filename.c_str());
+        }
+        int ret = reopen_video_reader(video);
+        if (ret == 0)
+        {
+            FlushQueues();
+            bEOF.store(false); // try again
+        }
+        else if (!live)
+        {
+            retry_at = steady_ms() + 1000;
+            return STEP_RETRY;
+        }
+        return STEP_BUSY;
+    }
+
+    // push frames of the cached loop until the queues hold target frames, wrapping around
+    int ReplayLoop(int target)
+    {
+        while (!bExit)
+        {
+            bool pushed = false;
+            if (loop.video.size() && VideoQueued() < target)
+            {
+                DeliverVideo(clone_raw_frame(loop.video[loop.vpos]));
+                loop.vpos = (loop.vpos + 1) % loop.video.size();
+                pushed = true;
+            }
+            if (loop.audio.size() && AudioQueued() < target)
+            {
+                const RawAFrame &a = loop.audio[loop.apos];
+                DeliverAudio(RawAFrame{a.product_id, a.audio_data});
+                loop.apos = (loop.apos + 1) % loop.audio.size();
+                pushed = true;
+            }
+            if (!pushed)
+                break;
+        }
+        return 0;
+    }
+    // queue a decoded frame, recording it if the loop is being cached
+    void PushVideo(RawVFrame &&f)
+    {
+        loop.Record(f, video, !NativeSource());
+        DeliverVideo(std::move(f));
+    }
+    void PushAudio(RawAFrame &&f)
+    {
+        loop.Record(f, video->filename);
+        DeliverAudio(std::move(f));
+    }
+    // a shared source decoding at native size, its consumers convert frames to their own sizes
+    bool NativeSource() const
+    {
+        return !source_key.empty() && video->lazy_convert && video->decode_reduce == DR_FULL;
+    }
+    // A shared source pushes a reference (lazy_convert) or a copy of each frame to every active
+    // consumer, the last one takes the frame itself. Pushes do not block under the lock, a
+    // consumer whose queue is full misses the frame, as it is not reading anyway
+    void DeliverVideo(RawVFrame &&f)
+    {
+        if (source_key.empty())
+        {
+            vQueue.PushMove(std::move(f));
+            return;
+        }
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        FFVideoDecodeThread *last = NULL;
+        for (auto c : consumers)
+        {
+            if (!IsSink(c) || (c->standby && c->vQueue.Size() >= c->standby))
+                continue;
+            if (last)
+                last->vQueue.TryPushMove(clone_raw_frame(f));
+            last = c;
+        }
+        if (last)
+            last->vQueue.TryPushMove(std::move(f));
+    }
+    void DeliverAudio(RawAFrame &&f)
+    {
+        if (source_key.empty())
+        {
+            aQueue.PushMove(std::move(f));
+            return;
+        }
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        FFVideoDecodeThread *last = NULL;
+        for (auto c : consumers)
+        {
+            if (!IsSink(c) || (c->standby && c->aQueue.Size() >= c->standby))
+                continue;
+            if (last)
+                last->aQueue.TryPushMove(RawAFrame{f.product_id, f.audio_data});
+            last = c;
+        }
+        if (last)
+            last->aQueue.TryPushMove(std::move(f));
+    }
+
+    // the reader of a shared source is opened, its consumers learn the stream info
+    void Opened()
+    {
+        opened = true;
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        for (auto c : consumers)
+            adopt_stream_info(c->video, video);
+    }
+    void AddConsumer(FFVideoDecodeThread *c)
+    {
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        consumers.push_back(c);
+        c->source = this;
+        if (opened)
+            adopt_stream_info(c->video, video);
+    }
+    // return the number of consumers left
+    int RemoveConsumer(FFVideoDecodeThread *c)
+    {
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        consumers.erase(std::remove(consumers.begin(), consumers.end(), c), consumers.end());
+        c->source = NULL;
+        return consumers.size();
+    }
+    bool HasActiveConsumer()
+    {
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        for (auto c : consumers)
+            if (!c->bStopped && !c->bExit && !c->standby)
+                return true;
+        return false;
+    }
+    bool HasStandbyConsumer()
+    {
+        std::lock_guard<std::mutex> lk(consumers_mutex);
+        for (auto c : consumers)
+            if (!c->bStopped && !c->bExit && c->standby)
+                return true;
+        return false;
+    }
+
+    void RUN()
+    {
+        while (true)
+        {
+            StepResult r = Step(0);
+            if (r == STEP_EXIT)
+                break;
+            if (r == STEP_RETRY)
+                wake.Wait([this] { return bExit || steady_ms() >= retry_at; }, 1000);
+            else if (r == STEP_IDLE)
+                wake.Wait([this] { return Runnable(); }, 100);
         }
     }
 
     void STOP(bool force = false)
     {
         bStopped.store(true);
+        standby.store(0);
+        notifier->Notify();
+        WakeQueues();
         if (force)
-        {
-            videoQueue.Clear();
-            vQueue.Clear();
-            aQueue.Clear();
-            last_frame.audio_data.clear();
-            last_frame.video_data.clear();
-            last_frame.product_id = 0;
-        }
+            ClearQueues();
+    }
+    // drop the frames queued and the last one shown, by the reading thread
+    void ClearQueues()
+    {
+        videoQueue.Clear();
+        vQueue.Clear();
+        aQueue.Clear();
+        last_frame.audio_data.clear();
+        last_frame.video_data.clear();
+        last_frame.product_id = 0;
+        skipped = RawVFrame();
+    }
+    // Keep the reader opened with frames pre-rolled from the beginning, which are not read
+    // until START(), see standby_video_decoder_thread()
+    void STANDBY(FFReader *writer, CacheMode mode, int floor, int frames)
+    {
+        if (standby && !bStopped)
+            return;
+        if (!bStopped) // switched away, drop what was being shown
+            ClearQueues();
+        standby.store(frames);
+        rewind.store(!source);
+        if (bStopped)
+            START(writer, mode, floor);
+        else
+            notifier->Notify();
     }
     void INIT(FFReader *writer, CacheMode mode, int floor)
     {
@@ -1934,17 +2693,44 @@ public:
         last_frame.reopen_time = 0;
         last_frame.audio_data.clear();
         last_frame.video_data.clear();
+        skipped = RawVFrame();
         reopen_time = 0;
+        if (source) // frames are pushed by the source, readers taking them wake it
+        {
+            pooled = false;
+            SetNotifier(source->notifier);
+            notifier->Notify();
+            return;
+        }
+        live = video && !video->fraw && !video->fshm && check_is_stream(video->filename.c_str());
+        // files of materials share the decode pool, live streams and raw inputs block on reading,
+        // and the main video is decoded ahead by a standalone thread
+        pooled = video && mode == AV_STREAMING && !live && !video->fraw && !video->fshm;
+        loopable = pooled; // files of materials loop
+        if (video)
+            video->codec_threads = pooled? 1 : decode_pool().Threads();
+        SetNotifier(pooled? &decode_pool().wake : &wake);
+        notifier->Notify();
     }
     void START(FFReader *writer, CacheMode mode, int floor)
     {
         INIT(writer, mode, floor);
-        if (runner == NULL)
+        if (source)
+            return;
+        if (pooled)
+            decode_pool().Add(this);
+        else if (runner == NULL)
             runner = new std::thread(&FFVideoDecodeThread::RUN, this);
     }
     void EXIT(bool force = false)
     {
         bExit.store(true);
+        notifier->Notify();
+        WakeQueues();
+        if (video && video->shmWait) // blocked waiting for the shm writer
+            video->shmWait->Wake();
+        if (pooled)
+            decode_pool().Remove(this, force);
         if (force)
         {
             videoQueue.Clear();
@@ -1955,7 +2741,7 @@ public:
         }
         else
         {
-            if(runner->joinable())
+            if(runner && runner->joinable())
             {
                 runner->join();
             }
@@ -1965,9 +2751,6 @@ public:
     }
 public:
     std::atomic_bool bStopped, bExit, bEOF;
-    SafeQueue<struct RawFrame> videoQueue; // for multi-threaded reading
-    SafeQueue<struct RawVFrame> vQueue;
-    SafeQueue<struct RawAFrame> aQueue;
     FFReader *video;
     std::thread *runner;
     int error_ret;
@@ -1975,51 +2758,291 @@ public:
     int floor_size;
     struct RawFrame last_frame; // if no data available, display last frame
     std::atomic_int32_t reopen_time;
+    RawVFrame skipped; // last frame skipped by read_thread_stream_skip_frame(), shown if no newer one arrives
+    SwsContext *lazy_sws; // converts frames of lazy_convert mode in the reading thread
+    // filled by the decoder, read by the thread of read_thread_*(), the decoder drops frames with Flush()
+    SpscQueue<struct RawFrame> videoQueue; // for multi-threaded reading
+    SpscQueue<struct RawVFrame> vQueue;
+    SpscQueue<struct RawAFrame> aQueue;
+    bool pooled; // decoded by decode_pool() instead of runner
+    bool loopable; // rewinds on EOF, the loop may be cached
+    LoopCache loop;
+    bool live; // network stream, reconnected when it is down
+    bool closed; // reader closed since stopped
+    bool filling; // queues are filled up to max_queue_size, after reaching the low watermark
+    bool reconnecting;
+    std::atomic<int64_t> retry_at; // steady_ms() to try opening again, 0 if not failed
+    std::atomic<int64_t> last_read; // steady_ms() of the last frame read, for Deadline()
+    QueueNotifier wake; // wakes RUN() on room in queues and on START/STOP/EXIT
+    QueueNotifier *notifier; // wake, or the pool's if pooled
+    // Readers of the same source share one decoder, see start_video_decoder_thread(). The source
+    // is a hidden decoder of its own reader, the consumers are the decoders of the materials,
+    // they are never run and only hold the queues the source fills
+    FFVideoDecodeThread *source; // of a consumer
+    std::string source_key; // of a source, its key in the registry
+    std::vector<FFVideoDecodeThread*> consumers; // of a source
+    std::mutex consumers_mutex;
+    bool opened; // the reader of a source has been opened, its stream info is known
+    std::atomic_int standby; // frames to pre-roll while the product is not shown, 0 if not on standby
+    std::atomic_bool rewind; // close the reader and flush the queues before pre-rolling
 
 } ffVideoDecodeThread;
 
 std::map<FFReader*, FFVideoDecodeThread*> decodermap;
 
-// main video use a standalone thread
-int start_video_decoder_thread(FFReader *video, CacheMode mode, int floor)
+// decoders of sources read by more than one material, by source_key()
+static std::mutex source_mutex;
+static std::map<std::string, FFVideoDecodeThread*> sources;
+
+// key of the readers sharing one decoder, the normalized path and what they decode into,
+// frames of lazy_convert mode are converted by each reader at its own display size
+static std::string source_key(FFReader *video)
 {
-    if (video == NULL)
-        return 0;
+    char path[PATH_MAX];
+    std::string key = !check_is_stream(video->filename.c_str()) && realpath(video->filename.c_str(), path)? path : video->filename;
+    char params[128];
+    snprintf(params, sizeof(params), "|v%d|a%d|%d|%d|%d|%lld|r%d", video->decode_video, video->decode_audio, video->out_pix_fmt,
+             video->aud_samplefmt, video->aud_channel, (long long)video->aud_bitrate, video->decode_reduce);
+    key += params;
+    if (!video->decode_video) // audio is cut into frames of the reader's fps
+    {
+        snprintf(params, sizeof(params), "|%.3f", video->fps);
+        key += params;
+    }
+    else if (!video->lazy_convert || video->decode_reduce != DR_FULL) // reduced for the display size
+    {
+        snprintf(params, sizeof(params), "|%dx%d|%s", video->disp_width, video->disp_height, video->scale_prefer? video->scale_prefer : "");
+        key += params;
+    }
+    return key;
+}
 
-    auto it = decodermap.find(video);
-    if (it == decodermap.end())
+// stream info of a reader read through a shared source, as if it had opened the file itself
+static void adopt_stream_info(FFReader *video, const FFReader *src)
+{
+    if (video->width) // adopted already
+        return;
+    video->width = src->width;
+    video->height = src->height;
+    video->pix_fmt = src->pix_fmt;
+    video->fps = src->fps;
+    video->rotation = src->rotation;
+    video->bitrate = src->bitrate;
+    video->totaltime = src->totaltime;
+    video->video_timebase = src->video_timebase;
+    video->audio_timebase = src->audio_timebase;
+    video->decode_audio = src->decode_audio;
+    if (video->disp_width > 0 && video->disp_height > 0)
+    {
+        if (fabs(video->rotation - 90.0) < 1.0 || fabs(video->rotation - 270.0) < 1.0)
+            std::swap(video->disp_width, video->disp_height);
+    }
+    else
     {
-        FFVideoDecodeThread *decoder = new FFVideoDecodeThread;
-        decodermap[video] = decoder;
-        decoder->START(video, mode, floor);
+        video->disp_width = video->width;
+        video->disp_height = video->height;
+    }
+    set_display_layout(video);
+}
+
+// attach the decoder of a material to the shared decoder of its source, creating it for the
+// first reader, return NULL if it can not be created
+static FFVideoDecodeThread *attach_source(FFVideoDecodeThread *decoder, FFReader *video, CacheMode mode, int floor)
+{
+    std::lock_guard<std::mutex> lk(source_mutex);
+    if (decoder->source)
+        return decoder->source;
+    std::string key = source_key(video);
+    auto it = sources.find(key);
+    FFVideoDecodeThread *src = NULL;
+    if (it == sources.end())
+    {
+        bool native = video->lazy_convert && video->decode_reduce == DR_FULL;
+        FFReader *reader = new_video_reader(video->filename.c_str(), video->decode_video, video->decode_audio,
+                                            native? 0 : video->disp_width, native? 0 : video->disp_height,
+                                            video->scale_prefer, video->out_pix_fmt, video->aud_samplefmt, video->aud_channel, video->aud_bitrate);
+        if (reader == NULL)
+            return NULL;
+        reader->fps = video->fps;
+        reader->lazy_convert = video->lazy_convert;
+        reader->decode_reduce = video->decode_reduce;
+        src = new FFVideoDecodeThread;
+        src->source_key = key;
+        src->INIT(reader, mode, floor);
+        src->STOP(true); // started by its first active consumer
+        sources[key] = src;
     }
     else
     {
-        it->second->START(video, mode, floor);
+        src = it->second;
+        LOG_INFO("Sharing the decoder of %s", video->filename.c_str());
     }
+    src->AddConsumer(decoder);
+    return src;
+}
+
+// run the source while any of its consumers is started, pre-roll it while they are on standby,
+// called under source_mutex
+static void run_source(FFVideoDecodeThread *src)
+{
+    if (src->HasActiveConsumer())
+    {
+        src->standby.store(0);
+        if (src->bStopped)
+            src->START(src->video, src->cache_mode, src->floor_size);
+        else
+            src->notifier->Notify();
+    }
+    else if (src->HasStandbyConsumer())
+        src->STANDBY(src->video, src->cache_mode, src->floor_size, FFVideoDecodeThread::preroll_frames);
+    else if (!src->bStopped)
+        src->STOP(true);
+}
+
+static void update_source(FFVideoDecodeThread *decoder)
+{
+    std::lock_guard<std::mutex> lk(source_mutex);
+    if (decoder->source)
+        run_source(decoder->source);
+}
+
+// detach the decoder of a material from its source, which is closed with its last consumer
+static void detach_source(FFVideoDecodeThread *decoder, bool force)
+{
+    std::lock_guard<std::mutex> lk(source_mutex);
+    FFVideoDecodeThread *src = decoder->source;
+    if (src == NULL)
+        return;
+    if (src->RemoveConsumer(decoder) > 0)
+    {
+        run_source(src);
+        return;
+    }
+    sources.erase(src->source_key);
+    src->EXIT(force);
+    // if force, will return quickly without freeing resources
+    if (!force)
+    {
+        read_video_close(src->video);
+        delete src;
+    }
+}
+
+// files of materials, decoded by the decode pool
+static bool pooled_reader(FFReader *video, CacheMode mode)
+{
+    return mode == AV_STREAMING && !video->fraw && !video->fshm && !check_is_stream(video->filename.c_str());
+}
+
+// files and live streams of materials are shared by materials of the same source (e.g. the same
+// background video in every product), which are consumers of one decoder, see attach_source().
+// Raw inputs (fifos, stdin and shm://) are not, their fifo or shm queue is opened with the reader,
+// and a second reader of it would take frames away from the first one instead of seeing them too
+static bool share_source(FFReader *video, CacheMode mode)
+{
+    return enable_source_sharing && mode == AV_STREAMING && !video->fraw && !video->fshm;
+}
+
+static FFVideoDecodeThread *get_decoder(FFReader *video, CacheMode mode, int floor)
+{
+    auto it = decodermap.find(video);
+    if (it != decodermap.end())
+        return it->second;
+    // frames of streaming mode are often dropped by catching up, only those read are converted
+    video->lazy_convert = (enable_lazy_convert && mode == AV_STREAMING && video->decode_video && !video->fraw && !video->fshm);
+
+    FFVideoDecodeThread *decoder = new FFVideoDecodeThread;
+    decodermap[video] = decoder;
+    if (share_source(video, mode))
+        attach_source(decoder, video, mode, floor);
+    return decoder;
+}
+
+// main video and live streams use a standalone thread each, files of materials share the decode pool,
+// a file or live stream read by several materials is decoded once for all of them
+int start_video_decoder_thread(FFReader *video, CacheMode mode, int floor)
+{
+    if (video == NULL)
+        return 0;
+
+    FFVideoDecodeThread *decoder = get_decoder(video, mode, floor);
+    if (decoder->standby) // the frames pre-rolled are read at once
+    {
+        // unless the source has moved on, decoding for other materials
+        FFVideoDecodeThread *src = decoder->source;
+        if (src && !src->bStopped && !src->standby)
+            decoder->ClearQueues();
+        decoder->standby.store(0);
+    }
+    decoder->START(video, mode, floor);
+    update_source(decoder);
     return 0;
 }
 
-int stop_video_decoder_thread(FFReader *video, CacheMode mode, int floor)
+// Files are opened and pre-rolled by the decode pool at the lowest priority, other readers (live
+// streams, raw inputs) are stopped as they would fall behind
+int standby_video_decoder_thread(FFReader *video, CacheMode mode, int floor)
 {
     if (video == NULL)
         return 0;
+    if (!pooled_reader(video, mode))
+        return stop_video_decoder_thread(video, mode, floor);
 
-    auto it = decodermap.find(video);
-    if (it == decodermap.end())
+    FFVideoDecodeThread *decoder = get_decoder(video, mode, floor);
+    decoder->STANDBY(video, mode, floor, FFVideoDecodeThread::preroll_frames);
+    update_source(decoder);
+    return 0;
+}
+
+// Frames pre-rolled, and those held by the codec (references and frame threads), at the source
+// size if known. Consumers of a shared source are counted as if decoding on their own
+int64_t standby_video_bytes(FFReader *video)
+{
+    static const int codec_frames = 6;
+    if (video == NULL || !pooled_reader(video, AV_STREAMING))
+        return 0;
+    int64_t bytes = 0;
+    if (video->decode_video)
     {
-        FFVideoDecodeThread *decoder = new FFVideoDecodeThread;
-        decodermap[video] = decoder;
-        decoder->INIT(video, mode, floor);
-        decoder->STOP(true);
+        int w = video->width > 0? video->width : video->disp_width;
+        int h = video->height > 0? video->height : video->disp_height;
+        if (w <= 0 || h <= 0)
+            w = 1920, h = 1080;
+        int64_t yuv = (int64_t)w * h * 3 / 2;
+        int64_t frame = video->lazy_convert || video->buffersize <= 0? yuv : video->buffersize;
+        bytes += codec_frames * yuv + FFVideoDecodeThread::preroll_frames * frame;
     }
-    else
+    if (video->decode_audio)
     {
-        it->second->STOP(true);
+        double fps = video->fps < 1.0? 25.0 : video->fps;
+        bytes += (int64_t)(FFVideoDecodeThread::preroll_frames * video->aud_bitrate * 2 * video->aud_channel / fps);
     }
+    return bytes;
+}
+
+int stop_video_decoder_thread(FFReader *video, CacheMode mode, int floor)
+{
+    if (video == NULL)
+        return 0;
+
+    bool created = decodermap.find(video) == decodermap.end();
+    FFVideoDecodeThread *decoder = get_decoder(video, mode, floor);
+    if (created)
+        decoder->INIT(video, mode, floor);
+    decoder->STOP(true);
+    update_source(decoder);
     return 0;
 }
 
+// move the frame read by read_video_frame() into data, unconverted in lazy_convert mode
+static void take_video_frame(FFReader *video, std::vector<unsigned char> *buffer, RawVFrame &data)
+{
+    if (video->lazy_convert)
+        data.frame.reset(take_decoded_frame(video));
+    else
+        data.video_data = take_frame_buffer(video, buffer);
+}
+
 int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
 {
     FFReader *video = decoder->video;
@@ -2037,7 +3060,7 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
     {
         while (!decoder->bExit && decoder->videoQueue.Size() < frame_num)
         {
-            struct RawFrame data = {0, 0, std::vector<unsigned char>(), std::vector<unsigned char>()};
+            struct RawFrame data = {0, 0, FrameBuffer(), std::vector<unsigned char>()};
             std::vector<unsigned char> *buffer = NULL;
             int ret = read_video_frame(video, &buffer);
             if (ret < 0)
@@ -2046,7 +3069,7 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
             }
 
             if (buffer)
-                data.video_data = *buffer;
+                data.video_data = take_frame_buffer(video, buffer);
 
             if (video->decode_audio && (video->decode_video==false || data.video_data.size()))
             {
@@ -2090,27 +3113,28 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
     {
         int old_updatetime = video->update_time;
         bool has_data = false;
-        if (video->decode_video && decoder->vQueue.Size() < frame_num)
+        if (video->decode_video && decoder->VideoQueued() < frame_num)
         {
-            if (video->buffers.size())
+            if (pending_video_frames(video))
             {
                 do
                 {
-                    struct RawVFrame data = {std::vector<unsigned char>()};
+                    struct RawVFrame data;
                     std::vector<unsigned char> *buffer = NULL;
                     int ret = read_video_frame(video, &buffer);
                     if (ret < 0)
                         return ret;
                     if (!buffer)
                         break;
-                    data.video_data = *buffer;
-                    decoder->vQueue.PushMove(std::move(data));
+                    take_video_frame(video, buffer, data);
+                    decoder->PushVideo(std::move(data));
                 }
-                while (video->buffers.size());
+                // the rest is left in the reader, key frames of keyframe_only mode come with many copies
+                while (pending_video_frames(video) && decoder->VideoQueued() < frame_num);
             }
             else
             {
-                struct RawVFrame data = {std::vector<unsigned char>()};
+                struct RawVFrame data;
                 std::vector<unsigned char> *buffer = NULL;
                 int ret = read_video_frame(video, &buffer);
                 if (ret < 0)
@@ -2121,16 +3145,14 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
                 if (decoder->cache_mode == AV_STREAMING && old_updatetime + 1 < video->update_time)
                 {
                     LOG_INFO("Warning: waited too long (%d seconds) for reading a frame, reset buffers", video->update_time - old_updatetime);
-                    decoder->vQueue.Clear();
-                    decoder->aQueue.Clear();
-                    decoder->reopen_time = time(NULL);
+                    decoder->FlushQueues();
                     old_updatetime = video->update_time;
                 }
 
                 if (buffer)
                 {
-                    data.video_data = *buffer;
-                    decoder->vQueue.PushMove(std::move(data));
+                    take_video_frame(video, buffer, data);
+                    decoder->PushVideo(std::move(data));
                 }
                 else
                 {
@@ -2141,9 +3163,9 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
             has_data = true;
         }
 
-        if (video->decode_audio && decoder->aQueue.Size() < frame_num)
+        if (video->decode_audio && decoder->AudioQueued() < frame_num)
         {
-            int avail_frames = (int)(video->audio_size / audio_per_frame);
+            int avail_frames = (int)(video->rawAudio.Size() / audio_per_frame);
             if (avail_frames)
             {
                 for (int i=0; i < avail_frames; i++)
@@ -2161,7 +3183,7 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
                     data.product_id = video->product_id;
                     int sz = data.audio_data.size();
                     if (sz)
-                        decoder->aQueue.PushMove(std::move(data));
+                        decoder->PushAudio(std::move(data));
                     if (sz < wanted) // not enough data
                         break;
                 }
@@ -2181,15 +3203,13 @@ int cache_video_data(FFVideoDecodeThread *decoder, int frame_num)
                 if (decoder->cache_mode == AV_STREAMING && old_updatetime + 1 < video->update_time)
                 {
                     LOG_INFO("Warning: waited too long (%d seconds) for reading audio frame, reset buffers", video->update_time - old_updatetime);
-                    decoder->vQueue.Clear();
-                    decoder->aQueue.Clear();
-                    decoder->reopen_time = time(NULL);
+                    decoder->FlushQueues();
                     recv_audio_bytes_f = 0.0;
                     recv_audio_bytes_i = 0.0;
                 }
                 data.product_id = video->product_id;
                 if (data.audio_data.size())
-                    decoder->aQueue.PushMove(std::move(data));
+                    decoder->PushAudio(std::move(data));
                 else if (!video->decode_video)
                 {
                     decoder->bEOF.store(true);
@@ -2231,7 +3251,8 @@ int read_thread_merge_data(FFReader *video, std::vector<unsigned char> &vdata, s
         RawFrame raw;
         if (decoder->videoQueue.PopMove(raw, timeout_sec? 1000 : 0))
         {
-            vdata = std::move(raw.video_data);
+            // the caller's previous frame is done with, it goes back to the pool with raw
+            vdata.swap(raw.video_data.vec());
             adata = std::move(raw.audio_data);
             product_id = raw.product_id;
             return 0;
@@ -2277,7 +3298,7 @@ int read_thread_separate_video_frame(FFReader *video, std::vector<unsigned char>
         RawVFrame raw;
         if (decoder->vQueue.PopMove(raw, timeout_sec? 1000 : 0))
         {
-            buffer = std::move(raw.video_data);
+            buffer.swap(raw.video_data.vec());
             return 0;
         }
 
@@ -2344,6 +3365,56 @@ int read_thread_separate_audio_frame(FFReader *video, std::vector<unsigned char>
     return 1;
 }
 
+// convert the frame kept by raw in lazy_convert mode into raw.video_data, at display size
+static int convert_raw_frame(FFVideoDecodeThread *decoder, RawVFrame &raw)
+{
+    if (!raw.frame)
+        return 0;
+    AUTOTIMED("[lazy] convert frame", STAT_RUNTIME);
+    FFReader *video = decoder->video;
+    AVFrame *frame = raw.frame.get();
+    decoder->lazy_sws = sws_getCachedContext(decoder->lazy_sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+        video->disp_width, video->disp_height, video->out_pix_fmt, get_sws_flags(video), NULL, NULL, NULL);
+    if (!decoder->lazy_sws)
+    {
+        LOG_ERROR("sws_getCachedContext failed for %s", video->filename.c_str());
+        raw.frame.reset();
+        return -1;
+    }
+    FrameBuffer converted = frame_pool().Acquire(video->buffersize);
+    int ret = convert_video_frame(video, decoder->lazy_sws, frame, converted.data());
+    raw.frame.reset();
+    if (ret < 0)
+        return ret;
+    frame_pool().CountFrame();
+    raw.video_data = std::move(converted);
+    return 0;
+}
+
+int read_thread_stream_skip_frame(FFReader *video)
+{
+    auto it = decodermap.find(video);
+    if (it == decodermap.end()) // not started?
+    {
+        LOG_ERROR("Error: video is not in decoder map, make sure it is started by start_video_decoder_thread.");
+        return -1;
+    }
+    FFVideoDecodeThread *decoder = it->second;
+    decoder->last_read = steady_ms();
+
+    RawVFrame raw;
+    while (decoder->vQueue.PopMove(raw, 0))
+    {
+        if (raw.video_data.empty() && !raw.frame) // no video in frame
+            continue;
+        decoder->skipped = std::move(raw);
+        return 1;
+    }
+    if (decoder->error_ret)
+        return decoder->error_ret;
+    return 0;
+}
+
 int read_thread_stream_video_frame(FFReader *video, std::vector<unsigned char> **buffer)
 {
     auto it = decodermap.find(video);
@@ -2353,8 +3424,9 @@ int read_thread_stream_video_frame(FFReader *video, std::vector<unsigned char> *
         return -1;
     }
     FFVideoDecodeThread *decoder = it->second;
+    decoder->last_read = steady_ms();
 
-    LOG_DEBUG("vQueue size %d, aQueue size %d, floor %d, video->vbufsiz %d, video->abufsize %d", decoder->vQueue.Size(), decoder->aQueue.Size(), decoder->floor_size, video->buffers.size(), video->audio_size);
+    LOG_DEBUG("vQueue size %d, aQueue size %d, floor %d, video->vbufsiz %d, video->abufsize %d", decoder->vQueue.Size(), decoder->aQueue.Size(), decoder->floor_size, video->buffers.size(), video->rawAudio.Size());
     if (decoder->floor_size > 0 && decoder->vQueue.Size() >= decoder->floor_size)
     {
         if (video->decode_audio)
@@ -2388,22 +3460,33 @@ int read_thread_stream_video_frame(FFReader *video, std::vector<unsigned char> *
     RawVFrame raw;
     while (decoder->vQueue.PopMove(raw, 0))
     {
-        if (raw.video_data.empty()) // no video in frame
+        if (raw.video_data.empty() && !raw.frame) // no video in frame
             continue;
 
+        decoder->skipped = RawVFrame(); // older than this one
+        if (convert_raw_frame(decoder, raw) < 0)
+            continue;
         decoder->last_frame.video_data = std::move(raw.video_data);
-        *buffer = &decoder->last_frame.video_data;
+        *buffer = &decoder->last_frame.video_data.vec();
         return 0;
     }
 
     if (decoder->error_ret)
         return decoder->error_ret;
+    // nothing newer arrived, the frame skipped last is shown instead of the one before it
+    if (!decoder->skipped.video_data.empty() || decoder->skipped.frame)
+    {
+        raw = std::move(decoder->skipped);
+        decoder->skipped = RawVFrame();
+        if (convert_raw_frame(decoder, raw) == 0)
+            decoder->last_frame.video_data = std::move(raw.video_data);
+    }
     if (decoder->last_frame.video_data.empty())
     {
         *buffer = NULL;
         return 0;
     }
-    *buffer = &decoder->last_frame.video_data;
+    *buffer = &decoder->last_frame.video_data.vec();
     return 0;
 }
 
@@ -2416,6 +3499,7 @@ int read_thread_stream_audio_frame(FFReader *video, std::vector<unsigned char> &
         return -1;
     }
     FFVideoDecodeThread *decoder = it->second;
+    decoder->last_read = steady_ms();
 
     if (!decoder->video->decode_audio) // no audio
     {
@@ -2482,6 +3566,7 @@ int close_video_thread(FFReader *video, bool force)
     }
     FFVideoDecodeThread *decoder = it->second;
     decoder->EXIT(force);
+    detach_source(decoder, force);
     // if force, will return quickly without freeing resources
     if (!force)
     {
@@ -7,7 +7,11 @@
 #include <string>
 #include <vector>
 #include "safequeue.h"
+#include "framepool.h"
+#include "audioring.h"
+#include "rawpipe.h"
 #include "3rd/shmqueue/shm_queue.h"
+#include "shmwait.h"
 extern "C"
 {
 #include <libavcodec/avcodec.h>
@@ -19,6 +23,16 @@ extern "C"
 }
 
 
+// How much of a video is decoded, for materials shown much smaller than their source
+enum DecodeReduce
+{
+    DR_AUTO,     // picked by open_video_reader() from the display size against the source size
+    DR_FULL,     // every frame at full resolution
+    DR_FAST,     // skip the loop filter and exact idct of b-frames, artifacts are hidden by downscaling
+    DR_LOWRES,   // decode at 1/2, 1/4 or 1/8 of the resolution if the codec supports lowres, and DR_FAST
+    DR_KEYFRAME, // key frames only, each shown until the next one, for thumbnail-sized layers
+};
+
 struct FFReader
 {
     std::string filename;
@@ -38,6 +52,7 @@ struct FFReader
 
     int width, height; // original size
     int disp_width, disp_height; // display size
+    int disp_linesize; // bytes per row of packed rgb frames read, padded for sws_scale(), 0 if rows are not padded
     int colorSpace, colorRange;
     bool decode_video;
     bool decode_audio;
@@ -53,7 +68,15 @@ struct FFReader
     double video_pts_time;
     double audio_pts_time;
     std::atomic_bool audio_adjusted; // only adjust for first frame
-    std::vector<std::vector<unsigned char>> buffers;
+    std::vector<FrameBuffer> buffers; // decoded frames not read yet, pooled
+    bool lazy_convert; // keep decoded frames in yuv and convert them only when read, see start_video_decoder_thread()
+    std::vector<AVFrame*> decoded; // decoded frames not read yet in lazy_convert mode
+    int codec_threads; // threads of the codecs, set by start_video_decoder_thread(), 0 for the budget of --decode_threads
+    DecodeReduce decode_reduce; // DR_FULL unless set before opening
+    bool keyframe_only; // DR_KEYFRAME is in effect
+    double key_pts_time; // pts time of the last key frame in keyframe_only mode
+    AVFrame *key_decoded; // the last key frame in keyframe_only mode, if lazy_convert, see key_frame_repeats()
+    FrameBuffer key_frame; // the same converted, if not lazy_convert
 
     AVPixelFormat pix_fmt, out_pix_fmt;
     int framesize;
@@ -61,13 +84,13 @@ struct FFReader
     AVSampleFormat aud_samplefmt;
     int aud_channel;
     int64_t aud_bitrate;
-    int audio_size;
     int product_id; // latest product id in rawAudio
     std::atomic_int32_t update_time; // timestamp for last packet arrival
     std::vector<unsigned char> rawBuffer;
-    std::vector<unsigned char> rawAudio;
-    FILE *fraw;
+    AudioRing rawAudio; // decoded or raw pcm not read yet
+    RawPipe *fraw; // raw input of a file, a fifo or stdin
     struct shm_queue *fshm;
+    ShmWaiter *shmWait; // waits for the elements of fshm
 };
 
 // Open a video file for reading, and scale to widthxheight if non zero
@@ -129,8 +152,15 @@ enum CacheMode {
     AV_SEPARATE,  // for normal video, read video and audio separately, both frame by frame
     AV_STREAMING, // for network streaming, read available video frame with equal length audio
 };
+// In AV_STREAMING mode, decoded frames are queued in yuv and converted only when read (lazy_convert),
+// unless enable_lazy_convert is 0
 int start_video_decoder_thread(FFReader *video, CacheMode mode, int floor);
 int stop_video_decoder_thread(FFReader *video, CacheMode mode, int floor);
+// Keep the reader opened and its first frames decoded while not read, e.g. a material of a product
+// likely to be switched to, start_video_decoder_thread() then reads them at once
+int standby_video_decoder_thread(FFReader *video, CacheMode mode, int floor);
+// estimated bytes held by a reader on standby
+int64_t standby_video_bytes(FFReader *video);
 
 // Read video data, includeing video frame and corresponding audio data, should be started with AV_TOGETHER mode
 int read_thread_merge_data(FFReader *video, std::vector<unsigned char> &vdata, std::vector<unsigned char> &adata, int &product_id, int timeout_sec);
@@ -145,6 +175,9 @@ int read_thread_separate_audio_frame(FFReader *video, std::vector<unsigned char>
 
 // Read thread streaming data, should be started with AV_STREAMING mode
 int read_thread_stream_video_frame(FFReader *video, std::vector<unsigned char> **buffer);
+// Drop the next video frame without converting it, it is still shown if no newer frame arrives before
+// the next read_thread_stream_video_frame(). Return 1 if a frame is dropped, 0 if none is available
+int read_thread_stream_skip_frame(FFReader *video);
 // Read audio data of up to max_length size, read all in buffer if max_length == 0
 int read_thread_stream_audio_frame(FFReader *video, std::vector<unsigned char> &buffer, int &product_id, int max_length);
 
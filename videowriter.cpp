@@ -67,16 +67,15 @@ void FFVideoEncodeThread::RUN()
                 writer = NULL;
                 pipe_cmd.clear();
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            videoBuffers.Wait(100); // woken by START/EXIT
             continue;
         }
         if (bExit && videoBuffers.Size()==0)
             break;
-        if (!videoBuffers.PopMove(buf, 100)) // empty
+        if (!videoBuffers.PopMove(buf, 100)) // empty, PopMove() has waited for a push
         {
             if (bExit) // exit only when queue is empty
                 break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
             continue;
         }
 
@@ -125,12 +124,24 @@ int FFVideoEncodeThread::Write(const unsigned char *data, int length, int type)
     }
     memcpy(buf.data()+offset, data, length);
     // last = buf;
-    videoBuffers.PushMove(std::move(buf));
+    // a full ring means the encoder or its output pipe is stalled, wait for it no longer than
+    // the 10ms below, then drop the frame, rendering must go on either way
+    if (!videoBuffers.TryPushMove(std::move(buf)))
+    {
+        videoBuffers.WaitBelow(ENCODE_QUEUE_LOW, 10);
+        if (!videoBuffers.TryPushMove(std::move(buf)))
+        {
+            if (dropped++ % 100 == 0)
+                LOG_ERROR("Warning: encode queue is full, %llu %s frames dropped so far", (unsigned long long)dropped, s.c_str());
+            return -1;
+        }
+    }
 
-    // we are going to fast, get some sleep
-    if (videoBuffers.Size() > 10)
+    // we are going too fast, wait until the encoder drains the queue to the low watermark,
+    // but no longer than before, so that a stalled encoder does not stall rendering
+    if (videoBuffers.Size() > ENCODE_QUEUE_HIGH)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        videoBuffers.WaitBelow(ENCODE_QUEUE_LOW, 10);
     }
     return 0;
 }
@@ -149,7 +160,7 @@ void FFAudioEncodeThread::RUN()
             }
             if (bExit) // exit
                 break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            audioBuffers.Wait(100); // woken by START/EXIT
             continue;
         }
         if (writer < 0)
@@ -183,8 +194,7 @@ void FFAudioEncodeThread::RUN()
                 writer = -1;
                 break;
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            continue;
+            continue; // PopMove() has waited for a push
         }
         int ret = write(writer, buf.data(), buf.size());
         if(ret < 0)
@@ -206,11 +216,19 @@ void FFSubtitleEncodeThread::RUN()
 
     while (true)
     {
-        if (bStopped || skip_subtitle || finishedBuffers.Size() >= 5)
+        if (bStopped || skip_subtitle)
         {
             if (bExit) // exit only when queue is empty
                 break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            finishedBuffers.Wait(100); // woken by EXIT
+            continue;
+        }
+        if (finishedBuffers.Size() >= SUBTITLE_QUEUE_HIGH)
+        {
+            if (bExit)
+                break;
+            // rendered ahead enough, resume when Read() takes the queue down to the low watermark
+            finishedBuffers.WaitBelow(SUBTITLE_QUEUE_LOW, 100);
             continue;
         }
 
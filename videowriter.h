@@ -9,13 +9,21 @@
 #include <thread>
 #include <opencv2/opencv.hpp>
 #include "safequeue.h"
+#include "spscqueue.h"
 
 #define MIN_SUBTITLE_WIDTH 100
 
+// watermarks of encoding queues, a producer above high waits until the queue drains to low
+#define ENCODE_QUEUE_HIGH   10
+#define ENCODE_QUEUE_LOW    5
+#define ENCODE_QUEUE_CAPACITY 64 // slots of the ring, Write() drops frames after 10ms when it is full
+#define SUBTITLE_QUEUE_HIGH 5
+#define SUBTITLE_QUEUE_LOW  3
+
 class FFVideoEncodeThread
 {
 public:
-    FFVideoEncodeThread() : bExit(true), bStopped(true), writer(NULL), runner(NULL), pipe_cmd(), sendnum(0)
+    FFVideoEncodeThread() : bExit(true), bStopped(true), videoBuffers(ENCODE_QUEUE_CAPACITY), writer(NULL), runner(NULL), pipe_cmd(), sendnum(0), dropped(0)
     {
     }
     ~FFVideoEncodeThread()
@@ -34,7 +42,7 @@ public:
         videoBuffers.Abort();
         if(force)
         {
-            videoBuffers.Clear();
+            videoBuffers.Flush();
         }
     }
     void START(FILE *fd)
@@ -63,8 +71,9 @@ public:
     void EXIT(bool force = false)
     {
         bExit.store(true);
+        videoBuffers.Wake();
         if (force)
-            videoBuffers.Clear();
+            videoBuffers.Flush();
         if (runner)
         {
             if (force)
@@ -84,11 +93,12 @@ public:
     }
 public:
     std::atomic_bool bStopped, bExit;
-    SafeQueue<std::vector<unsigned char>> videoBuffers;
+    SpscQueue<std::vector<unsigned char>> videoBuffers; // filled by Write(), read by RUN()
     FILE *writer;
     std::thread *runner;
     std::string pipe_cmd;
     int64_t sendnum;
+    uint64_t dropped; // frames dropped by Write() on a full ring
     void *audio_starter;
     std::string audio_fifo;
 };
@@ -131,6 +141,7 @@ public:
     void EXIT(bool force = false)
     {
         bExit.store(true);
+        audioBuffers.Wake();
         if (force && runner)
         {
             audioBuffers.Clear();
@@ -219,8 +230,8 @@ public:
 
     void EXIT(bool force = false)
     {
-        finishedBuffers.Clear(); 
         bExit.store(true);
+        finishedBuffers.Clear(); // wakes RUN() waiting for room
         // if(runner->joinable())
         // {
         //     runner->join();